@@ -5,30 +5,57 @@ DAXA_DECL_PUSH_CONSTANT(DrawPush, push)
 #if defined(DRAW_VERT)
 
 layout(location = 0) out f32vec4 v_col;
+layout(location = 1) flat out f32 v_lmap_layer;
 void main() {
     DrawVertex vert = VERTICES(gl_VertexIndex);
-    gl_Position = INPUT.mvp_mat * f32vec4(-(vert.pos + push.offset), 1.0);
+    gl_Position = INPUT.mvp_mat * f32vec4(-(vert.pos + DRAW.offset), 1.0);
     v_col = f32vec4(vert.uv0, vert.uv1);
+    v_lmap_layer = vert.lmap_layer;
 }
 
 #elif defined(DRAW_FRAG)
 
 layout(location = 0) in f32vec4 v_col;
+layout(location = 1) flat in f32 v_lmap_layer;
 layout(location = 0) out f32vec4 color;
+// One of these is defined per pipeline variant, see App::create_draw_pipeline
+// DRAW_MODE_TEXTURED_LIGHTMAP (default), DRAW_MODE_TEXTURE_ONLY, DRAW_MODE_LIGHTMAP_ONLY, DRAW_MODE_UV_DEBUG, DRAW_MODE_ALPHA_TESTED
 void main() {
+    DrawData draw = DRAW;
     f32vec2 uv0 = v_col.xy;
     f32vec2 uv1 = v_col.zw;
 
-    if (push.image_sampler0.value == 0) {
-        color = f32vec4(uv0, uv1);
-    } else {
-        f32vec4 tex0_col = texture(daxa_sampler2D(push.image_id0, push.image_sampler0), uv0);
-        f32vec4 tex1_col = texture(daxa_sampler2D(push.image_id1, push.image_sampler1), uv1);
+#if defined(DRAW_MODE_UV_DEBUG)
+    color = f32vec4(uv0, uv1);
+#elif defined(DRAW_MODE_TEXTURE_ONLY)
+    f32vec4 tex0_col = texture(daxa_sampler2D(draw.image_id0, draw.image_sampler0), uv0);
+    color = f32vec4(tex0_col.rgb, 1);
+#elif defined(DRAW_MODE_LIGHTMAP_ONLY)
+    f32vec4 tex1_col = texture(daxa_sampler2DArray(draw.image_id1, draw.image_sampler1), f32vec3(uv1, v_lmap_layer));
+    color = f32vec4(tex1_col.rgb, 1);
+#else
+    f32vec4 tex0_col = texture(daxa_sampler2D(draw.image_id0, draw.image_sampler0), uv0);
+#if defined(DRAW_MODE_ALPHA_TESTED)
+    if (tex0_col.a < 0.5)
+        discard;
+#endif
+    f32vec4 tex1_col = texture(daxa_sampler2DArray(draw.image_id1, draw.image_sampler1), f32vec3(uv1, v_lmap_layer));
+    color = f32vec4(tex0_col.rgb * tex1_col.rgb, 1);
+#endif
+}
+
+#elif defined(VIS_FRAG)
 
-        color = f32vec4(tex0_col.rgb * tex1_col.rgb, 1);
-        // color = f32vec4(tex0_col.rgb, 1);
-        // color = f32vec4(tex1_col.rgb, 1);
-    }
+// Visibility buffer variant, only records what covers the pixel. Shading happens in visbuffer.glsl.
+layout(location = 0) in f32vec4 v_col;
+layout(location = 0) out u32vec2 vis;
+void main() {
+#if defined(DRAW_MODE_ALPHA_TESTED)
+    DrawData draw = DRAW;
+    if (texture(daxa_sampler2D(draw.image_id0, draw.image_sampler0), v_col.xy).a < 0.5)
+        discard;
+#endif
+    vis = u32vec2(push.draw_index + 1, gl_PrimitiveID);
 }
 
 #endif
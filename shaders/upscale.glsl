@@ -0,0 +1,170 @@
+#include <shared/shared.inl>
+
+DAXA_DECL_PUSH_CONSTANT(UpscalePush, push)
+
+// Spatial upscaler modelled on AMD FidelityFX Super Resolution 1.0.
+// UPSCALE_EASU: edge adaptive upsampling from the rendered sub-rect to the output size.
+// UPSCALE_RCAS: robust contrast adaptive sharpening of the upsampled image.
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+f32vec3 load_src(i32vec2 p) {
+    p = clamp(p, i32vec2(0), i32vec2(push.src_size) - 1);
+    return texelFetch(daxa_sampler2D(push.src_image, push.src_sampler), p, 0).rgb;
+}
+
+f32 luma(f32vec3 c) {
+    return c.b * 0.5 + (c.r * 0.5 + c.g);
+}
+
+#if defined(UPSCALE_EASU)
+
+// Accumulates the edge direction and length of one of the 4 bilinear corners,
+//    a
+//  b c d
+//    e
+void easu_set(inout f32vec2 dir, inout f32 len, f32 w, f32 la, f32 lb, f32 lc, f32 ld, f32 le) {
+    f32 dc = ld - lc;
+    f32 cb = lc - lb;
+    f32 len_x = max(abs(dc), abs(cb));
+    len_x = len_x > 0.0 ? 1.0 / len_x : 0.0;
+    f32 dir_x = ld - lb;
+    len_x = clamp(abs(dir_x) * len_x, 0.0, 1.0);
+    len_x *= len_x;
+
+    f32 ec = le - lc;
+    f32 ca = lc - la;
+    f32 len_y = max(abs(ec), abs(ca));
+    len_y = len_y > 0.0 ? 1.0 / len_y : 0.0;
+    f32 dir_y = le - la;
+    len_y = clamp(abs(dir_y) * len_y, 0.0, 1.0);
+    len_y *= len_y;
+
+    dir += f32vec2(dir_x, dir_y) * w;
+    len += (len_x + len_y) * w;
+}
+
+void easu_tap(inout f32vec3 acc_col, inout f32 acc_w, f32vec2 off, f32vec2 dir, f32vec2 len2, f32 lob, f32 clp, f32vec3 col) {
+    f32vec2 v = f32vec2(off.x * dir.x + off.y * dir.y, off.x * -dir.y + off.y * dir.x) * len2;
+    f32 d2 = min(dot(v, v), clp);
+    // Approximation of lanczos2 without sin() or rcp(), windowed by lob
+    f32 wb = 2.0 / 5.0 * d2 - 1.0;
+    f32 wa = lob * d2 - 1.0;
+    wb *= wb;
+    wa *= wa;
+    wb = 25.0 / 16.0 * wb - (25.0 / 16.0 - 1.0);
+    f32 w = wb * wa;
+    acc_col += col * w;
+    acc_w += w;
+}
+
+void main() {
+    u32vec2 gid = gl_GlobalInvocationID.xy;
+    if (any(greaterThanEqual(gid, push.dst_size)))
+        return;
+
+    f32vec2 pp = (f32vec2(gid) + 0.5) * f32vec2(push.src_size) / f32vec2(push.dst_size) - 0.5;
+    f32vec2 fp = floor(pp);
+    pp -= fp;
+    i32vec2 ip = i32vec2(fp);
+
+    // 12-tap kernel
+    //    b c
+    //  e f g h
+    //  i j k l
+    //    n o
+    f32vec3 b = load_src(ip + i32vec2(0, -1));
+    f32vec3 c = load_src(ip + i32vec2(1, -1));
+    f32vec3 e = load_src(ip + i32vec2(-1, 0));
+    f32vec3 f = load_src(ip + i32vec2(0, 0));
+    f32vec3 g = load_src(ip + i32vec2(1, 0));
+    f32vec3 h = load_src(ip + i32vec2(2, 0));
+    f32vec3 i = load_src(ip + i32vec2(-1, 1));
+    f32vec3 j = load_src(ip + i32vec2(0, 1));
+    f32vec3 k = load_src(ip + i32vec2(1, 1));
+    f32vec3 l = load_src(ip + i32vec2(2, 1));
+    f32vec3 n = load_src(ip + i32vec2(0, 2));
+    f32vec3 o = load_src(ip + i32vec2(1, 2));
+
+    f32 bl = luma(b), cl = luma(c), el = luma(e), fl = luma(f), gl = luma(g), hl = luma(h);
+    f32 il = luma(i), jl = luma(j), kl = luma(k), ll = luma(l), nl = luma(n), ol = luma(o);
+
+    f32vec2 dir = f32vec2(0);
+    f32 len = 0;
+    easu_set(dir, len, (1.0 - pp.x) * (1.0 - pp.y), bl, el, fl, gl, jl);
+    easu_set(dir, len, pp.x * (1.0 - pp.y), cl, fl, gl, hl, kl);
+    easu_set(dir, len, (1.0 - pp.x) * pp.y, fl, il, jl, kl, nl);
+    easu_set(dir, len, pp.x * pp.y, gl, jl, kl, ll, ol);
+
+    f32 dir_r = dot(dir, dir);
+    if (dir_r < 1.0 / 32768.0) {
+        dir = f32vec2(1, 0);
+    } else {
+        dir *= inversesqrt(dir_r);
+    }
+
+    len = len * 0.5;
+    len *= len;
+    // Stretch the kernel along the edge, and shrink it across it
+    f32 stretch = dot(dir, dir) / max(abs(dir.x), abs(dir.y));
+    f32vec2 len2 = f32vec2(1.0 + (stretch - 1.0) * len, 1.0 - 0.5 * len);
+    f32 lob = 0.5 + ((1.0 / 4.0 - 0.04) - 0.5) * len;
+    f32 clp = 1.0 / lob;
+
+    f32vec3 acc_col = f32vec3(0);
+    f32 acc_w = 0;
+    easu_tap(acc_col, acc_w, f32vec2(0, -1) - pp, dir, len2, lob, clp, b);
+    easu_tap(acc_col, acc_w, f32vec2(1, -1) - pp, dir, len2, lob, clp, c);
+    easu_tap(acc_col, acc_w, f32vec2(-1, 1) - pp, dir, len2, lob, clp, i);
+    easu_tap(acc_col, acc_w, f32vec2(0, 1) - pp, dir, len2, lob, clp, j);
+    easu_tap(acc_col, acc_w, f32vec2(0, 0) - pp, dir, len2, lob, clp, f);
+    easu_tap(acc_col, acc_w, f32vec2(-1, 0) - pp, dir, len2, lob, clp, e);
+    easu_tap(acc_col, acc_w, f32vec2(1, 1) - pp, dir, len2, lob, clp, k);
+    easu_tap(acc_col, acc_w, f32vec2(2, 1) - pp, dir, len2, lob, clp, l);
+    easu_tap(acc_col, acc_w, f32vec2(2, 0) - pp, dir, len2, lob, clp, h);
+    easu_tap(acc_col, acc_w, f32vec2(1, 0) - pp, dir, len2, lob, clp, g);
+    easu_tap(acc_col, acc_w, f32vec2(1, 2) - pp, dir, len2, lob, clp, o);
+    easu_tap(acc_col, acc_w, f32vec2(0, 2) - pp, dir, len2, lob, clp, n);
+
+    // Clamp to the local 2x2 neighbourhood to remove ringing
+    f32vec3 min4 = min(min(f, g), min(j, k));
+    f32vec3 max4 = max(max(f, g), max(j, k));
+    f32vec3 col = clamp(acc_col / acc_w, min4, max4);
+
+    imageStore(push.dst_image, i32vec2(gid), f32vec4(col, 1));
+}
+
+#elif defined(UPSCALE_RCAS)
+
+// Limits the negative lobe so the filter cannot amplify noise into ringing
+#define RCAS_LIMIT (0.25 - (1.0 / 16.0))
+
+void main() {
+    u32vec2 gid = gl_GlobalInvocationID.xy;
+    if (any(greaterThanEqual(gid, push.dst_size)))
+        return;
+
+    //    b
+    //  d e f
+    //    h
+    i32vec2 p = i32vec2(gid);
+    f32vec3 b = load_src(p + i32vec2(0, -1));
+    f32vec3 d = load_src(p + i32vec2(-1, 0));
+    f32vec3 e = load_src(p);
+    f32vec3 f = load_src(p + i32vec2(1, 0));
+    f32vec3 h = load_src(p + i32vec2(0, 1));
+
+    f32vec3 mn4 = min(min(b, d), min(f, h));
+    f32vec3 mx4 = max(max(b, d), max(f, h));
+
+    f32vec3 hit_min = min(mn4, e) / (4.0 * mx4 + 1.0 / 1024.0);
+    f32vec3 hit_max = (1.0 - max(mx4, e)) / (4.0 * mn4 - 4.0 - 1.0 / 1024.0);
+    f32vec3 lobe_rgb = max(-hit_min, hit_max);
+    f32 lobe = max(-RCAS_LIMIT, min(max(lobe_rgb.r, max(lobe_rgb.g, lobe_rgb.b)), 0.0)) * push.sharpness;
+
+    f32vec3 col = (lobe * (b + d + f + h) + e) / (4.0 * lobe + 1.0);
+
+    imageStore(push.dst_image, i32vec2(gid), f32vec4(col, 1));
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include <shared/shared.inl>
+
+DAXA_DECL_PUSH_CONSTANT(VisResolvePush, push)
+
+// Shades the visibility buffer written by draw.glsl (VIS_FRAG) once per pixel.
+// Each texel holds (draw index + 1, triangle index), 0 meaning nothing was drawn.
+// The triangle is fetched and re-projected here, and the barycentrics along with their
+// screen space derivatives are rebuilt so texture sampling keeps its mip selection.
+// One of the DRAW_MODE_* defines is set per pipeline variant, like the forward path.
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+struct Barycentrics {
+    f32vec3 lambda;
+    f32vec3 ddx;
+    f32vec3 ddy;
+};
+
+// Perspective correct barycentrics of `pixel_ndc` and their change over one pixel in x and y
+Barycentrics calc_barycentrics(f32vec4 pt0, f32vec4 pt1, f32vec4 pt2, f32vec2 pixel_ndc, f32vec2 size) {
+    Barycentrics result;
+    f32vec3 inv_w = 1.0 / f32vec3(pt0.w, pt1.w, pt2.w);
+    f32vec2 ndc0 = pt0.xy * inv_w.x;
+    f32vec2 ndc1 = pt1.xy * inv_w.y;
+    f32vec2 ndc2 = pt2.xy * inv_w.z;
+
+    f32 inv_det = 1.0 / determinant(f32mat2x2(ndc2 - ndc1, ndc0 - ndc1));
+    result.ddx = f32vec3(ndc1.y - ndc2.y, ndc2.y - ndc0.y, ndc0.y - ndc1.y) * inv_det * inv_w;
+    result.ddy = f32vec3(ndc2.x - ndc1.x, ndc0.x - ndc2.x, ndc1.x - ndc0.x) * inv_det * inv_w;
+    f32 ddx_sum = dot(result.ddx, f32vec3(1));
+    f32 ddy_sum = dot(result.ddy, f32vec3(1));
+
+    f32vec2 delta = pixel_ndc - ndc0;
+    f32 interp_inv_w = inv_w.x + delta.x * ddx_sum + delta.y * ddy_sum;
+    f32 interp_w = 1.0 / interp_inv_w;
+    result.lambda = interp_w * (f32vec3(inv_w.x, 0, 0) + delta.x * result.ddx + delta.y * result.ddy);
+
+    // From per NDC unit to per pixel
+    result.ddx *= 2.0 / size.x;
+    result.ddy *= 2.0 / size.y;
+    ddx_sum *= 2.0 / size.x;
+    ddy_sum *= 2.0 / size.y;
+    f32 interp_w_ddx = 1.0 / (interp_inv_w + ddx_sum);
+    f32 interp_w_ddy = 1.0 / (interp_inv_w + ddy_sum);
+    result.ddx = interp_w_ddx * (result.lambda * interp_inv_w + result.ddx) - result.lambda;
+    result.ddy = interp_w_ddy * (result.lambda * interp_inv_w + result.ddy) - result.lambda;
+    return result;
+}
+
+f32vec2 interpolate(Barycentrics b, f32vec2 a0, f32vec2 a1, f32vec2 a2) {
+    return b.lambda.x * a0 + b.lambda.y * a1 + b.lambda.z * a2;
+}
+f32vec2 interpolate_ddx(Barycentrics b, f32vec2 a0, f32vec2 a1, f32vec2 a2) {
+    return b.ddx.x * a0 + b.ddx.y * a1 + b.ddx.z * a2;
+}
+f32vec2 interpolate_ddy(Barycentrics b, f32vec2 a0, f32vec2 a1, f32vec2 a2) {
+    return b.ddy.x * a0 + b.ddy.y * a1 + b.ddy.z * a2;
+}
+
+void main() {
+    u32vec2 pixel = gl_GlobalInvocationID.xy;
+    if (any(greaterThanEqual(pixel, push.render_size)))
+        return;
+
+    u32vec2 vis = imageLoad(push.vis_image, i32vec2(pixel)).xy;
+    if (vis.x == 0) {
+        imageStore(push.dst_image, i32vec2(pixel), push.clear_color);
+        return;
+    }
+
+    DrawData draw = deref(push.draws[vis.x - 1]);
+    DrawVertex v0 = deref(draw.vertices[vis.y * 3 + 0]);
+    DrawVertex v1 = deref(draw.vertices[vis.y * 3 + 1]);
+    DrawVertex v2 = deref(draw.vertices[vis.y * 3 + 2]);
+
+    // Must match the vertex shader in draw.glsl
+    f32mat4x4 mvp_mat = deref(push.gpu_input).mvp_mat;
+    f32vec4 pt0 = mvp_mat * f32vec4(-(v0.pos + draw.offset), 1.0);
+    f32vec4 pt1 = mvp_mat * f32vec4(-(v1.pos + draw.offset), 1.0);
+    f32vec4 pt2 = mvp_mat * f32vec4(-(v2.pos + draw.offset), 1.0);
+
+    f32vec2 size = f32vec2(push.render_size);
+    f32vec2 pixel_ndc = (f32vec2(pixel) + 0.5) / size * 2.0 - 1.0;
+    Barycentrics b = calc_barycentrics(pt0, pt1, pt2, pixel_ndc, size);
+
+    f32vec2 uv0 = interpolate(b, v0.uv0, v1.uv0, v2.uv0);
+    f32vec2 uv1 = interpolate(b, v0.uv1, v1.uv1, v2.uv1);
+
+    f32vec4 color;
+#if defined(DRAW_MODE_UV_DEBUG)
+    color = f32vec4(uv0, uv1);
+#else
+#if !defined(DRAW_MODE_LIGHTMAP_ONLY)
+    f32vec2 uv0_ddx = interpolate_ddx(b, v0.uv0, v1.uv0, v2.uv0);
+    f32vec2 uv0_ddy = interpolate_ddy(b, v0.uv0, v1.uv0, v2.uv0);
+    f32vec4 tex0_col = textureGrad(daxa_sampler2D(draw.image_id0, draw.image_sampler0), uv0, uv0_ddx, uv0_ddy);
+#endif
+#if !defined(DRAW_MODE_TEXTURE_ONLY)
+    f32vec2 uv1_ddx = interpolate_ddx(b, v0.uv1, v1.uv1, v2.uv1);
+    f32vec2 uv1_ddy = interpolate_ddy(b, v0.uv1, v1.uv1, v2.uv1);
+    f32vec4 tex1_col = textureGrad(daxa_sampler2DArray(draw.image_id1, draw.image_sampler1), f32vec3(uv1, v0.lmap_layer), uv1_ddx, uv1_ddy);
+#endif
+#if defined(DRAW_MODE_TEXTURE_ONLY)
+    color = f32vec4(tex0_col.rgb, 1);
+#elif defined(DRAW_MODE_LIGHTMAP_ONLY)
+    color = f32vec4(tex1_col.rgb, 1);
+#else
+    color = f32vec4(tex0_col.rgb * tex1_col.rgb, 1);
+#endif
+#endif
+
+    imageStore(push.dst_image, i32vec2(pixel), color);
+}
@@ -8,6 +8,7 @@ struct DrawVertex {
     f32vec3 pos;
     f32vec2 uv0;
     f32vec2 uv1;
+    f32 lmap_layer;
 };
 
 struct GpuInput {
@@ -17,8 +18,8 @@ struct GpuInput {
 DAXA_DECL_BUFFER_PTR(DrawVertex)
 DAXA_DECL_BUFFER_PTR(GpuInput)
 
-struct DrawPush {
-    daxa_BufferPtr(GpuInput) gpu_input;
+// One entry per draw, written by the CPU into the draw list of the frame being recorded
+struct DrawData {
     daxa_BufferPtr(DrawVertex) vertices;
     daxa_ImageViewId image_id0;
     daxa_ImageViewId image_id1;
@@ -26,6 +27,32 @@ struct DrawPush {
     daxa_SamplerId image_sampler1;
     f32vec3 offset;
 };
+DAXA_DECL_BUFFER_PTR(DrawData)
+
+struct DrawPush {
+    daxa_BufferPtr(GpuInput) gpu_input;
+    daxa_BufferPtr(DrawData) draws;
+    u32 draw_index;
+};
+
+struct VisResolvePush {
+    daxa_BufferPtr(GpuInput) gpu_input;
+    daxa_BufferPtr(DrawData) draws;
+    daxa_RWImage2Du32 vis_image;
+    daxa_RWImage2Df32 dst_image;
+    u32vec2 render_size;
+    f32vec4 clear_color;
+};
+
+struct UpscalePush {
+    daxa_ImageViewId src_image;
+    daxa_SamplerId src_sampler;
+    daxa_RWImage2Df32 dst_image;
+    u32vec2 src_size;
+    u32vec2 dst_size;
+    f32 sharpness;
+};
 
-#define VERTICES(i) deref(push.vertices[i])
+#define DRAW deref(push.draws[push.draw_index])
+#define VERTICES(i) deref(DRAW.vertices[i])
 #define INPUT deref(push.gpu_input)
@@ -83,6 +83,32 @@ auto ConfigXML::LoadProgramConfig() -> XMLError {
     window->QueryBoolAttribute("fullscreen", &this->m_bFullscreen);
     window->QueryBoolAttribute("multisampling", &this->m_bMultisampling);
     window->QueryBoolAttribute("vsync", &this->m_bVsync);
+    window->QueryUnsignedAttribute("framesinflight", &this->m_iFramesInFlight);
+    window->QueryUnsignedAttribute("fpslimit", &this->m_iFpsLimit);
+    window->QueryBoolAttribute("ondemand", &this->m_bOnDemand);
+
+    XMLElement *streaming = rootNode->FirstChildElement("streaming");
+
+    if (streaming != nullptr) {
+        streaming->QueryBoolAttribute("enabled", &this->m_bStreaming);
+        streaming->QueryFloatAttribute("radius", &this->m_fStreamingRadius);
+        streaming->QueryUnsignedAttribute("maxmaps", &this->m_iStreamingMaxMaps);
+    }
+
+    XMLElement *memory = rootNode->FirstChildElement("memory");
+
+    if (memory != nullptr) {
+        memory->QueryUnsignedAttribute("vrambudget", &this->m_iVramBudget);
+        if (char const *cpu_geometry = memory->Attribute("cpugeometry"))
+            this->m_szCpuGeometry = cpu_geometry;
+        memory->QueryBoolAttribute("mipstreaming", &this->m_bMipStreaming);
+    }
+
+    XMLElement *loading = rootNode->FirstChildElement("loading");
+
+    if (loading != nullptr) {
+        loading->QueryBoolAttribute("prefetch", &this->m_bPrefetch);
+    }
 
     XMLElement *gamepaths = rootNode->FirstChildElement("gamepaths");
 
@@ -219,6 +245,25 @@ auto ConfigXML::WriteDefaultProgramConfig() -> XMLError {
     window->SetAttribute("fullscreen", this->m_bFullscreen);
     window->SetAttribute("multisampling", this->m_bMultisampling);
     window->SetAttribute("vsync", this->m_bVsync);
+    window->SetAttribute("framesinflight", this->m_iFramesInFlight);
+    window->SetAttribute("fpslimit", this->m_iFpsLimit);
+    window->SetAttribute("ondemand", this->m_bOnDemand);
+
+    // Map streaming settings.
+    XMLElement *streaming = this->m_xmlProgramConfig.NewElement("streaming");
+    streaming->SetAttribute("enabled", this->m_bStreaming);
+    streaming->SetAttribute("radius", this->m_fStreamingRadius);
+    streaming->SetAttribute("maxmaps", this->m_iStreamingMaxMaps);
+
+    // Memory limits.
+    XMLElement *memory = this->m_xmlProgramConfig.NewElement("memory");
+    memory->SetAttribute("vrambudget", this->m_iVramBudget);
+    memory->SetAttribute("cpugeometry", this->m_szCpuGeometry.c_str());
+    memory->SetAttribute("mipstreaming", this->m_bMipStreaming);
+
+    // Startup loading.
+    XMLElement *loading = this->m_xmlProgramConfig.NewElement("loading");
+    loading->SetAttribute("prefetch", this->m_bPrefetch);
 
     // Collection of game paths.
     XMLElement *gamepaths = this->m_xmlProgramConfig.NewElement("gamepaths");
@@ -235,6 +280,9 @@ auto ConfigXML::WriteDefaultProgramConfig() -> XMLError {
     // Add elements to the document.
     this->m_xmlProgramConfig.InsertFirstChild(rootNode);
     rootNode->InsertFirstChild(window);
+    rootNode->InsertEndChild(streaming);
+    rootNode->InsertEndChild(memory);
+    rootNode->InsertEndChild(loading);
     rootNode->InsertEndChild(gamepaths);
     gamepaths->InsertFirstChild(hlgamepath);
     gamepaths->InsertEndChild(csgamepath);
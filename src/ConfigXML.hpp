@@ -105,6 +105,16 @@ class ConfigXML {
     bool m_bFullscreen{false};              /** Fullscreen or Windowed mode. */
     bool m_bMultisampling{false};           /** Enable or disable multisampling. */
     bool m_bVsync{true};                    /** Enable or disable Vsync. */
+    unsigned int m_iFramesInFlight{2};      /** Frames the CPU may record ahead of the GPU (2-3). */
+    unsigned int m_iFpsLimit{0};            /** Frame rate cap, 0 for uncapped. */
+    bool m_bOnDemand{false};                /** Only render when input or settings changed the frame. */
+    bool m_bStreaming{false};               /** Load and unload maps around the camera instead of all up front. */
+    float m_fStreamingRadius{4096.0f};      /** Distance from the camera within which maps are kept loaded. */
+    unsigned int m_iStreamingMaxMaps{16};   /** Most maps loaded at once while streaming. */
+    unsigned int m_iVramBudget{0};          /** MiB of map geometry, textures and lightmaps kept in VRAM, 0 for no limit. */
+    std::string m_szCpuGeometry{"keep"};    /** What happens to map triangles once uploaded: "keep", "drop" or "spill" to a temp file. */
+    bool m_bMipStreaming{true};             /** Upload the texture mips the camera is close enough to need, instead of all of them. */
+    bool m_bPrefetch{true};                 /** Read the WADs and maps ahead of their loaders at startup. */
     std::vector<std::string> m_szGamePaths; /** Locations of the game files. */
     // Map config.
     std::vector<ChapterEntry> m_vChapterEntries; /** Vector of chapters, containing maps. */
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "common.hpp"
+#include "texture_registry.hpp"
+
+#include <mutex>
+
+// Assets and entity data shared between the loaded maps. Owned by the app and handed to every loader,
+// so maps can be loaded from several threads and unloaded again.
+struct AssetRegistry {
+    TextureRegistry textures;
+
+    // Tables filled from map entities. Each is only touched with `entity_mutex` held.
+    std::mutex entity_mutex;
+    // Landmark name -> positions of that landmark in each map that has a changelevel to it
+    std::map<std::string, std::vector<std::pair<VERTEX, std::string>>> landmarks;
+    // Brush models (triggers, trains, ...) whose faces are not drawn, per map
+    std::map<std::string, std::vector<std::string>> dontRenderModel;
+    // Placement of each map, derived from the landmarks it shares with maps placed before it
+    std::map<std::string, VERTEX> offsets;
+    // Patterns of the switchable light styles (32 and up), per map
+    std::map<std::string, std::map<int, std::string>> lightstyles;
+};
@@ -2,7 +2,13 @@
 #include "bsp.hpp"
 #include "entities.hpp"
 #include "ConfigXML.hpp"
+#include "lightmap_packer.hpp"
+#include "face_builder.hpp"
 #include <cstring>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <limits>
 
 #include <png.h>
 #include <assimp/scene.h>
@@ -43,13 +49,10 @@ struct AssetExporter {
     }
 };
 
-std::map<std::string, BSP_TEXTURE> textures;
-std::map<std::string, std::vector<std::pair<VERTEX, std::string>>> landmarks;
-std::map<std::string, std::vector<std::string>> dontRenderModel;
-std::map<std::string, VERTEX> offsets;
-
 static AssetExporter exporter;
 
+std::mutex gpu_queue_mutex;
+
 // Correct UV coordinates
 static inline auto calcCoords(VERTEX v, VERTEX vs, VERTEX vt, float sShift, float tShift) -> COORDS {
     COORDS ret{};
@@ -58,6 +61,130 @@ static inline auto calcCoords(VERTEX v, VERTEX vs, VERTEX vt, float sShift, floa
     return ret;
 }
 
+// Copies a whole lump of `T`s into the load arena, as the file's bytes may not be aligned for them.
+// A lump reaching past the end of the file is cut short.
+template <typename T>
+static auto read_lump(FileView const &file, BSPLUMP const &lump, LoadArena &arena) -> std::span<T> {
+    auto const bytes = file.sub(static_cast<usize>(std::max(lump.nOffset, 0)), static_cast<usize>(std::max(lump.nLength, 0)));
+    auto const result = arena.alloc<T>(bytes.size() / sizeof(T));
+    std::memcpy(result.data(), bytes.data(), result.size_bytes());
+    return result;
+}
+
+auto read_miptex(FileView const &file, usize base, BSPMIPTEX const &bmt) -> std::optional<MiptexPixels> {
+    // The palette follows the last mip, after a 2 byte color count
+    auto const palette_offset = base + bmt.nOffsets[3] + static_cast<usize>(miptex_mip_size(bmt.nWidth, 3)) * miptex_mip_size(bmt.nHeight, 3) + 2;
+    if (file.sub(palette_offset, 256 * 3).size() != 256 * 3)
+        return std::nullopt;
+    auto result = MiptexPixels{.indices = {}, .palette = file.bytes.data() + palette_offset, .w = bmt.nWidth, .h = bmt.nHeight};
+    for (u32 mip = 0; mip < MIPTEX_MIP_N; mip++) {
+        auto const mip_size = static_cast<usize>(miptex_mip_size(bmt.nWidth, mip)) * miptex_mip_size(bmt.nHeight, mip);
+        auto const indices = file.sub(base + bmt.nOffsets[mip], mip_size);
+        if (indices.size() != mip_size)
+            return std::nullopt;
+        result.indices[mip] = indices.data();
+    }
+    return result;
+}
+
+// Bounds and texel size of a batch, from which the mips it needs are estimated
+static void measure_batch(TEXSTUFF &batch, BSP_TEXTURE const &texture) {
+    if (batch.triangles.empty())
+        return;
+    auto const &first = batch.triangles[0];
+    batch.mins = batch.maxs = f32vec3{first.x, first.y, first.z};
+    auto texel_size = std::numeric_limits<f32>::infinity();
+    for (usize i = 0; i + 2 < batch.triangles.size(); i += 3) {
+        auto const &a = batch.triangles[i];
+        for (usize j = 0; j < 3; j++) {
+            auto const &v = batch.triangles[i + j];
+            batch.mins = {std::min(batch.mins.x, v.x), std::min(batch.mins.y, v.y), std::min(batch.mins.z, v.z)};
+            batch.maxs = {std::max(batch.maxs.x, v.x), std::max(batch.maxs.y, v.y), std::max(batch.maxs.z, v.z)};
+            if (j == 0)
+                continue;
+            auto const world = std::sqrt((v.x - a.x) * (v.x - a.x) + (v.y - a.y) * (v.y - a.y) + (v.z - a.z) * (v.z - a.z));
+            auto const texels = std::hypot((v.u - a.u) * static_cast<f32>(texture.w), (v.v - a.v) * static_cast<f32>(texture.h));
+            if (texels > 0.0f)
+                texel_size = std::min(texel_size, world / texels);
+        }
+    }
+    batch.texel_size = std::isfinite(texel_size) ? texel_size : 1.0f;
+}
+
+#if BENCHMARK_FACE_PROCESSING
+// The two pass face loader the FaceBuilder replaced, kept for comparison. Returns the time taken in microseconds.
+static auto legacy_process_faces(std::span<BSPFACE const> faces, std::span<VERTEX const> vertices, std::span<BSPEDGE const> edges, std::span<i32 const> surfedges,
+                                 std::span<BSPTEXTUREINFO const> btfs, std::vector<std::string> const &texNames, std::span<u8 const> face_drawn,
+                                 std::span<LMAP const> lmaps, TextureRegistry const &textures, std::map<std::string, std::vector<VECFINAL>> &texturedTris) -> f64 {
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<VERTEX> verticesPrime;
+    for (auto e : surfedges) {
+        verticesPrime.push_back(vertices[edges[e > 0 ? e : -e].iVertex[e > 0 ? 0 : 1]]);
+    }
+
+    auto minUV = std::vector<float>(faces.size() * 2);
+    auto maxUV = std::vector<float>(faces.size() * 2);
+    for (usize i = 0; i < faces.size(); i++) {
+        BSPFACE const &f = faces[i];
+        BSPTEXTUREINFO const b = btfs[f.iTextureInfo];
+        std::string const faceTexName = texNames[b.iMiptex];
+
+        minUV[i * 2] = minUV[i * 2 + 1] = 99999;
+        maxUV[i * 2] = maxUV[i * 2 + 1] = -99999;
+
+        for (int j = 2, k = 1; j < f.nEdges; j++, k++) {
+            for (auto const &v : {verticesPrime[f.iFirstEdge], verticesPrime[f.iFirstEdge + k], verticesPrime[f.iFirstEdge + j]}) {
+                COORDS const c = calcCoords(v, b.vS, b.vT, b.fSShift, b.fTShift);
+                minUV[i * 2] = std::min(minUV[i * 2], c.u);
+                minUV[i * 2 + 1] = std::min(minUV[i * 2 + 1], c.v);
+                maxUV[i * 2] = std::max(maxUV[i * 2], c.u);
+                maxUV[i * 2 + 1] = std::max(maxUV[i * 2 + 1], c.v);
+            }
+        }
+    }
+
+    for (usize i = 0; i < faces.size(); i++) {
+        BSPFACE const &f = faces[i];
+        if (!face_drawn[i]) {
+            continue;
+        }
+        BSPTEXTUREINFO const b = btfs[f.iTextureInfo];
+        std::string const faceTexName = texNames[b.iMiptex];
+
+        int const lmw = ceil(maxUV[i * 2] / 16) - floor(minUV[i * 2] / 16) + 1;
+        int const lmh = ceil(maxUV[i * 2 + 1] / 16) - floor(minUV[i * 2 + 1] / 16) + 1;
+        float const mid_poly_s = (minUV[i * 2] + maxUV[i * 2]) / 2.0f;
+        float const mid_poly_t = (minUV[i * 2 + 1] + maxUV[i * 2 + 1]) / 2.0f;
+        float const mid_tex_s = (float)lmw / 2.0f;
+        float const mid_tex_t = (float)lmh / 2.0f;
+        float const fX = lmaps[i].finalX;
+        float const fY = lmaps[i].finalY;
+        auto const fLayer = static_cast<float>(lmaps[i].page);
+        BSP_TEXTURE const t = textures[textures.find(faceTexName)];
+
+        std::vector<VECFINAL> *vt = &texturedTris[faceTexName];
+
+        for (int j = 2, k = 1; j < f.nEdges; j++, k++) {
+            for (auto v : {verticesPrime[f.iFirstEdge], verticesPrime[f.iFirstEdge + k], verticesPrime[f.iFirstEdge + j]}) {
+                COORDS c = calcCoords(v, b.vS, b.vT, b.fSShift, b.fTShift);
+                COORDS cl{};
+                cl.u = mid_tex_s + (c.u - mid_poly_s) / 16.0f;
+                cl.v = mid_tex_t + (c.v - mid_poly_t) / 16.0f;
+                cl.u += fX;
+                cl.v += fY;
+                cl.u /= LIGHTMAP_PAGE_SIZE;
+                cl.v /= LIGHTMAP_PAGE_SIZE;
+                c.u /= t.w;
+                c.v /= t.h;
+                v.fixHand();
+                vt->push_back(VECFINAL(v, c, cl, fLayer));
+            }
+        }
+    }
+    return std::chrono::duration<f64, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+#endif
+
 static int save_png(std::string filename, i32 width, i32 height, i32 bitdepth, i32 colortype, u8 *data, i32 pitch, i32 transform) {
 #if EXPORT_IMAGES
     int i = 0;
@@ -140,14 +267,17 @@ error:
 
 void BSP::export_mesh() {
 #if EXPORT_MESHES
+    if (cpu_geometry == CpuGeometry::DROP) {
+        std::cerr << "Not exporting " << mapId << ", its triangles were dropped after upload." << std::endl;
+        return;
+    }
     auto scene_node = new aiNode(mapId);
 
-    auto const mesh_n = static_cast<usize>(std::count_if(this->texturedTris.begin(), this->texturedTris.end(), [](std::pair<std::string, TEXSTUFF> const &tex) {
-        if (tex.first != "aaatrigger" && tex.first != "origin" && tex.first != "clip" && tex.first != "sky" && tex.first[0] != '{' && !tex.second.triangles.empty()) {
-            return true;
-        }
-        return false;
-    }));
+    auto const &textures = assets->textures;
+    auto const exported = [&textures](TEXSTUFF const &tex) {
+        return (textures.flags(tex.texture) & (TEXTURE_FLAG_TOOL | TEXTURE_FLAG_MASKED)) == 0 && tex.vertex_n != 0;
+    };
+    auto const mesh_n = static_cast<usize>(std::count_if(this->texturedTris.begin(), this->texturedTris.end(), exported));
 
     auto const offset_i = exporter.materials.size();
     exporter.materials.reserve(mesh_n + offset_i);
@@ -158,8 +288,10 @@ void BSP::export_mesh() {
     scene_node->mName = mapId;
 
     usize mesh_i = 0;
-    for (auto [texture_name, texture_mesh_info] : this->texturedTris) {
-        if (texture_name != "aaatrigger" && texture_name != "origin" && texture_name != "clip" && texture_name != "sky" && texture_name[0] != '{' && !texture_mesh_info.triangles.empty()) {
+    for (usize batch = 0; batch < texturedTris.size(); batch++) {
+        auto const &texture_mesh_info = texturedTris[batch];
+        if (exported(texture_mesh_info)) {
+            auto const texture_name = std::string(textures.name(texture_mesh_info.texture));
             exporter.materials.push_back(new aiMaterial());
             exporter.meshes.push_back(new aiMesh());
 
@@ -177,13 +309,14 @@ void BSP::export_mesh() {
 
             // generate mesh
             {
-                usize vert_n = texture_mesh_info.triangles.size();
+                auto const tris = triangles(batch);
+                usize vert_n = tris.size();
                 mesh.mVertices = new aiVector3D[vert_n];
                 mesh.mNumVertices = vert_n;
                 mesh.mTextureCoords[0] = new aiVector3D[vert_n];
                 mesh.mNumUVComponents[0] = vert_n;
                 usize vert_i = 0;
-                for (auto const &v : texture_mesh_info.triangles) {
+                for (auto const &v : tris) {
                     f32vec3 full_offset{offset.x + ConfigOffsetChapter.x, offset.y + ConfigOffsetChapter.y, offset.z + ConfigOffsetChapter.z};
                     auto o = full_offset + propagated_user_offset;
                     mesh.mVertices[vert_i] = aiVector3D(v.x + o.x, v.y + o.y, v.z + o.z) * 0.0254f;
@@ -209,7 +342,20 @@ void BSP::export_mesh() {
 #endif
 }
 
-void BSP_TEXTURE::load(daxa::Device &device, std::string const &tex_name, u8 *data, u32 src_channel_n, u32 dst_channel_n, u32 mip_level_count) {
+// Waits for this upload only, not for the frames the main thread has in flight
+static void submit_and_wait(daxa::Device &device, daxa::CommandList &&cmd_list) {
+    auto semaphore = device.create_timeline_semaphore({.initial_value = 0, .name = "upload_semaphore"});
+    {
+        auto const lock = std::lock_guard{gpu_queue_mutex};
+        device.submit_commands({
+            .command_lists = {std::move(cmd_list)},
+            .signal_timeline_semaphores = {{semaphore, 1}},
+        });
+    }
+    semaphore.wait_for_value(1);
+}
+
+void BSP_TEXTURE::load(daxa::Device &device, std::string const &tex_name, u8 *data, u32 src_channel_n, u32 dst_channel_n, u32 mip_level_count, u32 layer_count) {
 #if EXPORT_ASSETS
     png_byte color_type = PNG_COLOR_TYPE_RGBA;
     if (src_channel_n == 3)
@@ -219,14 +365,14 @@ void BSP_TEXTURE::load(daxa::Device &device, std::string const &tex_name, u8 *da
 
     auto sx = static_cast<u32>(w);
     auto sy = static_cast<u32>(h);
-    usize image_size = sx * sy * sizeof(u8) * dst_channel_n;
-    auto texture_staging_buffer = device.create_buffer({
+    usize image_size = sx * sy * sizeof(u8) * dst_channel_n * layer_count;
+    auto texture_staging_buffer = create_buffer(device, {
         .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
         .size = static_cast<u32>(image_size),
         .name = "texture_staging_buffer",
     });
     u8 *staging_buffer_ptr = device.get_host_address_as<u8>(texture_staging_buffer);
-    for (usize i = 0; i < sx * sy; ++i) {
+    for (usize i = 0; i < sx * sy * layer_count; ++i) {
         usize src_offset = i * src_channel_n;
         usize dst_offset = i * dst_channel_n;
         for (usize ci = 0; ci < std::min(src_channel_n, dst_channel_n); ++ci) {
@@ -249,7 +395,7 @@ void BSP_TEXTURE::load(daxa::Device &device, std::string const &tex_name, u8 *da
             .base_mip_level = 0,
             .level_count = mip_level_count,
             .base_array_layer = 0,
-            .layer_count = 1,
+            .layer_count = layer_count,
         },
         .image_id = image_id,
     });
@@ -257,6 +403,7 @@ void BSP_TEXTURE::load(daxa::Device &device, std::string const &tex_name, u8 *da
         .buffer = texture_staging_buffer,
         .image = image_id,
         .image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+        .image_slice = {.layer_count = layer_count},
         .image_offset = {0, 0, 0},
         .image_extent = {sx, sy, 1},
     });
@@ -274,505 +421,503 @@ void BSP_TEXTURE::load(daxa::Device &device, std::string const &tex_name, u8 *da
     //     .image_id = image_id,
     // });
     cmd_list.complete();
-    device.submit_commands({
-        .command_lists = {std::move(cmd_list)},
-    });
-    device.wait_idle();
+    submit_and_wait(device, std::move(cmd_list));
     device.destroy_buffer(texture_staging_buffer);
 }
 
-void upload_buffer_data(daxa::Device &device, daxa::BufferId buffer_id, u8 *data, u32 size) {
-    auto staging_buffer = device.create_buffer({
+void BSP_TEXTURE::load_levels(daxa::Device &device, [[maybe_unused]] std::string const &tex_name, u8 const *data, u32 top_mip) {
+#if EXPORT_ASSETS
+    if (top_mip == 0)
+        save_png("assets_out/" + tex_name + ".png", w, h, 8, PNG_COLOR_TYPE_RGBA, const_cast<u8 *>(data), 4 * w, PNG_TRANSFORM_IDENTITY);
+#endif
+    usize image_size = 0;
+    for (u32 mip = top_mip; mip < MIPTEX_MIP_N; mip++)
+        image_size += static_cast<usize>(miptex_mip_size(static_cast<u32>(w), mip)) * miptex_mip_size(static_cast<u32>(h), mip) * 4;
+    auto texture_staging_buffer = create_buffer(device, {
         .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
-        .size = static_cast<u32>(size),
-        .name = "staging_buffer",
+        .size = static_cast<u32>(image_size),
+        .name = "texture_staging_buffer",
     });
-    u8 *staging_buffer_ptr = device.get_host_address_as<u8>(staging_buffer);
-    std::copy(data, data + size, staging_buffer_ptr);
+    std::memcpy(device.get_host_address_as<u8>(texture_staging_buffer), data, image_size);
     auto cmd_list = device.create_command_list({
         .name = "cmd_list",
     });
     cmd_list.pipeline_barrier({
         .src_access = daxa::AccessConsts::HOST_WRITE,
-        .dst_access = daxa::AccessConsts::TRANSFER_WRITE,
+        .dst_access = daxa::AccessConsts::TRANSFER_READ,
     });
-    cmd_list.copy_buffer_to_buffer({
-        .src_buffer = staging_buffer,
-        .dst_buffer = buffer_id,
-        .size = size,
+    record_levels(cmd_list, texture_staging_buffer, 0, top_mip);
+    cmd_list.complete();
+    submit_and_wait(device, std::move(cmd_list));
+    device.destroy_buffer(texture_staging_buffer);
+}
+
+void BSP_TEXTURE::record_levels(daxa::CommandList &cmd_list, daxa::BufferId staging_buffer, usize staging_offset, u32 top_mip) const {
+    auto const level_n = MIPTEX_MIP_N - top_mip;
+    cmd_list.pipeline_barrier_image_transition({
+        .src_access = daxa::AccessConsts::HOST_WRITE,
+        .dst_access = daxa::AccessConsts::TRANSFER_WRITE,
+        .src_layout = daxa::ImageLayout::UNDEFINED,
+        .dst_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+        .image_slice = {.level_count = level_n},
+        .image_id = image_id,
     });
-    cmd_list.pipeline_barrier({
+    usize buffer_offset = staging_offset;
+    for (u32 level = 0; level < level_n; level++) {
+        auto const sx = miptex_mip_size(static_cast<u32>(w), top_mip + level);
+        auto const sy = miptex_mip_size(static_cast<u32>(h), top_mip + level);
+        cmd_list.copy_buffer_to_image({
+            .buffer = staging_buffer,
+            .buffer_offset = buffer_offset,
+            .image = image_id,
+            .image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+            .image_slice = {.mip_level = level},
+            .image_extent = {sx, sy, 1},
+        });
+        buffer_offset += static_cast<usize>(sx) * sy * 4;
+    }
+    // The authored mips are complete, so the image goes straight to sampling, by the draws or the visibility resolve
+    cmd_list.pipeline_barrier_image_transition({
         .src_access = daxa::AccessConsts::TRANSFER_WRITE,
         .dst_access = daxa::AccessConsts::READ,
+        .src_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+        .dst_layout = daxa::ImageLayout::READ_ONLY_OPTIMAL,
+        .image_slice = {.level_count = level_n},
+        .image_id = image_id,
     });
-    cmd_list.complete();
-    device.submit_commands({
-        .command_lists = {std::move(cmd_list)},
-    });
-    device.wait_idle();
-    device.destroy_buffer(staging_buffer);
 }
 
-BSP::BSP(daxa::Device &device, const std::vector<std::string> &szGamePaths, const std::string &filename, const MapEntry &sMapEntry) {
+BSP::BSP(daxa::Device &device, GameFileSystem const &files, const std::string &filename, const MapEntry &sMapEntry, AssetRegistry &assets, WorldLightmap &world_lightmap, LoadScratch &scratch)
+    : assets{&assets} {
     std::string const id = sMapEntry.m_szName;
+    auto &textures = assets.textures;
+    // Everything below that does not outlive the constructor comes from here
+    auto &arena = scratch.arena;
+    arena.reset();
 
     uint8_t gammaTable[256];
     for (int i = 0; i < 256; i++) {
         gammaTable[i] = pow(i / 255.0, 1.0 / 3.0) * 255;
     }
 
-    // Light map atlas
-    lmapAtlas = new uint8_t[1024 * 1024 * 3];
-
-    std::ifstream inBSP;
-
-    // Try to open the file from all known gamepaths.
-    for (const auto &szGamePath : szGamePaths) {
-        if (!inBSP.is_open()) {
-            inBSP.open(szGamePath + filename, std::ios::binary);
-        }
-    }
-
-    // If the BSP wasn't found in any of the gamepaths...
-    if (!inBSP.is_open()) {
+    // Served from the game directories or their PAKs
+    auto const file = files.read(filename);
+    if (!file) {
         std::cerr << "Can't open BSP " << filename << "." << std::endl;
         return;
     }
 
     // Check BSP version
-    BSPHEADER bHeader{};
-    inBSP.read((char *)&bHeader, sizeof(bHeader));
+    auto const bHeader = file->read<BSPHEADER>(0);
     if (bHeader.nVersion != 30) {
         std::cerr << "BSP version is not 30 (" << filename << ")." << std::endl;
         return;
     }
 
     // Read Entities
-    inBSP.seekg(bHeader.lump[LUMP_ENTITIES].nOffset, std::ios::beg);
-    char *bff = new char[bHeader.lump[LUMP_ENTITIES].nLength];
-    inBSP.read(bff, bHeader.lump[LUMP_ENTITIES].nLength);
-    parse_entities(bff, id, sMapEntry);
-    delete[] bff;
+    parse_entities(entity_lump(*file, bHeader), id, sMapEntry, assets);
+    auto hidden_models = std::vector<std::string>{};
+    auto switchable_styles = std::map<int, std::string>{};
+    {
+        auto const lock = std::lock_guard{assets.entity_mutex};
+        hidden_models = assets.dontRenderModel[id];
+        switchable_styles = assets.lightstyles[id];
+    }
 
     // Read Models and hide some faces
-    auto *models = new BSPMODEL[bHeader.lump[LUMP_MODELS].nLength / (int)sizeof(BSPMODEL)];
-    inBSP.seekg(bHeader.lump[LUMP_MODELS].nOffset, std::ios::beg);
-    inBSP.read((char *)models, bHeader.lump[LUMP_MODELS].nLength);
-
-    std::map<int, bool> dontRenderFace;
-    for (auto &i : dontRenderModel[id]) {
-        int const modelId = atoi(i.substr(1).c_str());
+    auto const models = read_lump<BSPMODEL>(*file, bHeader.lump[LUMP_MODELS], arena);
+    if (!models.empty())
+        model_bounds(models[0], mins, maxs);
+
+    // Read Faces
+    FaceBuilder face_builder;
+    face_builder.faces = read_lump<BSPFACE>(*file, bHeader.lump[LUMP_FACES], arena);
+    auto const face_n = face_builder.faces.size();
+
+    auto const face_drawn = arena.alloc<u8>(face_n);
+    std::fill(face_drawn.begin(), face_drawn.end(), u8{1});
+    for (auto &i : hidden_models) {
+        auto const modelId = static_cast<usize>(atoi(i.substr(1).c_str()));
+        if (modelId >= models.size())
+            continue;
         int const startingFace = models[modelId].iFirstFace;
         for (int j = 0; j < models[modelId].nFaces; j++) {
-            // if(modelId == 57) std::cout << j+startingFace << std::endl;
-            dontRenderFace[j + startingFace] = true;
+            if (static_cast<usize>(j + startingFace) < face_n)
+                face_drawn[j + startingFace] = 0;
         }
     }
 
-    // Read Vertices
-    std::vector<VERTEX> vertices;
-    inBSP.seekg(bHeader.lump[LUMP_VERTICES].nOffset, std::ios::beg);
-    for (int i = 0; i < bHeader.lump[LUMP_VERTICES].nLength / 12; i++) {
-        VERTEX v;
-        inBSP.read((char *)&v, sizeof(v));
-        vertices.push_back(v);
-    }
-
-    // Read Edges
-    auto *edges = new BSPEDGE[bHeader.lump[LUMP_EDGES].nLength / (int)sizeof(BSPEDGE)];
-    inBSP.seekg(bHeader.lump[LUMP_EDGES].nOffset, std::ios::beg);
-    inBSP.read((char *)edges, bHeader.lump[LUMP_EDGES].nLength);
-
-    // Read Surfedges
-    std::vector<VERTEX> verticesPrime;
-    inBSP.seekg(bHeader.lump[LUMP_SURFEDGES].nOffset, std::ios::beg);
-    for (int i = 0; i < bHeader.lump[LUMP_SURFEDGES].nLength / (int)sizeof(int); i++) {
-        int e = 0;
-        inBSP.read((char *)&e, sizeof(e));
-        verticesPrime.push_back(vertices[edges[e > 0 ? e : -e].iVertex[e > 0 ? 0 : 1]]);
-    }
+    // Read Vertices, Edges and Surfedges
+    auto const vertices = read_lump<VERTEX>(*file, bHeader.lump[LUMP_VERTICES], arena);
+    auto const edges = read_lump<BSPEDGE>(*file, bHeader.lump[LUMP_EDGES], arena);
+    auto const surfedges = read_lump<i32>(*file, bHeader.lump[LUMP_SURFEDGES], arena);
+    face_builder.load_vertices(arena, vertices, edges, surfedges);
 
     // Read Lightmaps
-    inBSP.seekg(bHeader.lump[LUMP_LIGHTING].nOffset, std::ios::beg);
-    int const size = bHeader.lump[LUMP_LIGHTING].nLength;
-    auto *lmap = new uint8_t[size];
-    inBSP.read((char *)lmap, size);
-    std::vector<LMAP> lmaps;
+    auto const lighting = read_lump<u8>(*file, bHeader.lump[LUMP_LIGHTING], arena);
+    auto const size = static_cast<int>(lighting.size());
+    auto *const lmap = lighting.data();
+    auto const lmaps = arena.alloc<LMAP>(face_n);
 
     // Read Textures
-    inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset, std::ios::beg);
-    BSPTEXTUREHEADER theader{};
-    inBSP.read((char *)&theader, sizeof(theader));
-    int *texOffSets = new int[theader.nMipTextures];
-    inBSP.read((char *)texOffSets, theader.nMipTextures * sizeof(int));
-
-    std::vector<std::string> texNames;
-
-    for (u32 i = 0; i < theader.nMipTextures; i++) {
-        inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset + texOffSets[i], std::ios::beg);
-
-        BSPMIPTEX bmt{};
-        inBSP.read((char *)&bmt, sizeof(bmt));
-        if (!textures.contains(bmt.szName)) { // First appearance of the texture
-            if (bmt.nOffsets[0] != 0 && bmt.nOffsets[1] != 0 && bmt.nOffsets[2] != 0 && bmt.nOffsets[3] != 0) {
-                // Textures that are inside the BSP
-
-                // Awful code. This and wad.cpp may be joined, they are pretty similar (except that these don't have color palettes)
-
-                auto *data0 = new unsigned char[bmt.nWidth * bmt.nHeight];
-                inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset + texOffSets[i] + bmt.nOffsets[0], std::ios::beg);
-                inBSP.read((char *)data0, bmt.nWidth * bmt.nHeight);
-
-                auto *data1 = new unsigned char[bmt.nWidth * bmt.nHeight / 4];
-                inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset + texOffSets[i] + bmt.nOffsets[1], std::ios::beg);
-                inBSP.read((char *)data1, bmt.nWidth * bmt.nHeight / 4);
-
-                auto *data2 = new unsigned char[bmt.nWidth * bmt.nHeight / 16];
-                inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset + texOffSets[i] + bmt.nOffsets[2], std::ios::beg);
-                inBSP.read((char *)data2, bmt.nWidth * bmt.nHeight / 16);
-
-                auto *data3 = new unsigned char[bmt.nWidth * bmt.nHeight / 64];
-                inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset + texOffSets[i] + bmt.nOffsets[3], std::ios::beg);
-                inBSP.read((char *)data3, bmt.nWidth * bmt.nHeight / 64);
-
-                short dummy = 0;
-                inBSP.read((char *)&dummy, 2);
-
-                auto *data4 = new unsigned char[256 * 3];
-                inBSP.read((char *)data4, 256 * 3);
-
-                auto *dataFinal0 = new unsigned char[bmt.nWidth * bmt.nHeight * 4];
-                auto *dataFinal1 = new unsigned char[bmt.nWidth * bmt.nHeight];
-                auto *dataFinal2 = new unsigned char[bmt.nWidth * bmt.nHeight / 4];
-                auto *dataFinal3 = new unsigned char[bmt.nWidth * bmt.nHeight / 16];
-
-                for (u32 y = 0; y < bmt.nHeight; y++) {
-                    for (u32 x = 0; x < bmt.nWidth; x++) {
-                        dataFinal0[(x + y * bmt.nWidth) * 4] = data4[data0[y * bmt.nWidth + x] * 3];
-                        dataFinal0[(x + y * bmt.nWidth) * 4 + 1] = data4[data0[y * bmt.nWidth + x] * 3 + 1];
-                        dataFinal0[(x + y * bmt.nWidth) * 4 + 2] = data4[data0[y * bmt.nWidth + x] * 3 + 2];
-
-                        if (dataFinal0[(x + y * bmt.nWidth) * 4] == 0 && dataFinal0[(x + y * bmt.nWidth) * 4 + 1] == 0 && dataFinal0[(x + y * bmt.nWidth) * 4 + 2] == 255) {
-                            dataFinal0[(x + y * bmt.nWidth) * 4 + 3] = dataFinal0[(x + y * bmt.nWidth) * 4 + 2] = dataFinal0[(x + y * bmt.nWidth) * 4 + 1] = dataFinal0[(x + y * bmt.nWidth) * 4 + 0] = 0;
-                        } else {
-                            dataFinal0[(x + y * bmt.nWidth) * 4 + 3] = 255;
-                        }
-                    }
-                }
-                for (u32 y = 0; y < bmt.nHeight / 2; y++) {
-                    for (u32 x = 0; x < bmt.nWidth / 2; x++) {
-                        dataFinal1[(x + y * bmt.nWidth / 2) * 4] = data4[data1[y * bmt.nWidth / 2 + x] * 3];
-                        dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 1] = data4[data1[y * bmt.nWidth / 2 + x] * 3 + 1];
-                        dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 2] = data4[data1[y * bmt.nWidth / 2 + x] * 3 + 2];
-
-                        if (dataFinal1[(x + y * bmt.nWidth / 2) * 4] == 0 && dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 1] == 0 && dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 2] == 255) {
-                            dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 3] = dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 2] = dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 1] = dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 0] = 0;
-                        } else {
-                            dataFinal1[(x + y * bmt.nWidth / 2) * 4 + 3] = 255;
-                        }
-                    }
-                }
-                for (u32 y = 0; y < bmt.nHeight / 4; y++) {
-                    for (u32 x = 0; x < bmt.nWidth / 4; x++) {
-                        dataFinal2[(x + y * bmt.nWidth / 4) * 4] = data4[data2[y * bmt.nWidth / 4 + x] * 3];
-                        dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 1] = data4[data2[y * bmt.nWidth / 4 + x] * 3 + 1];
-                        dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 2] = data4[data2[y * bmt.nWidth / 4 + x] * 3 + 2];
-
-                        if (dataFinal2[(x + y * bmt.nWidth / 4) * 4] == 0 && dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 1] == 0 && dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 2] == 255) {
-                            dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 3] = dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 2] = dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 1] = dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 0] = 0;
-                        } else {
-                            dataFinal2[(x + y * bmt.nWidth / 4) * 4 + 3] = 255;
-                        }
-                    }
-                }
-                for (u32 y = 0; y < bmt.nHeight / 8; y++) {
-                    for (u32 x = 0; x < bmt.nWidth / 8; x++) {
-                        dataFinal3[(x + y * bmt.nWidth / 8) * 4] = data4[data3[y * bmt.nWidth / 8 + x] * 3];
-                        dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 1] = data4[data3[y * bmt.nWidth / 8 + x] * 3 + 1];
-                        dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 2] = data4[data3[y * bmt.nWidth / 8 + x] * 3 + 2];
-
-                        if (dataFinal3[(x + y * bmt.nWidth / 8) * 4] == 0 && dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 1] == 0 && dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 2] == 255) {
-                            dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 3] = dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 2] = dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 1] = dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 0] = 0;
-                        } else {
-                            dataFinal3[(x + y * bmt.nWidth / 8) * 4 + 3] = 255;
-                        }
-                    }
-                }
+    auto const textures_offset = static_cast<usize>(std::max(bHeader.lump[LUMP_TEXTURES].nOffset, 0));
+    auto const theader = file->read<BSPTEXTUREHEADER>(textures_offset);
+    // A corrupt count can't make the offsets run past the lump, or allocate more than it holds
+    auto const textures_length = static_cast<usize>(std::max(bHeader.lump[LUMP_TEXTURES].nLength, 0));
+    auto texture_n = static_cast<u32>(std::min<usize>(theader.nMipTextures, textures_length > sizeof(theader) ? (textures_length - sizeof(theader)) / sizeof(i32) : 0));
+    if (texture_n < theader.nMipTextures)
+        std::cerr << "Texture lump of " << filename << " holds " << texture_n << " of its " << theader.nMipTextures << " textures." << std::endl;
+    auto const texOffSets = arena.alloc<i32>(texture_n);
+    if (!file->read(textures_offset + sizeof(theader), texOffSets.data(), texOffSets.size_bytes())) {
+        std::cerr << "Texture lump of " << filename << " is truncated." << std::endl;
+        texture_n = 0;
+    }
 
-                BSP_TEXTURE n{};
-                n.w = bmt.nWidth;
-                n.h = bmt.nHeight;
-
-                n.image_id = device.create_image({
-                    .format = daxa::Format::R8G8B8A8_SRGB,
-                    .size = {bmt.nWidth, bmt.nHeight, 1},
-                    .mip_level_count = 4,
-                    .usage = daxa::ImageUsageFlagBits::SHADER_SAMPLED | daxa::ImageUsageFlagBits::TRANSFER_SRC | daxa::ImageUsageFlagBits::TRANSFER_DST,
-                    .name = "image",
-                });
-                n.load(device, bmt.szName, dataFinal0);
-
-                textures[bmt.szName] = n;
-
-                delete[] data0;
-                delete[] data1;
-                delete[] data2;
-                delete[] data3;
-                delete[] data4;
-                delete[] dataFinal0;
-                delete[] dataFinal1;
-                delete[] dataFinal2;
-                delete[] dataFinal3;
-
-            } else {
-                BSP_TEXTURE n{};
-                n.w = 1;
-                n.h = 1;
-                textures[bmt.szName] = n;
+    for (u32 i = 0; i < texture_n; i++) {
+        auto const miptex_offset = textures_offset + static_cast<usize>(std::max(texOffSets[i], 0));
+        auto const bmt = file->read<BSPMIPTEX>(miptex_offset);
+        auto [texture, claimed] = textures.acquire({bmt.szName, MAXTEXTURENAME});
+        auto const pixels = bmt.nOffsets[0] != 0 && bmt.nOffsets[1] != 0 && bmt.nOffsets[2] != 0 && bmt.nOffsets[3] != 0 ? read_miptex(*file, miptex_offset, bmt) : std::nullopt;
+        if (pixels) {
+            // Textures that are inside the BSP
+
+            // The engine prefers a map's embedded texture over a WAD or another map's one with the same name
+            if (!claimed) {
+                // Its content is only known once whoever claimed it published it
+                textures.wait_ready(texture);
+                if (textures.content(texture) != hash_miptex(*pixels)) {
+                    // Someone else holds it too, so this is never the last reference
+                    textures.release(texture);
+                    texture = textures.acquire_variant({bmt.szName, MAXTEXTURENAME});
+                    claimed = true;
+                }
             }
+            if (claimed)
+                load_miptex(device, textures, texture, *pixels, scratch.texture_rgba);
+        } else if (claimed) {
+            BSP_TEXTURE n{};
+            n.w = 1;
+            n.h = 1;
+            textures.publish(texture, n);
         }
-        texNames.emplace_back(bmt.szName);
+        // Textures a WAD or another map already holds are shared, the rest were just loaded and published
+        texture_refs.push_back(texture);
     }
 
     // Read Texture information
-    inBSP.seekg(bHeader.lump[LUMP_TEXINFO].nOffset, std::ios::beg);
-    auto *btfs = new BSPTEXTUREINFO[bHeader.lump[LUMP_TEXINFO].nLength / (int)sizeof(BSPTEXTUREINFO)];
-    inBSP.read((char *)btfs, bHeader.lump[LUMP_TEXINFO].nLength);
-
-    // Read Faces and lightmaps
-    inBSP.seekg(bHeader.lump[LUMP_FACES].nOffset, std::ios::beg);
+    auto const btfs = read_lump<BSPTEXTUREINFO>(*file, bHeader.lump[LUMP_TEXINFO], arena);
 
-    auto *minUV = new float[bHeader.lump[LUMP_FACES].nLength / (int)sizeof(BSPFACE) * 2];
-    auto *maxUV = new float[bHeader.lump[LUMP_FACES].nLength / (int)sizeof(BSPFACE) * 2];
-
-    for (int i = 0; i < bHeader.lump[LUMP_FACES].nLength / (int)sizeof(BSPFACE); i++) {
-        BSPFACE f{};
-        inBSP.read((char *)&f, sizeof(f));
-        BSPTEXTUREINFO const b = btfs[f.iTextureInfo];
-        std::string const faceTexName = texNames[b.iMiptex];
-
-        minUV[i * 2] = minUV[i * 2 + 1] = 99999;
-        maxUV[i * 2] = maxUV[i * 2 + 1] = -99999;
-
-        for (int j = 2, k = 1; j < f.nEdges; j++, k++) {
-            VERTEX const v1 = verticesPrime[f.iFirstEdge];
-            VERTEX const v2 = verticesPrime[f.iFirstEdge + k];
-            VERTEX const v3 = verticesPrime[f.iFirstEdge + j];
-            COORDS const c1 = calcCoords(v1, b.vS, b.vT, b.fSShift, b.fTShift);
-            COORDS const c2 = calcCoords(v2, b.vS, b.vT, b.fSShift, b.fTShift);
-            COORDS const c3 = calcCoords(v3, b.vS, b.vT, b.fSShift, b.fTShift);
-
-            minUV[i * 2] = std::min(minUV[i * 2], c1.u);
-            minUV[i * 2 + 1] = std::min(minUV[i * 2 + 1], c1.v);
-            minUV[i * 2] = std::min(minUV[i * 2], c2.u);
-            minUV[i * 2 + 1] = std::min(minUV[i * 2 + 1], c2.v);
-            minUV[i * 2] = std::min(minUV[i * 2], c3.u);
-            minUV[i * 2 + 1] = std::min(minUV[i * 2 + 1], c3.v);
-
-            maxUV[i * 2] = std::max(maxUV[i * 2], c1.u);
-            maxUV[i * 2 + 1] = std::max(maxUV[i * 2 + 1], c1.v);
-            maxUV[i * 2] = std::max(maxUV[i * 2], c2.u);
-            maxUV[i * 2 + 1] = std::max(maxUV[i * 2 + 1], c2.v);
-            maxUV[i * 2] = std::max(maxUV[i * 2], c3.u);
-            maxUV[i * 2 + 1] = std::max(maxUV[i * 2 + 1], c3.v);
+    // Project the face vertices and build the lightmaps from their extents
+#if BENCHMARK_FACE_PROCESSING
+    auto const face_start = std::chrono::steady_clock::now();
+#endif
+    face_builder.project(arena, btfs);
+    for (usize i = 0; i < face_n; i++) {
+        auto const &f = face_builder.faces[i];
+        int lmw = face_builder.extents[i].lightmap_w();
+        int lmh = face_builder.extents[i].lightmap_h();
+
+        if (f.nEdges < 3) {
+            face_drawn[i] = 0;
+        }
+        // Its miptex may be past the ones a truncated texture lump held
+        if (btfs[f.iTextureInfo].iMiptex >= texture_refs.size()) {
+            face_drawn[i] = 0;
         }
-
-        int lmw = ceil(maxUV[i * 2] / 16) - floor(minUV[i * 2] / 16) + 1;
-        int lmh = ceil(maxUV[i * 2 + 1] / 16) - floor(minUV[i * 2 + 1] / 16) + 1;
-
         if (lmw > 17 || lmh > 17) {
+            face_drawn[i] = 0;
             lmw = lmh = 1;
-            // continue;
         }
         LMAP l{};
         l.w = lmw;
         l.h = lmh;
+        // Up to 4 lightmaps follow each other in the lump, one per style
+        for (l.style_n = 0; l.style_n < 4 && f.nStyles[l.style_n] != NO_LIGHT_STYLE; l.style_n++) {
+            l.styles[l.style_n] = f.nStyles[l.style_n];
+        }
         if (f.nLightmapOffset < size) {
             l.offset = lmap + f.nLightmapOffset;
+            if (f.nLightmapOffset + static_cast<u32>(lmw * lmh * 3) * std::max(l.style_n, 1u) > static_cast<u32>(size)) {
+                l.style_n = std::min(l.style_n, 1u);
+            }
         } else {
             l.offset = nullptr;
         }
-        lmaps.push_back(l);
+        lmaps[i] = l;
     }
+#if BENCHMARK_FACE_PROCESSING
+    auto const lightmap_start = std::chrono::steady_clock::now();
+#endif
 
-    int lmapRover[1024];
-    memset(lmapRover, 0, 1024 * 4);
-
-    // Light map "rover" algorithm from Quake 2 (http://fabiensanglard.net/quake2/quake2_opengl_renderer.php)
-    for (u32 i = 0; i < lmaps.size(); i++) {
-        int best = 1024;
-        int best2 = 0;
+    auto lmap_rects = std::vector<LightmapRect>(lmaps.size());
+    for (usize i = 0; i < lmaps.size(); i++) {
+        lmap_rects[i] = LightmapRect{.w = lmaps[i].w, .h = lmaps[i].h};
+    }
 
-        for (int a = 0; a < 1024 - lmaps[i].w; a++) {
-            best2 = 0;
-            int j = 0;
-            for (j = 0; j < lmaps[i].w; j++) {
-                if (lmapRover[a + j] >= best) {
-                    break;
-                }
-                if (lmapRover[a + j] > best2) {
-                    best2 = lmapRover[a + j];
-                }
-            }
-            if (j == lmaps[i].w) {
-                lmaps[i].finalX = a;
-                lmaps[i].finalY = best = best2;
-            }
+#if BENCHMARK_LIGHTMAP_PACKING
+    {
+        auto rover_rects = lmap_rects;
+        auto const rover_start = std::chrono::steady_clock::now();
+        auto const rover_placed_n = rover_pack(rover_rects);
+        auto const rover_end = std::chrono::steady_clock::now();
+        auto rover_height = 0;
+        for (usize i = 0; i < rover_placed_n; i++)
+            rover_height = std::max(rover_height, rover_rects[i].y + rover_rects[i].h);
+
+        auto skyline_rects = lmap_rects;
+        auto skyline_packer = LightmapPacker{};
+        auto const skyline_start = std::chrono::steady_clock::now();
+        skyline_packer.pack(skyline_rects);
+        auto const skyline_end = std::chrono::steady_clock::now();
+        auto skyline_height = 0;
+        for (auto const &rect : skyline_rects) {
+            if (rect.page + 1 == skyline_packer.pages.size())
+                skyline_height = std::max(skyline_height, rect.y + rect.h);
         }
 
-        if (best + lmaps[i].h > 1024) {
-            std::cout << "Lightmap atlas is too small (" << filename << ")." << std::endl;
-            break;
-        }
+        auto const us = [](auto d) { return std::chrono::duration<f64, std::micro>(d).count(); };
+        std::cout << "Lightmap packing (" << filename << ", " << lmap_rects.size() << " lightmaps): "
+                  << "rover " << us(rover_end - rover_start) << "us, " << rover_placed_n << " placed, height " << rover_height << "; "
+                  << "skyline " << us(skyline_end - skyline_start) << "us, " << skyline_packer.pages.size() << " page(s), last page height " << skyline_height << std::endl;
+    }
+#endif
 
-        for (int a = 0; a < lmaps[i].w; a++) {
-            lmapRover[lmaps[i].finalX + a] = best + lmaps[i].h;
+    // Shared with the other maps. Once the world lightmap is on the GPU, the rects written here are queued to be copied to it.
+    {
+        auto const lock = std::lock_guard{world_lightmap.mutex};
+        if (!world_lightmap.pack(lmap_rects, lightmap_pages)) {
+            std::cerr << "Lightmap is larger than a lightmap page (" << filename << ")." << std::endl;
         }
+        light_style_slot = world_lightmap.styles.add_map(switchable_styles);
 
-        int const finalX = lmaps[i].finalX;
-        int const finalY = lmaps[i].finalY;
-
-#define ATXY(_x, _y) (((_x) + ((_y) * 1024)) * 3)
+#define ATXY(_x, _y) (((_x) + ((_y) * LIGHTMAP_PAGE_SIZE)) * 3)
 #define LMXY(_x, _y) (((_x) + ((_y) * lmaps[i].w)) * 3)
-        for (int y = 0; y < lmaps[i].h; y++) {
-            for (int x = 0; x < lmaps[i].w; x++) {
-                if (lmaps[i].offset) {
-                    lmapAtlas[ATXY(finalX + x, finalY + y) + 0] = gammaTable[lmaps[i].offset[LMXY(x, y) + 0]];
-                    lmapAtlas[ATXY(finalX + x, finalY + y) + 1] = gammaTable[lmaps[i].offset[LMXY(x, y) + 1]];
-                    lmapAtlas[ATXY(finalX + x, finalY + y) + 2] = gammaTable[lmaps[i].offset[LMXY(x, y) + 2]];
-                } else {
-                    lmapAtlas[ATXY(finalX + x, finalY + y) + 0] = 200;
-                    lmapAtlas[ATXY(finalX + x, finalY + y) + 1] = 50;
-                    lmapAtlas[ATXY(finalX + x, finalY + y) + 2] = 255;
+        for (u32 i = 0; i < lmaps.size(); i++) {
+            lmaps[i].finalX = lmap_rects[i].x;
+            lmaps[i].finalY = lmap_rects[i].y;
+            lmaps[i].page = lmap_rects[i].page;
+
+            int const finalX = lmaps[i].finalX;
+            int const finalY = lmaps[i].finalY;
+            uint8_t *const page = world_lightmap.page_texels(lmaps[i].page);
+
+            // Anything but the constant style 0 alone is kept around to be re-composited when its styles change
+            bool const animated = lmaps[i].offset && (lmaps[i].style_n > 1 || (lmaps[i].style_n == 1 && lmaps[i].styles[0] != 0));
+            if (animated) {
+                auto &styles = world_lightmap.styles;
+                styles.add_lightmap(light_style_slot, lmaps[i].page, finalX, finalY, lmaps[i].w, lmaps[i].h, lmaps[i].styles, lmaps[i].style_n, lmaps[i].offset);
+                styles.composite(styles.lightmaps.back(), page + ATXY(finalX, finalY), LIGHTMAP_PAGE_SIZE * 3, 3);
+                continue;
+            }
+
+            for (int y = 0; y < lmaps[i].h; y++) {
+                for (int x = 0; x < lmaps[i].w; x++) {
+                    if (lmaps[i].offset) {
+                        page[ATXY(finalX + x, finalY + y) + 0] = gammaTable[lmaps[i].offset[LMXY(x, y) + 0]];
+                        page[ATXY(finalX + x, finalY + y) + 1] = gammaTable[lmaps[i].offset[LMXY(x, y) + 1]];
+                        page[ATXY(finalX + x, finalY + y) + 2] = gammaTable[lmaps[i].offset[LMXY(x, y) + 2]];
+                    } else {
+                        page[ATXY(finalX + x, finalY + y) + 0] = 200;
+                        page[ATXY(finalX + x, finalY + y) + 1] = 50;
+                        page[ATXY(finalX + x, finalY + y) + 2] = 255;
+                    }
                 }
             }
         }
+        for (auto const &rect : lmap_rects)
+            world_lightmap.queue_upload(rect);
     }
 
     // Load the actual triangles
-
-    inBSP.seekg(bHeader.lump[LUMP_FACES].nOffset, std::ios::beg);
-    for (int i = 0; i < bHeader.lump[LUMP_FACES].nLength / (int)sizeof(BSPFACE); i++) {
-
-        BSPFACE f{};
-        inBSP.read((char *)&f, sizeof(f));
-
-        if (dontRenderFace[i]) {
+#if BENCHMARK_FACE_PROCESSING
+    auto const triangulate_start = std::chrono::steady_clock::now();
+#endif
+    auto const buckets = FaceBuckets(textures, texture_refs);
+    std::span<VECFINAL> triangles;
+    std::vector<u32> bucket_offsets;
+    face_builder.triangulate(arena, btfs, buckets, face_drawn, lmaps, triangles, bucket_offsets);
+    for (u32 b = 0; b < buckets.size(); b++) {
+        if (bucket_offsets[b] == bucket_offsets[b + 1])
             continue;
+        texturedTris.push_back({
+            .triangles = std::vector<VECFINAL>(triangles.begin() + bucket_offsets[b] * 3, triangles.begin() + bucket_offsets[b + 1] * 3),
+            .texture = buckets.textures[b],
+            .vertex_n = (bucket_offsets[b + 1] - bucket_offsets[b]) * 3,
+        });
+        measure_batch(texturedTris.back(), textures.wait_ready(buckets.textures[b]));
+    }
+#if BENCHMARK_FACE_PROCESSING
+    {
+        auto const face_end = std::chrono::steady_clock::now();
+        // The lightmap compositing and packing in between is the same for both paths
+        auto const new_us = std::chrono::duration<f64, std::micro>((lightmap_start - face_start) + (face_end - triangulate_start)).count();
+        auto texNames = std::vector<std::string>{};
+        for (auto texture : texture_refs)
+            texNames.emplace_back(textures.name(texture));
+        auto legacy_tris = std::map<std::string, std::vector<VECFINAL>>{};
+        auto const legacy_us = legacy_process_faces(face_builder.faces, vertices, edges, surfedges, btfs, texNames, face_drawn, lmaps, textures, legacy_tris);
+        auto identical = legacy_tris.size() == texturedTris.size();
+        for (auto const &tex : texturedTris) {
+            auto const it = legacy_tris.find(std::string(textures.name(tex.texture)));
+            identical = identical && it != legacy_tris.end() && it->second.size() == tex.triangles.size() &&
+                        std::memcmp(it->second.data(), tex.triangles.data(), tex.triangles.size() * sizeof(VECFINAL)) == 0;
         }
 
-        BSPTEXTUREINFO const b = btfs[f.iTextureInfo];
-
-        std::string const faceTexName = texNames[b.iMiptex];
+        // The same builder on one chunk with the scalar projection, its output may depend on neither
+        auto reference = FaceBuilder{};
+        reference.faces = face_builder.faces;
+        reference.max_chunk_n = 1;
+        reference.use_sse2 = false;
+        reference.load_vertices(arena, vertices, edges, surfedges);
+        auto const reference_start = std::chrono::steady_clock::now();
+        reference.project(arena, btfs);
+        std::span<VECFINAL> reference_triangles;
+        std::vector<u32> reference_offsets;
+        reference.triangulate(arena, btfs, buckets, face_drawn, lmaps, reference_triangles, reference_offsets);
+        auto const reference_us = std::chrono::duration<f64, std::micro>(std::chrono::steady_clock::now() - reference_start).count();
+        identical = identical && reference_offsets == bucket_offsets && reference_triangles.size() == triangles.size() &&
+                    std::memcmp(reference_triangles.data(), triangles.data(), triangles.size_bytes()) == 0 &&
+                    std::memcmp(reference.extents.data(), face_builder.extents.data(), face_builder.extents.size_bytes()) == 0;
+
+        std::cout << "Face processing (" << filename << ", " << face_n << " faces): legacy " << legacy_us << "us, single pass " << new_us << "us on "
+                  << face_builder.chunk_count() << " chunk(s), scalar on one chunk " << reference_us << "us, " << (identical ? "identical output" : "OUTPUT DIFFERS") << std::endl;
+    }
+#endif
 
-        // Calculate light map uvs
-        int const lmw = ceil(maxUV[i * 2] / 16) - floor(minUV[i * 2] / 16) + 1;
-        int const lmh = ceil(maxUV[i * 2 + 1] / 16) - floor(minUV[i * 2 + 1] / 16) + 1;
+    totalTris = 0;
+    for (auto const &tex : texturedTris)
+        totalTris += tex.vertex_n;
+    upload_geometry(device);
 
-        if (lmw > 17) {
-            continue;
-        }
-        if (lmh > 17) {
-            continue;
-        }
+    mapId = id;
+    std::cout << "Loaded " << filename << " (" << arena.peak / 1024 << " KiB peak load memory)" << std::endl;
+}
 
-        float const mid_poly_s = (minUV[i * 2] + maxUV[i * 2]) / 2.0f;
-        float const mid_poly_t = (minUV[i * 2 + 1] + maxUV[i * 2 + 1]) / 2.0f;
-        float const mid_tex_s = (float)lmw / 2.0f;
-        float const mid_tex_t = (float)lmh / 2.0f;
-        float const fX = lmaps[i].finalX;
-        float const fY = lmaps[i].finalY;
-        BSP_TEXTURE const t = textures[faceTexName];
+void BSP::upload_geometry(daxa::Device &device) {
+    create_geometry_buffers(device);
+    if (bufObjects.empty())
+        return;
+    // Every batch goes through one staging buffer and one submit
+    auto staging_buffer = create_buffer(device, {
+        .size = static_cast<u32>(geometry_bytes()),
+        .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
+        .name = "staging_buffer",
+    });
+    auto cmd_list = device.create_command_list({
+        .name = "cmd_list",
+    });
+    record_geometry_upload(cmd_list, staging_buffer, device.get_host_address_as<u8>(staging_buffer), 0);
+    cmd_list.complete();
+    submit_and_wait(device, std::move(cmd_list));
+    device.destroy_buffer(staging_buffer);
+}
 
-        std::vector<VECFINAL> *vt = &texturedTris[faceTexName].triangles;
+void BSP::create_geometry_buffers(daxa::Device &device) {
+    bufObjects = std::vector<BUFFER>(texturedTris.size());
+    for (usize i = 0; i < texturedTris.size(); i++) {
+        bufObjects[i].buffer_id = create_buffer(device, {
+            .size = static_cast<u32>(texturedTris[i].vertex_n * sizeof(VECFINAL)),
+            .name = "textured_tri_buffer",
+        });
+    }
+    geometry_resident = true;
+}
 
-        for (int j = 2, k = 1; j < f.nEdges; j++, k++) {
-            VERTEX v1 = verticesPrime[f.iFirstEdge];
-            VERTEX v2 = verticesPrime[f.iFirstEdge + k];
-            VERTEX v3 = verticesPrime[f.iFirstEdge + j];
-            COORDS c1 = calcCoords(v1, b.vS, b.vT, b.fSShift, b.fTShift);
-            COORDS c2 = calcCoords(v2, b.vS, b.vT, b.fSShift, b.fTShift);
-            COORDS c3 = calcCoords(v3, b.vS, b.vT, b.fSShift, b.fTShift);
-
-            COORDS c1l{};
-            COORDS c2l{};
-            COORDS c3l{};
-
-            c1l.u = mid_tex_s + (c1.u - mid_poly_s) / 16.0f;
-            c2l.u = mid_tex_s + (c2.u - mid_poly_s) / 16.0f;
-            c3l.u = mid_tex_s + (c3.u - mid_poly_s) / 16.0f;
-            c1l.v = mid_tex_t + (c1.v - mid_poly_t) / 16.0f;
-            c2l.v = mid_tex_t + (c2.v - mid_poly_t) / 16.0f;
-            c3l.v = mid_tex_t + (c3.v - mid_poly_t) / 16.0f;
-
-            c1l.u += fX;
-            c2l.u += fX;
-            c3l.u += fX;
-            c1l.v += fY;
-            c2l.v += fY;
-            c3l.v += fY;
-
-            c1l.u /= 1024.0;
-            c2l.u /= 1024.0;
-            c3l.u /= 1024.0;
-            c1l.v /= 1024.0;
-            c2l.v /= 1024.0;
-            c3l.v /= 1024.0;
-
-            c1.u /= t.w;
-            c2.u /= t.w;
-            c3.u /= t.w;
-            c1.v /= t.h;
-            c2.v /= t.h;
-            c3.v /= t.h;
-
-            v1.fixHand();
-            v2.fixHand();
-            v3.fixHand();
-
-            vt->push_back(VECFINAL(v1, c1, c1l));
-            vt->push_back(VECFINAL(v2, c2, c2l));
-            vt->push_back(VECFINAL(v3, c3, c3l));
-        }
-        texturedTris[faceTexName].image_id = textures[faceTexName].image_id;
+auto BSP::record_geometry_upload(daxa::CommandList &cmd_list, daxa::BufferId staging_buffer, u8 *staging, usize staging_offset) const -> usize {
+    cmd_list.pipeline_barrier({
+        .src_access = daxa::AccessConsts::HOST_WRITE,
+        .dst_access = daxa::AccessConsts::TRANSFER_READ,
+    });
+    usize size = 0;
+    for (usize i = 0; i < bufObjects.size(); i++) {
+        auto const tris = triangles(i);
+        std::memcpy(staging + staging_offset + size, tris.data(), tris.size_bytes());
+        cmd_list.copy_buffer_to_buffer({
+            .src_buffer = staging_buffer,
+            .src_offset = staging_offset + size,
+            .dst_buffer = bufObjects[i].buffer_id,
+            .size = tris.size_bytes(),
+        });
+        size += tris.size_bytes();
     }
+    cmd_list.pipeline_barrier({
+        .src_access = daxa::AccessConsts::TRANSFER_WRITE,
+        .dst_access = daxa::AccessConsts::READ,
+    });
+    return size;
+}
 
-    delete[] btfs;
-    delete[] texOffSets;
-    delete[] edges;
+void BSP::evict_geometry(daxa::Device &device) {
+    for (auto &buf : bufObjects)
+        device.destroy_buffer(buf.buffer_id);
+    bufObjects.clear();
+    geometry_resident = false;
+}
 
-    inBSP.close();
+auto BSP::geometry_bytes() const -> u64 {
+    u64 result = 0;
+    for (auto const &tex : texturedTris)
+        result += tex.vertex_n * sizeof(VECFINAL);
+    return result;
+}
 
-    lmap_image_id = device.create_image({
-        .format = daxa::Format::R8G8B8A8_SRGB,
-        .size = {1024, 1024, 1},
-        .usage = daxa::ImageUsageFlagBits::SHADER_SAMPLED | daxa::ImageUsageFlagBits::TRANSFER_SRC | daxa::ImageUsageFlagBits::TRANSFER_DST,
-        .name = "image",
-    });
+auto parse_cpu_geometry(std::string const &name) -> CpuGeometry {
+    if (name == "drop")
+        return CpuGeometry::DROP;
+    if (name == "spill")
+        return CpuGeometry::SPILL;
+    if (name != "keep")
+        std::cerr << "Unknown cpugeometry \"" << name << "\", keeping triangles in RAM." << std::endl;
+    return CpuGeometry::KEEP;
+}
 
-    BSP_TEXTURE lmap_tex;
-    lmap_tex.image_id = lmap_image_id;
-    lmap_tex.w = 1024;
-    lmap_tex.h = 1024;
-    lmap_tex.load(device, sMapEntry.m_szName + "_lightmap", lmapAtlas, 3, 4, 1);
-    delete[] lmapAtlas;
+void BSP::release_cpu_geometry(CpuGeometry policy) {
+    if (policy == CpuGeometry::KEEP || cpu_geometry != CpuGeometry::KEEP)
+        return;
+    if (policy == CpuGeometry::SPILL) {
+        // Unique per map load, several instances may spill at once
+        static std::atomic<u32> spill_n = 0;
+        auto const path = std::filesystem::temp_directory_path() /
+                          ("halfmapper_" + mapId + "_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "_" + std::to_string(spill_n++) + ".tris");
+        {
+            auto out = std::ofstream(path, std::ios::binary);
+            u64 spill_offset = 0;
+            for (auto &tex : texturedTris) {
+                tex.spill_offset = spill_offset;
+                out.write(reinterpret_cast<char const *>(tex.triangles.data()), static_cast<std::streamsize>(tex.triangles.size() * sizeof(VECFINAL)));
+                spill_offset += tex.triangles.size() * sizeof(VECFINAL);
+            }
+            if (!out) {
+                std::cerr << "Can't spill the triangles of " << mapId << " to " << path << ", keeping them in RAM." << std::endl;
+                out.close();
+                std::filesystem::remove(path);
+                return;
+            }
+        }
+        if (!spill.open(path, true) && geometry_bytes() != 0) {
+            std::cerr << "Can't map the triangles of " << mapId << " back from " << path << ", keeping them in RAM." << std::endl;
+            spill.close();
+            return;
+        }
+    }
+    for (auto &tex : texturedTris)
+        tex.triangles = {};
+    cpu_geometry = policy;
+}
 
-    bufObjects = std::vector<BUFFER>(texturedTris.size());
+auto BSP::triangles(usize batch) const -> std::span<VECFINAL const> {
+    auto const &tex = texturedTris[batch];
+    if (cpu_geometry == CpuGeometry::SPILL)
+        return {reinterpret_cast<VECFINAL const *>(spill.data() + tex.spill_offset), tex.vertex_n};
+    return tex.triangles;
+}
 
-    int i = 0;
-    totalTris = 0;
-    for (auto it = texturedTris.begin(); it != texturedTris.end(); it++, i++) {
-        auto &buf = bufObjects[i];
-        auto buf_size = static_cast<u32>((*it).second.triangles.size() * sizeof(VECFINAL));
-        buf.buffer_id = device.create_buffer({
-            .size = buf_size,
-            .name = "textured_tri_buffer",
-        });
-        upload_buffer_data(device, buf.buffer_id, reinterpret_cast<u8 *>((*it).second.triangles.data()), buf_size);
-        totalTris += (*it).second.triangles.size();
-    }
+auto BSP::cpu_geometry_bytes() const -> u64 {
+    return cpu_geometry == CpuGeometry::KEEP ? geometry_bytes() : 0;
+}
 
-    mapId = id;
+auto BSP::draw_offset() const -> f32vec3 {
+    return f32vec3{offset.x + ConfigOffsetChapter.x, offset.y + ConfigOffsetChapter.y, offset.z + ConfigOffsetChapter.z} + propagated_user_offset;
 }
 
 static constexpr auto parentless_maps = std::array<std::string_view, 7>{
@@ -785,10 +930,41 @@ static constexpr auto parentless_maps = std::array<std::string_view, 7>{
     "c5a1",
 };
 
-void BSP::calculateOffset() {
-    if (offsets.contains(mapId)) {
-        offset = offsets[mapId];
-    } else {
+void BSP::unload(daxa::Device &device, WorldLightmap &world_lightmap) {
+    evict_geometry(device);
+    texturedTris.clear();
+    spill.close();
+    totalTris = 0;
+
+    for (auto texture : texture_refs) {
+        if (textures_active)
+            assets->textures.deactivate(texture, 0);
+        auto const released = assets->textures.release(texture);
+        if (released && !released->image_id.is_empty())
+            device.destroy_image(released->image_id);
+    }
+    texture_refs.clear();
+    textures_active = false;
+    {
+        auto const lock = std::lock_guard{world_lightmap.mutex};
+        world_lightmap.release_pages(lightmap_pages);
+        if (light_style_slot != ~0u)
+            world_lightmap.styles.remove_map(light_style_slot);
+    }
+    lightmap_pages.clear();
+    light_style_slot = ~0u;
+
+    // Landmarks and the computed offset stay, so the map lands in the same place when loaded again
+    auto const lock = std::lock_guard{assets->entity_mutex};
+    assets->dontRenderModel.erase(mapId);
+    assets->lightstyles.erase(mapId);
+}
+
+auto place_map(AssetRegistry &assets, std::string const &mapId, std::string &parent_mapId) -> VERTEX {
+    auto const lock = std::lock_guard{assets.entity_mutex};
+    auto &offsets = assets.offsets;
+    auto const &landmarks = assets.landmarks;
+    if (!offsets.contains(mapId)) {
         if (mapId == "c0a0" || mapId == "cs_office") {
             // Origin for other maps
             offsets[mapId] = VERTEX(0, 0, 0);
@@ -798,7 +974,7 @@ void BSP::calculateOffset() {
             float oz = 0;
             bool found = false;
 
-            auto parent_override = [this]() {
+            auto parent_override = [&]() {
                 if (std::find(parentless_maps.begin(), parentless_maps.end(), mapId) != parentless_maps.end()) {
                     parent_mapId = "";
                 } else if (mapId == "c2a3e") {
@@ -855,33 +1031,45 @@ void BSP::calculateOffset() {
             offsets[mapId] = VERTEX(ox, oy, oz);
         }
     }
+    return offsets[mapId];
 }
 
-void BSP::render(daxa::Device &device, daxa::CommandList &cmd_list, daxa::BufferId gpu_input_buffer, daxa::SamplerId image_sampler0, daxa::SamplerId image_sampler1) {
+void BSP::calculateOffset() {
+    offset = place_map(*assets, mapId, parent_mapId);
+}
+
+// Draws either the opaque batches, or only the masked ('{' prefixed) ones which need the alpha tested pipeline
+void BSP::render(daxa::Device &device, daxa::CommandList &cmd_list, DrawList &draw_list, daxa::ImageViewId lmap_image_view, daxa::SamplerId image_sampler0, daxa::SamplerId image_sampler1, bool masked) {
     // Calculate map offset based on landmarks
     calculateOffset();
     f32vec3 full_offset{offset.x + ConfigOffsetChapter.x, offset.y + ConfigOffsetChapter.y, offset.z + ConfigOffsetChapter.z};
 
-    if (!this->should_draw)
+    if (!this->should_draw || !geometry_resident)
         return;
     full_offset = full_offset + propagated_user_offset;
 
-    int i = 0;
-    for (auto it = texturedTris.begin(); it != texturedTris.end(); it++, i++) {
+    for (usize i = 0; i < texturedTris.size(); i++) {
+        auto const &tex = texturedTris[i];
+        auto const flags = assets->textures.flags(tex.texture);
         // Don't render some dummy triangles (triggers and such)
-        if ((*it).first != "aaatrigger" && (*it).first != "origin" && (*it).first != "clip" && (*it).first != "sky" && (*it).first[0] != '{' && !(*it).second.triangles.empty()) {
-            // if(mapId == "c1a0e.bsp") std::cout << (*it).first << std::endl;
-            cmd_list.push_constant(DrawPush{
-                .gpu_input = device.get_device_address(gpu_input_buffer),
+        if ((flags & TEXTURE_FLAG_TOOL) == 0 && ((flags & TEXTURE_FLAG_MASKED) != 0) == masked && tex.vertex_n != 0) {
+            if (draw_list.count == draw_list.capacity)
+                return;
+            auto const draw_index = draw_list.count++;
+            draw_list.draws[draw_index] = DrawData{
                 .vertices = device.get_device_address(bufObjects[i].buffer_id),
-                .image_id0 = (*it).second.image_id.default_view(),
-                .image_id1 = lmap_image_id.default_view(),
+                .image_id0 = assets->textures[tex.texture].image_id.default_view(),
+                .image_id1 = lmap_image_view,
                 .image_sampler0 = image_sampler0,
                 .image_sampler1 = image_sampler1,
                 .offset = full_offset,
+            };
+            cmd_list.push_constant(DrawPush{
+                .gpu_input = draw_list.gpu_input_address,
+                .draws = draw_list.draws_address,
+                .draw_index = draw_index,
             });
-            auto vert_n = static_cast<u32>((*it).second.triangles.size());
-            cmd_list.draw({.vertex_count = vert_n});
+            cmd_list.draw({.vertex_count = tex.vertex_n});
 
 #if COUNT_DRAWS
             draw_count++;
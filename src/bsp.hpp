@@ -1,6 +1,12 @@
 #pragma once
 
 #include "common.hpp"
+#include "asset_registry.hpp"
+#include "game_fs.hpp"
+#include "lightmap_packer.hpp"
+#include "utils/load_arena.hpp"
+#include "utils/mapped_file.hpp"
+#include <span>
 #include <string>
 
 // Extracted from http://hlbsp.sourceforge.net/index.php?content=bspdef
@@ -63,6 +69,9 @@ struct BSPMIPTEX {
     uint32_t nOffsets[MIPLEVELS]; // Offsets to texture mipmaps BSPMIPTEX;
 };
 
+// The mips and the palette of a miptex at `base`, pointing into the file. Empty if any of them is past its end.
+auto read_miptex(FileView const &file, usize base, BSPMIPTEX const &bmt) -> std::optional<MiptexPixels>;
+
 #define MAX_MAP_HULLS 4
 struct BSPMODEL {
     float nMins[3], nMaxs[3];          // Defines bounding box
@@ -72,11 +81,32 @@ struct BSPMODEL {
     int32_t iFirstFace, nFaces;        // Index and count into faces
 };
 
+// The entity lump as text, up to its terminating NUL. Views the file, nothing is copied.
+inline auto entity_lump(FileView const &file, BSPHEADER const &header) -> std::string_view {
+    auto const bytes = file.sub(static_cast<usize>(std::max(header.lump[LUMP_ENTITIES].nOffset, 0)), static_cast<usize>(std::max(header.lump[LUMP_ENTITIES].nLength, 0)));
+    auto const text = std::string_view(reinterpret_cast<char const *>(bytes.data()), bytes.size());
+    return text.substr(0, text.find('\0'));
+}
+
+// Bounds of a model in the renderer's handedness, with the same axis swap and mirror as VERTEX::fixHand
+inline void model_bounds(BSPMODEL const &model, f32vec3 &mins, f32vec3 &maxs) {
+    mins = {-model.nMaxs[0], model.nMins[2], model.nMins[1]};
+    maxs = {-model.nMins[0], model.nMaxs[2], model.nMaxs[1]};
+}
+
+inline auto distance_to_bounds(f32vec3 p, f32vec3 mins, f32vec3 maxs) -> f32 {
+    auto const dx = std::max({mins.x - p.x, 0.0f, p.x - maxs.x});
+    auto const dy = std::max({mins.y - p.y, 0.0f, p.y - maxs.y});
+    auto const dz = std::max({mins.z - p.z, 0.0f, p.z - maxs.z});
+    return std::sqrt(dx * dx + dy * dy + dz * dz);
+}
+
 struct COORDS {
     float u, v;
 };
 struct VECFINAL {
-    float x, y, z, u, v, ul, vl;
+    float x, y, z, u, v, ul, vl, ll;
+    VECFINAL() = default;
     VECFINAL(float _x, float _y, float _z, float _u, float _v) {
         x = _x;
         y = _y;
@@ -85,51 +115,111 @@ struct VECFINAL {
         v = _v;
         ul = 0.0f;
         vl = 0.0f;
+        ll = 0.0f;
     }
-    VECFINAL(VERTEX vt, COORDS c, COORDS c2) {
+    VECFINAL(VERTEX vt, COORDS c, COORDS c2, float layer) {
         x = vt.x, y = vt.y, z = vt.z;
         u = c.u, v = c.v;
         ul = c2.u;
         vl = c2.v;
+        ll = layer;
     }
 };
-struct BSP_TEXTURE {
-    daxa::ImageId image_id;
-    int w, h;
-
-    void load(daxa::Device &device, std::string const &tex_name, uint8_t *data, u32 src_channel_n = 4, u32 dst_channel_n = 4, u32 mip_level_count = 4);
-};
 struct LMAP {
     unsigned char *offset;
     int w, h;
     int finalX, finalY;
+    u32 page;
+    std::array<u8, 4> styles;
+    u32 style_n;
 };
 
 struct TEXSTUFF {
+    // Empty once the CPU copy was dropped or spilled, vertex_n stays
     std::vector<VECFINAL> triangles;
-    daxa::ImageId image_id;
+    TextureHandle texture;
+    u32 vertex_n = 0;
+    // Where the triangles are in the spill file
+    u64 spill_offset = 0;
+    // Bounds of the triangles, and the world size of a mip 0 texel on the most densely textured one
+    f32vec3 mins = {}, maxs = {};
+    f32 texel_size = 1.0f;
+};
+
+// What happens to a map's triangles once they are in vertex buffers
+enum struct CpuGeometry : u8 {
+    // They stay in RAM
+    KEEP,
+    // They are freed. The map's geometry can then neither be evicted from VRAM nor exported.
+    DROP,
+    // They are written to a temporary file, which is mapped and paged back in when they are read
+    SPILL,
 };
+auto parse_cpu_geometry(std::string const &name) -> CpuGeometry;
 
 struct BUFFER {
     daxa::BufferId buffer_id;
 };
 
+// Host-visible list of DrawData for the frame being recorded. Each frame in flight has its own.
+struct DrawList {
+    DrawData *draws = nullptr;
+    daxa::BufferDeviceAddress draws_address = {};
+    daxa::BufferDeviceAddress gpu_input_address = {};
+    u32 capacity = 0;
+    u32 count = 0;
+};
+
 class BSP {
   public:
-    BSP(daxa::Device &device, const std::vector<std::string> &szGamePaths, const std::string &filename, const MapEntry &sMapEntry);
-    void render(daxa::Device &device, daxa::CommandList &cmd_list, daxa::BufferId gpu_input_buffer, daxa::SamplerId image_sampler0, daxa::SamplerId image_sampler1);
+    BSP(daxa::Device &device, GameFileSystem const &files, const std::string &filename, const MapEntry &sMapEntry, AssetRegistry &assets, WorldLightmap &world_lightmap, LoadScratch &scratch);
+    // Frees the GPU buffers and drops the map's references to textures, lightmap pages and light styles.
+    // The device defers destroying them until the frames in flight are done with them.
+    void unload(daxa::Device &device, WorldLightmap &world_lightmap);
+    void render(daxa::Device &device, daxa::CommandList &cmd_list, DrawList &draw_list, daxa::ImageViewId lmap_image_view, daxa::SamplerId image_sampler0, daxa::SamplerId image_sampler1, bool masked);
     int totalTris;
     void SetChapterOffset(const float x, const float y, const float z);
 
-    daxa::ImageId lmap_image_id;
-
     void calculateOffset();
     void export_mesh();
 
-    unsigned char *lmapAtlas;
+    // Vertex buffers are created from the triangles of texturedTris, so that they can be evicted and created again
+    void upload_geometry(daxa::Device &device);
+    // The same in two steps: the buffers, then their copies recorded into a command list of the caller's. The
+    // triangles are written to `staging` at `staging_offset`, which needs geometry_bytes() free. Returns the bytes staged.
+    void create_geometry_buffers(daxa::Device &device);
+    auto record_geometry_upload(daxa::CommandList &cmd_list, daxa::BufferId staging_buffer, u8 *staging, usize staging_offset) const -> usize;
+    void evict_geometry(daxa::Device &device);
+    auto geometry_bytes() const -> u64;
+    // Applies the policy for the CPU copy of the triangles. A spill that fails keeps them.
+    void release_cpu_geometry(CpuGeometry policy);
+    // The triangles of a batch, read back from the spill file if they were spilled. Empty if they were dropped.
+    auto triangles(usize batch) const -> std::span<VECFINAL const>;
+    auto can_evict_geometry() const -> bool {
+        return cpu_geometry != CpuGeometry::DROP;
+    }
+    // Bytes of triangles held in RAM, which excludes spilled ones
+    auto cpu_geometry_bytes() const -> u64;
+    // Where the vertices are drawn relative to their position in the BSP
+    auto draw_offset() const -> f32vec3;
+
 
-    std::map<std::string, TEXSTUFF> texturedTris;
+    // One batch per texture, in the order the BSP lists them. bufObjects[i] holds the vertices of texturedTris[i].
+    std::vector<TEXSTUFF> texturedTris;
     std::vector<BUFFER> bufObjects;
+    CpuGeometry cpu_geometry = CpuGeometry::KEEP;
+    MappedFile spill;
+    AssetRegistry *assets = nullptr;
+    // One texture reference per miptex, and the lightmap pages and light style slot the map uses
+    std::vector<TextureHandle> texture_refs;
+    std::vector<u32> lightmap_pages;
+    u32 light_style_slot = ~0u;
+    // World model bounds, without the offsets
+    f32vec3 mins = {}, maxs = {};
+    // VRAM residency: whether the vertex buffers exist and the textures are marked in use, and the frame the map was last in view
+    bool geometry_resident = false;
+    bool textures_active = false;
+    u64 last_visible_frame = 0;
     std::string mapId;
     std::string parent_mapId;
     VERTEX offset;
@@ -143,6 +233,6 @@ class BSP {
     bool show_gizmo = false;
 };
 
-extern std::map<std::string, BSP_TEXTURE> textures;
-extern std::map<std::string, std::vector<std::pair<VERTEX, std::string>>> landmarks;
-extern std::map<std::string, std::vector<std::string>> dontRenderModel;
+// Offset of a map relative to the origin maps, found through the landmarks it shares with maps placed before it.
+// Computed once and then cached in the registry. Sets `parent_mapId` when it is first computed.
+auto place_map(AssetRegistry &assets, std::string const &mapId, std::string &parent_mapId) -> VERTEX;
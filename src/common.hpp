@@ -9,6 +9,7 @@
 #include <cmath>
 #include <map>
 #include <algorithm>
+#include <mutex>
 #include <assert.h>
 
 #include <daxa/daxa.hpp>
@@ -19,14 +20,37 @@ using namespace daxa::math_operators;
 #include "../shared/shared.inl"
 
 #define COUNT_DRAWS 0
+#define COUNT_ALLOCATIONS 0
 #define EXPORT_ASSETS 0
 #define EXPORT_IMAGES 1
 #define EXPORT_MESHES 1
+#define BENCHMARK_LIGHTMAP_PACKING 0
+#define BENCHMARK_FACE_PROCESSING 0
+#define BENCHMARK_ENTITY_PARSING 0
+#define BENCHMARK_UPSCALER 0
 
 #if COUNT_DRAWS
 extern usize draw_count;
 #endif
 
+#if COUNT_ALLOCATIONS
+#include <atomic>
+extern std::atomic<u64> heap_allocation_count;
+extern std::atomic<u64> buffer_creation_count;
+#endif
+
+// All buffers are created through here, so that the Debug window can report buffer creations per frame.
+inline auto create_buffer(daxa::Device &device, daxa::BufferInfo const &info) -> daxa::BufferId {
+#if COUNT_ALLOCATIONS
+    buffer_creation_count.fetch_add(1, std::memory_order_relaxed);
+#endif
+    return device.create_buffer(info);
+}
+
+// Map loader threads upload while the main thread renders. Every submission to the device queue, and
+// every wait for the whole device, holds this.
+extern std::mutex gpu_queue_mutex;
+
 struct VERTEX {
     float x, y, z;
     void fixHand() {
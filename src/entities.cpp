@@ -1,10 +1,104 @@
+#include <charconv>
+#include <chrono>
 #include <cmath>
+#include <unordered_map>
 
 #include "common.hpp"
 #include "bsp.hpp"
 #include "ConfigXML.hpp"
+#include "entities.hpp"
 
-void parse_entities(const std::string &szStr, const std::string &id, const MapEntry &sMapEntry) {
+namespace {
+    struct EntityTokenizer {
+        std::string_view text;
+        usize pos = 0;
+
+        // Empty once the text is used up. `quoted` tells a quoted empty string from the end.
+        auto next(bool &quoted) -> std::string_view {
+            quoted = false;
+            while (pos < text.size()) {
+                if (static_cast<unsigned char>(text[pos]) <= ' ') {
+                    pos++;
+                } else if (text.substr(pos, 2) == "//") {
+                    auto const eol = text.find('\n', pos);
+                    pos = eol != std::string_view::npos ? eol : text.size();
+                } else {
+                    break;
+                }
+            }
+            if (pos >= text.size())
+                return {};
+            auto const begin = pos;
+            if (text[pos] == '"') {
+                quoted = true;
+                // No escapes, like COM_Parse: a backslash is text, so Windows paths keep their closing quote
+                auto const end = std::min(text.find('"', begin + 1), text.size());
+                pos = std::min(end + 1, text.size());
+                return text.substr(begin + 1, end - begin - 1);
+            }
+            if (text[pos] == '{' || text[pos] == '}')
+                return text.substr(pos++, 1);
+            while (pos < text.size() && static_cast<unsigned char>(text[pos]) > ' ' && text[pos] != '{' && text[pos] != '}' && text[pos] != '"')
+                pos++;
+            return text.substr(begin, pos - begin);
+        }
+    };
+
+    auto to_int(std::string_view str) -> int {
+        int result = 0;
+        while (!str.empty() && (str.front() == ' ' || str.front() == '+'))
+            str.remove_prefix(1);
+        std::from_chars(str.data(), str.data() + str.size(), result);
+        return result;
+    }
+} // namespace
+
+auto parse_entity_table(std::string_view lump) -> EntityTable {
+    lump = lump.substr(0, lump.find('\0'));
+    auto table = EntityTable{};
+    auto interned = std::unordered_map<std::string_view, u32>{};
+    auto tokens = EntityTokenizer{.text = lump};
+    auto const is_end = [](std::string_view token, bool quoted) { return !quoted && (token.empty() || token == "{" || token == "}"); };
+    bool quoted = false;
+    while (true) {
+        auto const open = tokens.next(quoted);
+        if (open.empty() && !quoted)
+            break;
+        if (quoted || open != "{") {
+            std::cerr << "Missing stuff in entity: " << open << std::endl;
+            break;
+        }
+        auto &entity = table.entities.emplace_back();
+        entity.first_pair = static_cast<u32>(table.pairs.size());
+        while (true) {
+            bool key_quoted = false;
+            auto const key = tokens.next(key_quoted);
+            if (!key_quoted && key == "}")
+                break;
+            auto const value = tokens.next(quoted);
+            if (is_end(key, key_quoted) || is_end(value, quoted)) {
+                // Keeps the entities before it, the rest of the lump can't be trusted
+                std::cerr << "Malformed entity " << table.entities.size() - 1 << " at key \"" << key << "\"" << std::endl;
+                table.pairs.resize(entity.first_pair);
+                table.entities.pop_back();
+                return table;
+            }
+            table.pairs.push_back({.key = key, .value = value});
+            if (key == "classname") {
+                auto const [it, added] = interned.try_emplace(value, static_cast<u32>(table.classnames.size()));
+                if (added)
+                    table.classnames.push_back(value);
+                entity.classname = it->second;
+            }
+        }
+        entity.pair_n = static_cast<u32>(table.pairs.size()) - entity.first_pair;
+    }
+    return table;
+}
+
+#if BENCHMARK_ENTITY_PARSING
+// The line based parser the entity table replaced, kept for comparison
+static auto legacy_parse_entities(const std::string &szStr, const MapEntry &sMapEntry) -> MapEntities {
     std::stringstream ss(szStr);
 
     int status = 0;
@@ -13,12 +107,18 @@ void parse_entities(const std::string &szStr, const std::string &id, const MapEn
     std::string targetname;
     std::string landmark;
     std::string modelname;
+    std::string pattern;
+    int style = 0;
+    int spawnflags = 0;
+    bool isLight = false;
     bool isLandMark = false;
     bool isChangeLevel = false;
     bool isTeleport = false;
 
     std::map<std::string, int> changelevels;
     std::map<std::string, VERTEX> ret;
+    std::vector<std::string> hidden_models;
+    std::map<int, std::string> switchable_styles;
 
     while (ss.good()) {
         std::string str;
@@ -26,6 +126,7 @@ void parse_entities(const std::string &szStr, const std::string &id, const MapEn
         if (status == 0) {
             if (str == "{") {
                 status = 1, isLandMark = false, isChangeLevel = false, isTeleport = false;
+                isLight = false, style = 0, spawnflags = 0, pattern.clear();
             } else {
                 if (ss.good()) {
                     std::cerr << "Missing stuff in entity: " << str << std::endl;
@@ -57,12 +158,19 @@ void parse_entities(const std::string &szStr, const std::string &id, const MapEn
                     }
                 }
                 if (isTeleport || isChangeLevel) {
-                    dontRenderModel[id].push_back(modelname);
+                    hidden_models.push_back(modelname);
+                }
+                if (isLight && style >= 32) {
+                    // Switchable light, spawnflag 1 means it starts off
+                    switchable_styles[style] = (spawnflags & 1) ? "a" : (pattern.empty() ? "m" : pattern);
                 }
             } else {
                 if (str == R"("classname" "info_landmark")") {
                     isLandMark = true;
                 }
+                if (str == R"("classname" "light")" || str == R"("classname" "light_spot")") {
+                    isLight = true;
+                }
                 if (str == R"("classname" "trigger_changelevel")") {
                     isChangeLevel = true;
                 }
@@ -81,6 +189,16 @@ void parse_entities(const std::string &szStr, const std::string &id, const MapEn
                     targetname = str.substr(14);
                     targetname.erase(targetname.size() - 1);
                 }
+                if (str.substr(0, 7) == "\"style\"") {
+                    style = atoi(str.substr(9).c_str());
+                }
+                if (str.substr(0, 9) == "\"pattern\"") {
+                    pattern = str.substr(11);
+                    pattern.erase(pattern.size() - 1);
+                }
+                if (str.substr(0, 12) == "\"spawnflags\"") {
+                    spawnflags = atoi(str.substr(14).c_str());
+                }
                 if (str.substr(0, 10) == "\"landmark\"") {
                     landmark = str.substr(12);
                     landmark.erase(landmark.size() - 1);
@@ -88,9 +206,107 @@ void parse_entities(const std::string &szStr, const std::string &id, const MapEn
             }
         }
     }
-    for (auto it = ret.begin(); it != ret.end(); it++) {
-        if (changelevels.contains((*it).first)) {
-            landmarks[(*it).first].push_back(make_pair((*it).second, id));
+
+    auto result = MapEntities{};
+    for (auto &[name, position] : ret) {
+        if (changelevels.contains(name))
+            result.landmarks.emplace(name, position);
+    }
+    result.hidden_models = std::move(hidden_models);
+    result.switchable_styles = std::move(switchable_styles);
+    return result;
+}
+#endif
+
+auto parse_entities(std::string_view lump, const MapEntry &sMapEntry) -> MapEntities {
+#if BENCHMARK_ENTITY_PARSING
+    auto const start = std::chrono::steady_clock::now();
+#endif
+    auto const table = parse_entity_table(lump);
+
+    std::map<std::string_view, VERTEX> landmarks;
+    std::vector<std::string_view> changelevel_landmarks;
+    auto result = MapEntities{};
+    for (auto const &entity : table.entities) {
+        if (entity.classname == EntityTable::NO_CLASSNAME)
+            continue;
+        auto const classname = table.classnames[entity.classname];
+        if (classname == "info_landmark") {
+            float x = NAN;
+            float y = NAN;
+            float z = NAN;
+            sscanf(std::string(table.value(entity, "origin")).c_str(), "%f %f %f", &x, &y, &z);
+            VERTEX v(x, y, z);
+            v.fixHand();
+
+            auto const targetname = table.value(entity, "targetname");
+            if (sMapEntry.m_szOffsetTargetName == targetname) {
+                // Apply map offsets from the config, to fix landmark positions.
+                v.x += sMapEntry.m_fOffsetX;
+                v.y += sMapEntry.m_fOffsetY;
+                v.z += sMapEntry.m_fOffsetZ;
+            }
+            landmarks[targetname] = v;
+        } else if (classname == "light" || classname == "light_spot") {
+            auto const style = to_int(table.value(entity, "style"));
+            if (style >= 32) {
+                // Switchable light, spawnflag 1 means it starts off
+                auto const pattern = table.value(entity, "pattern");
+                result.switchable_styles[style] = (to_int(table.value(entity, "spawnflags")) & 1) ? "a" : (pattern.empty() ? "m" : std::string(pattern));
+            }
+        }
+
+        bool const is_changelevel = classname == "trigger_changelevel";
+        if (is_changelevel) {
+            auto const landmark = table.value(entity, "landmark");
+            if (!landmark.empty())
+                changelevel_landmarks.push_back(landmark);
+        }
+        if (is_changelevel || classname == "trigger_teleport" || classname == "func_pendulum" || classname == "trigger_transition" ||
+            classname == "trigger_hurt" || classname == "func_train" || classname == "func_door_rotating") {
+            auto const model = table.value(entity, "model");
+            if (!model.empty())
+                result.hidden_models.emplace_back(model);
+        }
+    }
+
+    for (auto const &[name, position] : landmarks) {
+        if (std::find(changelevel_landmarks.begin(), changelevel_landmarks.end(), name) != changelevel_landmarks.end())
+            result.landmarks.emplace(name, position);
+    }
+
+#if BENCHMARK_ENTITY_PARSING
+    {
+        auto const end = std::chrono::steady_clock::now();
+        auto const legacy = legacy_parse_entities(std::string(lump.substr(0, lump.find('\0'))), sMapEntry);
+        auto const legacy_end = std::chrono::steady_clock::now();
+        auto identical = legacy.hidden_models == result.hidden_models && legacy.switchable_styles == result.switchable_styles &&
+                         legacy.landmarks.size() == result.landmarks.size();
+        for (auto const &[name, v] : result.landmarks) {
+            auto const it = legacy.landmarks.find(name);
+            identical = identical && it != legacy.landmarks.end() && std::memcmp(&it->second, &v, sizeof(v)) == 0;
         }
+        std::cout << "Entity parsing (" << sMapEntry.m_szName << ", " << table.entities.size() << " entities, " << table.classnames.size() << " classes): legacy "
+                  << std::chrono::duration<f64, std::micro>(legacy_end - end).count() << "us, table " << std::chrono::duration<f64, std::micro>(end - start).count() << "us, "
+                  << (identical ? "identical output" : "OUTPUT DIFFERS") << std::endl;
+    }
+#endif
+    return result;
+}
+
+void register_entities(MapEntities &&entities, const std::string &id, AssetRegistry &assets) {
+    // Parsed without the lock, other loaders only wait for the tables to be updated
+    auto const lock = std::lock_guard{assets.entity_mutex};
+    assets.dontRenderModel[id] = std::move(entities.hidden_models);
+    assets.lightstyles[id] = std::move(entities.switchable_styles);
+    for (auto &[name, positions] : assets.landmarks) {
+        std::erase_if(positions, [&id](auto const &position) { return position.second == id; });
+    }
+    for (auto const &[name, position] : entities.landmarks) {
+        assets.landmarks[name].push_back(make_pair(position, id));
     }
 }
+
+void parse_entities(std::string_view lump, const std::string &id, const MapEntry &sMapEntry, AssetRegistry &assets) {
+    register_entities(parse_entities(lump, sMapEntry), id, assets);
+}
@@ -1,8 +1,68 @@
 #ifndef ENTITIES_H
 #define ENTITIES_H
 
+#include "common.hpp"
+
+#include <map>
+#include <string_view>
+
 struct MapEntry;
+struct AssetRegistry;
+
+// Every entity of a map's entity lump, with keys and values viewing the lump, so it must outlive the table.
+// - Tokens may be separated by any whitespace and `//` comments, like the engine's parser allows.
+// - A quoted string ends at the next quote, there are no escapes, so a value is the text between its quotes.
+// - Classnames are interned, so that finding all entities of a class compares integers.
+struct EntityTable {
+    static constexpr u32 NO_CLASSNAME = ~0u;
+
+    struct Pair {
+        std::string_view key;
+        std::string_view value;
+    };
+    struct Entity {
+        u32 classname = NO_CLASSNAME;
+        u32 first_pair = 0;
+        u32 pair_n = 0;
+    };
+    std::vector<std::string_view> classnames;
+    std::vector<Pair> pairs;
+    std::vector<Entity> entities;
+
+    // NO_CLASSNAME if no entity has it
+    auto classname_id(std::string_view classname) const -> u32 {
+        auto const it = std::find(classnames.begin(), classnames.end(), classname);
+        return it != classnames.end() ? static_cast<u32>(it - classnames.begin()) : NO_CLASSNAME;
+    }
+    auto is(Entity const &entity, std::string_view classname) const -> bool {
+        return entity.classname != NO_CLASSNAME && classnames[entity.classname] == classname;
+    }
+    // The last value of the key, empty if the entity doesn't have it
+    auto value(Entity const &entity, std::string_view key) const -> std::string_view {
+        for (auto i = entity.first_pair + entity.pair_n; i > entity.first_pair; i--) {
+            if (pairs[i - 1].key == key)
+                return pairs[i - 1].value;
+        }
+        return {};
+    }
+};
+
+// Stops at the first NUL, and at the first malformed entity after reporting it
+auto parse_entity_table(std::string_view lump) -> EntityTable;
+
+// What the renderer needs from a map's entity lump, before it is added to the registry
+struct MapEntities {
+    // Landmarks a changelevel of the map leads through, with their position
+    std::map<std::string, VERTEX> landmarks;
+    std::vector<std::string> hidden_models;
+    std::map<int, std::string> switchable_styles;
+};
 
-void parse_entities(const std::string &str, const std::string &id, const MapEntry &sMapEntry);
+// Touches no shared state, so maps can be parsed on several threads
+auto parse_entities(std::string_view lump, const MapEntry &sMapEntry) -> MapEntities;
+// Replaces whatever an earlier load of the map `id` left in the registry's entity tables.
+// Landmarks are matched in the order maps are registered, so register them in config order.
+void register_entities(MapEntities &&entities, const std::string &id, AssetRegistry &assets);
+void parse_entities(std::string_view lump, const std::string &id, const MapEntry &sMapEntry, AssetRegistry &assets);
 
 #endif
@@ -0,0 +1,188 @@
+#include "face_builder.hpp"
+#include "utils/parallel_chunks.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FACE_BUILDER_SSE2 1
+#include <emmintrin.h>
+#else
+#define FACE_BUILDER_SSE2 0
+#endif
+
+FaceBuckets::FaceBuckets(TextureRegistry const &registry, std::vector<TextureHandle> const &miptex_textures) {
+    // Miptexes with the same name share a texture handle and so a bucket
+    of_miptex.reserve(miptex_textures.size());
+    for (auto const texture : miptex_textures) {
+        auto const it = std::find(textures.begin(), textures.end(), texture);
+        of_miptex.push_back(static_cast<u32>(it - textures.begin()));
+        if (it == textures.end()) {
+            textures.push_back(texture);
+            // Textures another loader claimed first may still be decoding
+            auto const &tex = registry.wait_ready(texture);
+            texture_w.push_back(static_cast<f32>(tex.w));
+            texture_h.push_back(static_cast<f32>(tex.h));
+        }
+    }
+}
+
+void FaceBuilder::load_vertices(LoadArena &arena, std::span<VERTEX const> vertices, std::span<BSPEDGE const> edges, std::span<i32 const> surfedges) {
+    auto const n = surfedges.size();
+    xs = arena.alloc<f32>(n);
+    ys = arena.alloc<f32>(n);
+    zs = arena.alloc<f32>(n);
+    ss = arena.alloc<f32>(n);
+    ts = arena.alloc<f32>(n);
+    for (usize i = 0; i < n; i++) {
+        auto const e = surfedges[i];
+        VERTEX const &v = vertices[edges[e > 0 ? e : -e].iVertex[e > 0 ? 0 : 1]];
+        xs[i] = v.x;
+        ys[i] = v.y;
+        zs[i] = v.z;
+    }
+}
+
+// Same operation order as the scalar path, so both produce identical coordinates
+static void project_span(f32 const *xs, f32 const *ys, f32 const *zs, u32 n, BSPTEXTUREINFO const &b, f32 *ss, f32 *ts, FaceExtents &extents, [[maybe_unused]] bool use_sse2) {
+    u32 i = 0;
+#if FACE_BUILDER_SSE2
+    if (use_sse2 && n >= 4) {
+        auto const s_x = _mm_set1_ps(b.vS.x), s_y = _mm_set1_ps(b.vS.y), s_z = _mm_set1_ps(b.vS.z), s_shift = _mm_set1_ps(b.fSShift);
+        auto const t_x = _mm_set1_ps(b.vT.x), t_y = _mm_set1_ps(b.vT.y), t_z = _mm_set1_ps(b.vT.z), t_shift = _mm_set1_ps(b.fTShift);
+        auto min_s = _mm_set1_ps(extents.min_s), min_t = _mm_set1_ps(extents.min_t);
+        auto max_s = _mm_set1_ps(extents.max_s), max_t = _mm_set1_ps(extents.max_t);
+        for (; i + 4 <= n; i += 4) {
+            auto const x = _mm_loadu_ps(xs + i);
+            auto const y = _mm_loadu_ps(ys + i);
+            auto const z = _mm_loadu_ps(zs + i);
+            auto const s = _mm_add_ps(_mm_add_ps(_mm_add_ps(s_shift, _mm_mul_ps(s_x, x)), _mm_mul_ps(s_y, y)), _mm_mul_ps(s_z, z));
+            auto const t = _mm_add_ps(_mm_add_ps(_mm_add_ps(t_shift, _mm_mul_ps(t_x, x)), _mm_mul_ps(t_y, y)), _mm_mul_ps(t_z, z));
+            _mm_storeu_ps(ss + i, s);
+            _mm_storeu_ps(ts + i, t);
+            min_s = _mm_min_ps(min_s, s);
+            min_t = _mm_min_ps(min_t, t);
+            max_s = _mm_max_ps(max_s, s);
+            max_t = _mm_max_ps(max_t, t);
+        }
+        alignas(16) f32 lanes[4][4];
+        _mm_store_ps(lanes[0], min_s);
+        _mm_store_ps(lanes[1], min_t);
+        _mm_store_ps(lanes[2], max_s);
+        _mm_store_ps(lanes[3], max_t);
+        for (u32 lane = 0; lane < 4; lane++) {
+            extents.min_s = std::min(extents.min_s, lanes[0][lane]);
+            extents.min_t = std::min(extents.min_t, lanes[1][lane]);
+            extents.max_s = std::max(extents.max_s, lanes[2][lane]);
+            extents.max_t = std::max(extents.max_t, lanes[3][lane]);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        ss[i] = b.fSShift + b.vS.x * xs[i] + b.vS.y * ys[i] + b.vS.z * zs[i];
+        ts[i] = b.fTShift + b.vT.x * xs[i] + b.vT.y * ys[i] + b.vT.z * zs[i];
+        extents.min_s = std::min(extents.min_s, ss[i]);
+        extents.min_t = std::min(extents.min_t, ts[i]);
+        extents.max_s = std::max(extents.max_s, ss[i]);
+        extents.max_t = std::max(extents.max_t, ts[i]);
+    }
+}
+
+void FaceBuilder::project(LoadArena &arena, std::span<BSPTEXTUREINFO const> texinfos) {
+    extents = arena.alloc<FaceExtents>(faces.size());
+    std::fill(extents.begin(), extents.end(), FaceExtents{});
+    // Faces own disjoint surfedge ranges, so the chunks never write the same element
+    parallel_chunks(faces.size(), chunk_count(), [&](usize, usize face_begin, usize face_end) {
+        for (usize i = face_begin; i < face_end; i++) {
+            auto const &f = faces[i];
+            // Degenerate faces keep the empty extents and are never drawn
+            if (f.nEdges < 3)
+                continue;
+            auto const first = f.iFirstEdge;
+            project_span(xs.data() + first, ys.data() + first, zs.data() + first, f.nEdges, texinfos[f.iTextureInfo], ss.data() + first, ts.data() + first, extents[i], use_sse2);
+        }
+    });
+}
+
+auto FaceBuilder::chunk_count() const -> usize {
+    auto const chunk_n = parallel_chunk_count(faces.size(), MIN_FACES_PER_CHUNK);
+    return max_chunk_n != 0 ? std::min<usize>(chunk_n, max_chunk_n) : chunk_n;
+}
+
+void FaceBuilder::emit_face(u32 face_i, BSPTEXTUREINFO const &texinfo, FaceBuckets const &buckets, LMAP const &lmap, std::vector<VECFINAL> &face_vertices, VECFINAL *dst) const {
+    auto const &f = faces[face_i];
+    auto const &e = extents[face_i];
+    auto const bucket = buckets.of_miptex[texinfo.iMiptex];
+    auto const tex_w = buckets.texture_w[bucket];
+    auto const tex_h = buckets.texture_h[bucket];
+
+    float const mid_poly_s = (e.min_s + e.max_s) / 2.0f;
+    float const mid_poly_t = (e.min_t + e.max_t) / 2.0f;
+    float const mid_tex_s = (float)e.lightmap_w() / 2.0f;
+    float const mid_tex_t = (float)e.lightmap_h() / 2.0f;
+    float const fX = lmap.finalX;
+    float const fY = lmap.finalY;
+    auto const fLayer = static_cast<float>(lmap.page);
+
+    // Every face vertex once, the fan below only copies them
+    face_vertices.clear();
+    for (u32 i = f.iFirstEdge; i < f.iFirstEdge + f.nEdges; i++) {
+        COORDS lc{};
+        lc.u = mid_tex_s + (ss[i] - mid_poly_s) / 16.0f;
+        lc.v = mid_tex_t + (ts[i] - mid_poly_t) / 16.0f;
+        lc.u += fX;
+        lc.v += fY;
+        lc.u /= LIGHTMAP_PAGE_SIZE;
+        lc.v /= LIGHTMAP_PAGE_SIZE;
+        auto const c = COORDS{.u = ss[i] / tex_w, .v = ts[i] / tex_h};
+        auto v = VERTEX(xs[i], ys[i], zs[i]);
+        v.fixHand();
+        face_vertices.emplace_back(v, c, lc, fLayer);
+    }
+    for (u32 j = 2, k = 1; j < f.nEdges; j++, k++) {
+        *dst++ = face_vertices[0];
+        *dst++ = face_vertices[k];
+        *dst++ = face_vertices[j];
+    }
+}
+
+void FaceBuilder::triangulate(LoadArena &arena, std::span<BSPTEXTUREINFO const> texinfos, FaceBuckets const &buckets, std::span<u8 const> face_drawn, std::span<LMAP const> lmaps,
+                              std::span<VECFINAL> &triangles, std::vector<u32> &bucket_offsets) const {
+    // Counting sort by bucket over contiguous face chunks: every chunk counts its triangles per bucket,
+    // the prefix sum runs bucket-major then chunk-major, and each chunk scatters its faces in order.
+    // A bucket therefore holds its faces in face order no matter how many chunks there are,
+    // and the result is identical to the serial loader.
+    auto const chunk_n = chunk_count();
+    auto const bucket_n = buckets.size();
+    auto chunk_cursors = std::vector<u32>(chunk_n * bucket_n, 0);
+    auto const chunk_bucket = [bucket_n](usize chunk_i, u32 bucket) { return chunk_i * bucket_n + bucket; };
+
+    parallel_chunks(faces.size(), chunk_n, [&](usize chunk_i, usize face_begin, usize face_end) {
+        for (usize i = face_begin; i < face_end; i++) {
+            if (face_drawn[i])
+                chunk_cursors[chunk_bucket(chunk_i, buckets.of_miptex[texinfos[faces[i].iTextureInfo].iMiptex])] += faces[i].nEdges - 2;
+        }
+    });
+
+    bucket_offsets.assign(bucket_n + 1, 0);
+    u32 offset = 0;
+    for (u32 b = 0; b < bucket_n; b++) {
+        bucket_offsets[b] = offset;
+        for (usize chunk_i = 0; chunk_i < chunk_n; chunk_i++) {
+            auto const count = chunk_cursors[chunk_bucket(chunk_i, b)];
+            chunk_cursors[chunk_bucket(chunk_i, b)] = offset;
+            offset += count;
+        }
+    }
+    bucket_offsets[bucket_n] = offset;
+
+    triangles = arena.alloc<VECFINAL>(static_cast<usize>(offset) * 3);
+    parallel_chunks(faces.size(), chunk_n, [&](usize chunk_i, usize face_begin, usize face_end) {
+        auto face_vertices = std::vector<VECFINAL>{};
+        for (usize i = face_begin; i < face_end; i++) {
+            if (!face_drawn[i])
+                continue;
+            auto const &texinfo = texinfos[faces[i].iTextureInfo];
+            auto &cursor = chunk_cursors[chunk_bucket(chunk_i, buckets.of_miptex[texinfo.iMiptex])];
+            emit_face(static_cast<u32>(i), texinfo, buckets, lmaps[i], face_vertices, triangles.data() + static_cast<usize>(cursor) * 3);
+            cursor += faces[i].nEdges - 2;
+        }
+    });
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "bsp.hpp"
+#include "utils/load_arena.hpp"
+
+// Texture space bounds of a face's vertices, in texels
+struct FaceExtents {
+    f32 min_s = 99999, min_t = 99999;
+    f32 max_s = -99999, max_t = -99999;
+
+    // Lightmap size in luxels, one luxel every 16 texels
+    auto lightmap_w() const -> i32 {
+        return static_cast<i32>(std::ceil(max_s / 16) - std::floor(min_s / 16) + 1);
+    }
+    auto lightmap_h() const -> i32 {
+        return static_cast<i32>(std::ceil(max_t / 16) - std::floor(min_t / 16) + 1);
+    }
+};
+
+// Groups the miptexes of a BSP by texture, which is what the triangles are drawn by
+struct FaceBuckets {
+    std::vector<u32> of_miptex;
+    std::vector<TextureHandle> textures;
+    std::vector<f32> texture_w, texture_h;
+
+    FaceBuckets(TextureRegistry const &registry, std::vector<TextureHandle> const &miptex_textures);
+    auto size() const -> u32 {
+        return static_cast<u32>(textures.size());
+    }
+};
+
+// The faces of one BSP in SoA form. Every surfedge vertex is projected onto its face's texinfo axes
+// exactly once (4 at a time with SSE2), and the extents come out of the same loop. Triangulation then
+// reuses those projections and writes the fan triangles straight into per-texture ranges of one array.
+// Both loops run over contiguous face chunks on worker threads, the output does not depend on the chunk count.
+// All arrays live in the load arena and are only valid until it is reset.
+struct FaceBuilder {
+    std::span<BSPFACE> faces;
+    // Surfedge vertex positions and their texture space coordinates, in texels
+    std::span<f32> xs, ys, zs;
+    std::span<f32> ss, ts;
+    std::span<FaceExtents> extents;
+
+    // Resolves the surfedges to vertex positions
+    void load_vertices(LoadArena &arena, std::span<VERTEX const> vertices, std::span<BSPEDGE const> edges, std::span<i32 const> surfedges);
+    void project(LoadArena &arena, std::span<BSPTEXTUREINFO const> texinfos);
+
+    // Triangles of the faces with `face_drawn` set, grouped by bucket with a counting sort. Bucket b owns
+    // triangles [bucket_offsets[b], bucket_offsets[b + 1]), each 3 consecutive vertices, in face order.
+    void triangulate(LoadArena &arena, std::span<BSPTEXTUREINFO const> texinfos, FaceBuckets const &buckets, std::span<u8 const> face_drawn, std::span<LMAP const> lmaps,
+                     std::span<VECFINAL> &triangles, std::vector<u32> &bucket_offsets) const;
+
+    // Chunks the face loops are split into, spread over worker threads. Small maps stay on the calling thread.
+    static constexpr usize MIN_FACES_PER_CHUNK = 2048;
+    u32 max_chunk_n = 0; // 0 means one per hardware thread
+    bool use_sse2 = true; // The scalar projection gives the same result, the face processing benchmark checks it
+    auto chunk_count() const -> usize;
+
+  private:
+    void emit_face(u32 face_i, BSPTEXTUREINFO const &texinfo, FaceBuckets const &buckets, LMAP const &lmap, std::vector<VECFINAL> &face_vertices, VECFINAL *dst) const;
+};
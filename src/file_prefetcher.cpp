@@ -0,0 +1,108 @@
+#include "file_prefetcher.hpp"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+FilePrefetcher::FilePrefetcher(GameFileSystem const &a_files, std::vector<std::string> a_paths, u64 a_window)
+    : files{a_files}, paths{std::move(a_paths)}, window{a_window} {
+    worker = std::thread([this]() { run(); });
+}
+
+FilePrefetcher::~FilePrefetcher() {
+    {
+        auto const lock = std::lock_guard{mutex};
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+void FilePrefetcher::done() {
+    {
+        auto const lock = std::lock_guard{mutex};
+        ++done_n;
+    }
+    cv.notify_all();
+}
+
+void FilePrefetcher::run() {
+    auto const size_of = [this](usize i) -> u64 {
+        auto const *const entry = files.find(paths[i]);
+        return entry != nullptr ? entry->size : 0;
+    };
+    auto chunk = std::vector<char>(CHUNK_SIZE);
+    for (usize i = 0; i < paths.size(); i++) {
+        auto const *const entry = files.find(paths[i]);
+        if (entry == nullptr)
+            continue;
+        {
+            auto lock = std::unique_lock{mutex};
+            cv.wait(lock, [&]() {
+                if (stopping || i <= done_n)
+                    return true;
+                u64 ahead = 0;
+                for (auto j = done_n; j <= i; j++)
+                    ahead += size_of(j);
+                return ahead <= window;
+            });
+            if (stopping)
+                return;
+            // The loader is past it already, reading it now would only evict what comes next
+            if (i < done_n)
+                continue;
+        }
+
+        auto const path = files.source_path(*entry);
+#if defined(_WIN32)
+        auto in = std::ifstream(path, std::ios::binary);
+        in.seekg(static_cast<std::streamoff>(entry->offset), std::ios::beg);
+        for (u64 offset = 0; offset < entry->size && in && !stopping; offset += CHUNK_SIZE) {
+            in.read(chunk.data(), static_cast<std::streamsize>(std::min<u64>(CHUNK_SIZE, entry->size - offset)));
+            read_n.fetch_add(static_cast<u64>(in.gcount()), std::memory_order_relaxed);
+        }
+#else
+        auto const fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            continue;
+#if defined(__linux__)
+        // Lets the kernel read further ahead of each chunk than its default window
+        posix_fadvise(fd, static_cast<off_t>(entry->offset), static_cast<off_t>(entry->size), POSIX_FADV_SEQUENTIAL);
+#endif
+        for (u64 offset = 0; offset < entry->size && !stopping; offset += CHUNK_SIZE) {
+            auto const n = pread(fd, chunk.data(), std::min<u64>(CHUNK_SIZE, entry->size - offset), static_cast<off_t>(entry->offset + offset));
+            if (n <= 0)
+                break;
+            read_n.fetch_add(static_cast<u64>(n), std::memory_order_relaxed);
+        }
+        ::close(fd);
+#endif
+    }
+}
+
+auto page_cache_residency([[maybe_unused]] GameFileSystem const &files, [[maybe_unused]] std::vector<std::string> const &paths) -> std::optional<PageCacheResidency> {
+#if defined(__linux__)
+    auto result = PageCacheResidency{.bytes = 0, .cached_bytes = 0};
+    auto const page_size = static_cast<usize>(sysconf(_SC_PAGESIZE));
+    auto pages = std::vector<unsigned char>{};
+    for (auto const &path : paths) {
+        auto const file = files.read(path);
+        if (!file || file->size() == 0)
+            continue;
+        // Mapping the file reads nothing, mincore() only looks at what is cached
+        auto const begin = reinterpret_cast<uintptr_t>(file->bytes.data()) & ~(page_size - 1);
+        auto const end = reinterpret_cast<uintptr_t>(file->bytes.data() + file->size());
+        pages.resize((end - begin + page_size - 1) / page_size);
+        if (mincore(reinterpret_cast<void *>(begin), end - begin, pages.data()) != 0)
+            return std::nullopt;
+        auto const cached_n = static_cast<u64>(std::count_if(pages.begin(), pages.end(), [](unsigned char page) { return (page & 1) != 0; }));
+        result.bytes += file->size();
+        result.cached_bytes += std::min<u64>(cached_n * page_size, file->size());
+    }
+    return result;
+#else
+    return std::nullopt;
+#endif
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "game_fs.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+// Reads the files a load is going to consume ahead of it, in the order it consumes them. On a cold page cache the
+// loaders then find their lumps in memory instead of waiting on small random reads, one file after the other.
+// - Each file is read front to back in large chunks on a thread of its own, with the OS told the reads are sequential.
+// - It stays at most `window` bytes ahead of the files the loader is done with, so that a large config does not
+//   evict what was read ahead before it is used.
+struct FilePrefetcher {
+    static constexpr usize CHUNK_SIZE = usize{1} << 20;
+
+    FilePrefetcher(GameFileSystem const &files, std::vector<std::string> paths, u64 window = u64{256} << 20);
+    FilePrefetcher(FilePrefetcher const &) = delete;
+    auto operator=(FilePrefetcher const &) -> FilePrefetcher & = delete;
+    // Stops after the chunk being read
+    ~FilePrefetcher();
+
+    // The loader is done with the next file of the list
+    void done();
+
+    auto bytes_read() const -> u64 {
+        return read_n.load(std::memory_order_relaxed);
+    }
+
+  private:
+    GameFileSystem const &files;
+    std::vector<std::string> paths;
+    u64 window;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    usize done_n = 0;
+    // Also read by the worker between chunks, without the lock
+    std::atomic<bool> stopping = false;
+    std::atomic<u64> read_n = 0;
+
+    void run();
+};
+
+// Total size of the files, and how much of it is in the OS page cache. Measured without reading anything.
+// Empty where the OS can't tell.
+struct PageCacheResidency {
+    u64 bytes;
+    u64 cached_bytes;
+};
+auto page_cache_residency(GameFileSystem const &files, std::vector<std::string> const &paths) -> std::optional<PageCacheResidency>;
@@ -0,0 +1,126 @@
+#include "game_fs.hpp"
+
+#include <cctype>
+#include <chrono>
+#include <system_error>
+
+// Extracted from the Quake PAK format, which GoldSrc kept
+struct PAKHEADER {
+    char szMagic[4]; // "PACK"
+    int32_t nDirOffset;
+    int32_t nDirLength;
+};
+struct PAKDIRENTRY {
+    char szName[56];
+    int32_t nFilePos;
+    int32_t nFileLen;
+};
+
+auto normalize_game_path(std::string_view path) -> std::string {
+    auto result = std::string{};
+    result.reserve(path.size());
+    for (auto c : path) {
+        if (c == '\\')
+            c = '/';
+        if (c == '/' && result.empty())
+            continue;
+        result.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
+    }
+    return result;
+}
+
+void GameFileSystem::add_pak(std::filesystem::path const &path) {
+    std::ifstream in(path, std::ios::binary);
+    PAKHEADER header{};
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in || std::memcmp(header.szMagic, "PACK", 4) != 0 || header.nDirOffset < 0 || header.nDirLength < 0) {
+        std::cerr << "Can't read PAK " << path.string() << "." << std::endl;
+        return;
+    }
+    auto dir = std::vector<PAKDIRENTRY>(static_cast<usize>(header.nDirLength) / sizeof(PAKDIRENTRY));
+    in.seekg(header.nDirOffset, std::ios::beg);
+    in.read(reinterpret_cast<char *>(dir.data()), static_cast<std::streamsize>(dir.size() * sizeof(PAKDIRENTRY)));
+    if (!in) {
+        std::cerr << "Can't read the directory of PAK " << path.string() << "." << std::endl;
+        return;
+    }
+
+    auto const source = static_cast<u32>(sources.size());
+    auto &s = *sources.emplace_back(std::make_unique<Source>());
+    s.path = path;
+    s.pak = true;
+    ++pak_n;
+    for (auto const &e : dir) {
+        if (e.nFilePos < 0 || e.nFileLen < 0)
+            continue;
+        auto const name = std::string_view(e.szName, static_cast<usize>(std::find(std::begin(e.szName), std::end(e.szName), '\0') - std::begin(e.szName)));
+        entries.try_emplace(normalize_game_path(name), Entry{.source = source, .offset = static_cast<u64>(e.nFilePos), .size = static_cast<u64>(e.nFileLen)});
+    }
+}
+
+void GameFileSystem::add_directory(std::filesystem::path const &root) {
+    auto ec = std::error_code{};
+    for (auto it = std::filesystem::recursive_directory_iterator(root, std::filesystem::directory_options::skip_permission_denied, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file(ec))
+            continue;
+        auto const relative = normalize_game_path(std::filesystem::relative(it->path(), root, ec).generic_string());
+        if (ec || entries.contains(relative))
+            continue;
+        auto const source = static_cast<u32>(sources.size());
+        auto &s = *sources.emplace_back(std::make_unique<Source>());
+        s.path = it->path();
+        entries.emplace(relative, Entry{.source = source, .offset = 0, .size = static_cast<u64>(it->file_size(ec))});
+    }
+}
+
+void GameFileSystem::build(std::vector<std::string> const &game_paths) {
+    auto const start = std::chrono::steady_clock::now();
+    for (auto const &game_path : game_paths) {
+        auto const root = std::filesystem::path(game_path);
+        auto ec = std::error_code{};
+        if (!std::filesystem::is_directory(root, ec))
+            continue;
+        // pak0.pak, pak1.pak... until one is missing, searched from the last one
+        auto paks = std::vector<std::filesystem::path>{};
+        for (u32 i = 0;; i++) {
+            auto const pak = root / ("pak" + std::to_string(i) + ".pak");
+            if (!std::filesystem::is_regular_file(pak, ec))
+                break;
+            paks.push_back(pak);
+        }
+        for (auto it = paks.rbegin(); it != paks.rend(); ++it)
+            add_pak(*it);
+        add_directory(root);
+    }
+    auto const ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Indexed " << entries.size() << " game files (" << pak_n << " PAKs) in " << ms << "ms" << std::endl;
+}
+
+auto GameFileSystem::find(std::string_view path) const -> Entry const * {
+    auto const it = entries.find(normalize_game_path(path));
+    return it != entries.end() ? &it->second : nullptr;
+}
+
+auto GameFileSystem::read(std::string_view path) const -> std::optional<FileView> {
+    auto const *const entry = find(path);
+    if (entry == nullptr)
+        return std::nullopt;
+    if (entry->size == 0)
+        return FileView{};
+    auto const &s = *sources[entry->source];
+    auto const lock = std::lock_guard{s.mutex};
+    if (!s.tried) {
+        s.tried = true;
+        if (!s.file.open(s.path))
+            std::cerr << "Can't map " << s.path.string() << "." << std::endl;
+    }
+    auto const bytes = s.file.bytes();
+    if (entry->offset > bytes.size() || entry->size > bytes.size() - entry->offset)
+        return std::nullopt;
+    return FileView{.bytes = bytes.subspan(entry->offset, entry->size)};
+}
+
+auto GameFileSystem::source_path(Entry const &entry) const -> std::string {
+    return sources[entry.source]->path.string();
+}
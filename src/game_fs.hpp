@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.hpp"
+#include "utils/mapped_file.hpp"
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+
+// Bounds checked reads out of a file's bytes
+struct FileView {
+    std::span<u8 const> bytes;
+
+    auto size() const -> usize {
+        return bytes.size();
+    }
+    // False, leaving `dst` untouched, if the range is not entirely in the file
+    auto read(usize offset, void *dst, usize size) const -> bool {
+        if (offset > bytes.size() || size > bytes.size() - offset)
+            return false;
+        std::memcpy(dst, bytes.data() + offset, size);
+        return true;
+    }
+    // Zero initialized if out of bounds
+    template <typename T>
+    auto read(usize offset) const -> T {
+        T result{};
+        read(offset, &result, sizeof(T));
+        return result;
+    }
+    // The part of [offset, offset + size) that is in the file
+    auto sub(usize offset, usize size) const -> std::span<u8 const> {
+        if (offset > bytes.size())
+            return {};
+        return bytes.subspan(offset, std::min(size, bytes.size() - offset));
+    }
+};
+
+// The game directories of the config and the PAK archives in them, indexed once into one table of relative paths.
+// - Paths are looked up case insensitively, with either slash.
+// - Earlier game directories take precedence over later ones, like trying each in turn did. Within a directory,
+//   PAK contents take precedence over loose files and higher numbered PAKs over lower ones, like in the engine.
+// - A directory or archive is mapped on the first read of a file in it, and stays mapped, so the views read
+//   out of it are valid for as long as the file system lives. Reads may happen on several threads.
+struct GameFileSystem {
+    struct Entry {
+        u32 source;
+        u64 offset;
+        u64 size;
+    };
+
+    GameFileSystem() = default;
+    GameFileSystem(GameFileSystem const &) = delete;
+    auto operator=(GameFileSystem const &) -> GameFileSystem & = delete;
+
+    void build(std::vector<std::string> const &game_paths);
+    auto find(std::string_view path) const -> Entry const *;
+    auto read(std::string_view path) const -> std::optional<FileView>;
+    // Where an entry comes from, for messages
+    auto source_path(Entry const &entry) const -> std::string;
+
+    auto file_count() const -> usize {
+        return entries.size();
+    }
+    auto pak_count() const -> u32 {
+        return pak_n;
+    }
+
+  private:
+    struct Source {
+        std::filesystem::path path;
+        bool pak = false;
+        mutable std::mutex mutex;
+        mutable MappedFile file;
+        mutable bool tried = false;
+    };
+    std::vector<std::unique_ptr<Source>> sources;
+    std::unordered_map<std::string, Entry> entries;
+    u32 pak_n = 0;
+
+    void add_pak(std::filesystem::path const &path);
+    void add_directory(std::filesystem::path const &root);
+};
+
+// The key a path is indexed under: lower case, forward slashes, no leading slash
+auto normalize_game_path(std::string_view path) -> std::string;
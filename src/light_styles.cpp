@@ -0,0 +1,224 @@
+#include "light_styles.hpp"
+
+#include <cmath>
+
+// From the GoldSrc game DLL (world.cpp)
+static constexpr auto light_style_patterns = std::array<std::string_view, 13>{
+    "m",                                                   // 0 normal
+    "mmnmmommommnonmmonqnmmo",                             // 1 flicker (first variety)
+    "abcdefghijklmnopqrstuvwxyzyxwvutsrqponmlkjihgfedcba", // 2 slow strong pulse
+    "mmmmmaaaaammmmmaaaaaabcdefgabcdefg",                  // 3 candle (first variety)
+    "mamamamamama",                                        // 4 fast strobe
+    "jklmnopqrstuvwxyzyxwvutsrqponmlkj",                   // 5 gentle pulse 1
+    "nmonqnmomnmomomno",                                   // 6 flicker (second variety)
+    "mmmaaaabcdefgmmmmaaaammmaamm",                        // 7 candle (second variety)
+    "mmmaaammmaaammmabcdefaaaammmmabcdefmmmaaaa",          // 8 candle (third variety)
+    "aaaaaaaazzzzzzzz",                                    // 9 slow strobe (fourth variety)
+    "mmamammmmammamamaaamammma",                           // 10 fluorescent flicker
+    "abcdefghijklmnopqrrqponmlkjihgfedcba",                // 11 slow pulse not fade to black
+    "mmnnmmnnnmmnn",                                       // 12 underwater light mutation
+};
+
+auto default_light_style_pattern(u32 style) -> std::string_view {
+    if (style < light_style_patterns.size())
+        return light_style_patterns[style];
+    if (style == 63)
+        return "a"; // testing
+    return "m";
+}
+
+static auto pattern_value(std::string const &pattern, u64 tick) -> u8 {
+    if (pattern.empty())
+        return LIGHT_STYLE_NORMAL;
+    auto const c = pattern[tick % pattern.size()];
+    return static_cast<u8>(std::clamp(c, 'a', 'z') - 'a');
+}
+
+LightStyles::LightStyles() {
+    // Same curve the static lightmaps are baked with
+    for (int i = 0; i < 256; i++) {
+        gamma_table[i] = static_cast<u8>(pow(i / 255.0, 1.0 / 3.0) * 255);
+    }
+}
+
+auto LightStyles::add_map(std::map<int, std::string> const &switchable_patterns) -> u32 {
+    auto map_slot = static_cast<u32>(maps.size());
+    if (!free_map_slots.empty()) {
+        map_slot = free_map_slots.back();
+        free_map_slots.pop_back();
+    } else {
+        maps.emplace_back();
+    }
+    // A reused slot was emptied by remove_map()
+    auto &map = maps[map_slot];
+    for (u32 style = 0; style < MAX_LIGHT_STYLES; ++style) {
+        auto const it = switchable_patterns.find(static_cast<int>(style));
+        map.patterns[style] = it != switchable_patterns.end() ? it->second : std::string{default_light_style_pattern(style)};
+        map.values[style] = pattern_value(map.patterns[style], tick);
+    }
+    return map_slot;
+}
+
+static auto lightmap_sample_n(AnimatedLightmap const &lightmap) -> usize {
+    return static_cast<usize>(lightmap.w * lightmap.h * 3) * lightmap.style_n;
+}
+
+void LightStyles::remove_map(u32 map_slot) {
+    // Compacts the other maps' lightmaps and samples in place, keeping their order
+    auto new_index = std::vector<u32>(lightmaps.size(), ~0u);
+    u32 lightmap_n = 0;
+    usize sample_n = 0;
+    for (usize i = 0; i < lightmaps.size(); i++) {
+        auto lightmap = lightmaps[i];
+        if (lightmap.map_slot == map_slot)
+            continue;
+        auto const size = lightmap_sample_n(lightmap);
+        if (lightmap.samples_offset != sample_n)
+            std::memmove(samples.data() + sample_n, samples.data() + lightmap.samples_offset, size);
+        lightmap.samples_offset = sample_n;
+        sample_n += size;
+        new_index[i] = lightmap_n;
+        lightmaps[lightmap_n++] = lightmap;
+    }
+    lightmaps.resize(lightmap_n);
+    samples.resize(sample_n);
+
+    for (auto &map : maps) {
+        for (auto style : map.used_styles) {
+            for (auto &lightmap_i : map.lightmaps[style])
+                lightmap_i = new_index[lightmap_i];
+        }
+    }
+    std::erase_if(queue, [&](u32 lightmap_i) { return new_index[lightmap_i] == ~0u; });
+    for (auto &lightmap_i : queue)
+        lightmap_i = new_index[lightmap_i];
+
+    // The patterns are all assigned again when the slot is reused
+    auto &map = maps[map_slot];
+    map.used_styles.clear();
+    for (auto &style_lightmaps : map.lightmaps)
+        style_lightmaps.clear();
+    free_map_slots.push_back(map_slot);
+}
+
+void LightStyles::add_lightmap(u32 map_slot, u32 page, i32 x, i32 y, i32 w, i32 h, std::array<u8, 4> const &styles, u32 style_n, u8 const *raw_samples) {
+    auto const lightmap_i = static_cast<u32>(lightmaps.size());
+    auto const sample_n = static_cast<usize>(w * h * 3) * style_n;
+    lightmaps.push_back({
+        .map_slot = map_slot,
+        .page = page,
+        .x = x,
+        .y = y,
+        .w = w,
+        .h = h,
+        .styles = styles,
+        .style_n = style_n,
+        .samples_offset = samples.size(),
+    });
+    samples.insert(samples.end(), raw_samples, raw_samples + sample_n);
+
+    auto &map = maps[map_slot];
+    for (u32 i = 0; i < style_n; ++i) {
+        auto const style = styles[i];
+        if (style >= MAX_LIGHT_STYLES)
+            continue;
+        if (map.lightmaps[style].empty())
+            map.used_styles.push_back(style);
+        map.lightmaps[style].push_back(lightmap_i);
+    }
+}
+
+void LightStyles::composite(AnimatedLightmap const &lightmap, u8 *dst, usize dst_row_pitch, u32 dst_channel_n) const {
+    auto const &map = maps[lightmap.map_slot];
+    auto scales = std::array<u32, 4>{};
+    for (u32 i = 0; i < lightmap.style_n; ++i) {
+        // In 1/LIGHT_STYLE_NORMAL units, so 'm' leaves the samples untouched
+        scales[i] = lightmap.styles[i] < MAX_LIGHT_STYLES ? map.values[lightmap.styles[i]] : 0;
+    }
+    auto const texel_n = static_cast<usize>(lightmap.w * lightmap.h);
+    u8 const *const src = samples.data() + lightmap.samples_offset;
+    for (i32 y = 0; y < lightmap.h; ++y) {
+        u8 *const dst_row = dst + dst_row_pitch * static_cast<usize>(y);
+        for (i32 x = 0; x < lightmap.w; ++x) {
+            auto const texel_i = static_cast<usize>(x + y * lightmap.w);
+            for (u32 c = 0; c < 3; ++c) {
+                u32 light = 0;
+                for (u32 i = 0; i < lightmap.style_n; ++i)
+                    light += src[(texel_n * i + texel_i) * 3 + c] * scales[i];
+                dst_row[static_cast<usize>(x) * dst_channel_n + c] = gamma_table[std::min(light / LIGHT_STYLE_NORMAL, 255u)];
+            }
+        }
+    }
+}
+
+void LightStyles::update(f64 time) {
+    if (!animate)
+        return;
+    auto const new_tick = static_cast<u64>(time * LIGHT_STYLE_TICKS_PER_SECOND);
+    if (new_tick == tick)
+        return;
+    tick = new_tick;
+    for (auto &map : maps) {
+        for (auto style : map.used_styles) {
+            auto const value = pattern_value(map.patterns[style], tick);
+            if (value == map.values[style])
+                continue;
+            map.values[style] = value;
+            for (auto lightmap_i : map.lightmaps[style]) {
+                if (lightmaps[lightmap_i].queued)
+                    continue;
+                lightmaps[lightmap_i].queued = true;
+                queue.push_back(lightmap_i);
+            }
+        }
+    }
+}
+
+auto LightStyles::animating() const -> bool {
+    if (!animate)
+        return false;
+    for (auto const &map : maps) {
+        for (auto style : map.used_styles) {
+            if (map.patterns[style].size() > 1)
+                return true;
+        }
+    }
+    return false;
+}
+
+void LightStyles::queue_all() {
+    for (auto const &map : maps) {
+        for (auto style : map.used_styles) {
+            for (auto lightmap_i : map.lightmaps[style]) {
+                if (lightmaps[lightmap_i].queued)
+                    continue;
+                lightmaps[lightmap_i].queued = true;
+                queue.push_back(lightmap_i);
+            }
+        }
+    }
+}
+
+void LightStyles::record_uploads(daxa::CommandList &cmd_list, daxa::ImageId image, daxa::BufferId staging_buffer, usize staging_buffer_offset, u8 *staging, usize staging_size) {
+    usize staging_offset = 0;
+    usize uploaded_n = 0;
+    for (; uploaded_n < queue.size(); ++uploaded_n) {
+        auto &lightmap = lightmaps[queue[uploaded_n]];
+        auto const lightmap_size = static_cast<usize>(lightmap.w * lightmap.h * 4);
+        if (staging_offset + lightmap_size > staging_size)
+            break;
+        composite(lightmap, staging + staging_offset, static_cast<usize>(lightmap.w * 4), 4);
+        cmd_list.copy_buffer_to_image({
+            .buffer = staging_buffer,
+            .buffer_offset = staging_buffer_offset + staging_offset,
+            .image = image,
+            .image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+            .image_slice = {.base_array_layer = lightmap.page},
+            .image_offset = {lightmap.x, lightmap.y, 0},
+            .image_extent = {static_cast<u32>(lightmap.w), static_cast<u32>(lightmap.h), 1},
+        });
+        lightmap.queued = false;
+        staging_offset += lightmap_size;
+    }
+    queue.erase(queue.begin(), queue.begin() + static_cast<std::ptrdiff_t>(uploaded_n));
+}
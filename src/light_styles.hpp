@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <array>
+#include <string_view>
+
+static constexpr u32 MAX_LIGHT_STYLES = 64;
+static constexpr u8 NO_LIGHT_STYLE = 255;
+// GoldSrc advances every style pattern 10 times per second
+static constexpr f64 LIGHT_STYLE_TICKS_PER_SECOND = 10.0;
+// Pattern letter for the unmodified lightmap, 'a' is black and 'z' almost double brightness
+static constexpr u8 LIGHT_STYLE_NORMAL = 'm' - 'a';
+
+// The built-in style patterns (0-12 and 63), styles 32 and up are defined by the map's light entities
+auto default_light_style_pattern(u32 style) -> std::string_view;
+
+// A face lightmap lit by anything besides the constant style 0. It is re-composited from its
+// raw per-style samples whenever one of its styles changes value.
+struct AnimatedLightmap {
+    u32 map_slot;
+    u32 page;
+    i32 x, y, w, h;
+    std::array<u8, 4> styles;
+    u32 style_n;
+    // style_n consecutive w * h RGB lightmaps in LightStyles::samples
+    usize samples_offset;
+    bool queued = false;
+};
+
+struct MapLightStyles {
+    std::array<std::string, MAX_LIGHT_STYLES> patterns;
+    std::array<u8, MAX_LIGHT_STYLES> values;
+    // Animated lightmaps using each style, and the styles that are used at all
+    std::array<std::vector<u32>, MAX_LIGHT_STYLES> lightmaps;
+    std::vector<u32> used_styles;
+};
+
+// Light style state for every loaded map. Per frame, only the lightmaps whose style value changed
+// since the last upload are re-composited on the CPU and copied to the world lightmap.
+struct LightStyles {
+    std::vector<MapLightStyles> maps;
+    // Slots of removed maps, handed out again by add_map()
+    std::vector<u32> free_map_slots;
+    std::vector<AnimatedLightmap> lightmaps;
+    std::vector<u8> samples;
+    std::vector<u32> queue;
+    std::array<u8, 256> gamma_table;
+
+    bool animate = true;
+    u64 tick = 0;
+
+    LightStyles();
+
+    // `switchable_patterns` holds the patterns of the map's styles 32 and up
+    auto add_map(std::map<int, std::string> const &switchable_patterns) -> u32;
+    // Frees the map's slot, and drops its lightmaps and their samples. The ones of the other maps are moved down
+    // over them, so the indices of lightmaps of other maps change.
+    void remove_map(u32 map_slot);
+    void add_lightmap(u32 map_slot, u32 page, i32 x, i32 y, i32 w, i32 h, std::array<u8, 4> const &styles, u32 style_n, u8 const *raw_samples);
+    // Writes the lightmap with the current style values as `dst_channel_n` channel texels
+    void composite(AnimatedLightmap const &lightmap, u8 *dst, usize dst_row_pitch, u32 dst_channel_n) const;
+
+    // Advances the patterns and queues the lightmaps of styles that changed value
+    void update(f64 time);
+    // True if update() may queue lightmaps later on, without anything else changing
+    auto animating() const -> bool;
+    // Queues every lightmap of the loaded maps, after the image they are in lost them
+    void queue_all();
+    // Composites queued lightmaps into `staging`, which starts `staging_buffer_offset` bytes into `staging_buffer`,
+    // and records their copies into `image`. Whatever does not fit in `staging_size` stays queued for the next frame.
+    void record_uploads(daxa::CommandList &cmd_list, daxa::ImageId image, daxa::BufferId staging_buffer, usize staging_buffer_offset, u8 *staging, usize staging_size);
+};
@@ -0,0 +1,253 @@
+#include "lightmap_packer.hpp"
+#include "bsp.hpp"
+
+#include <numeric>
+
+void LightmapPacker::add_page() {
+    auto &page = pages.emplace_back();
+    page.skyline.push_back({.x = 0, .y = 0, .w = LIGHTMAP_PAGE_SIZE});
+}
+
+// Returns the index of the skyline node the rect starts at, or -1 if it does not fit.
+// Prefers the lowest resulting top edge, then the narrowest node to limit wasted space.
+auto LightmapPacker::find_position(Page const &page, i32 w, i32 h, i32 &best_x, i32 &best_y) const -> i32 {
+    auto best_i = -1;
+    auto best_top = LIGHTMAP_PAGE_SIZE + 1;
+    auto best_w = LIGHTMAP_PAGE_SIZE + 1;
+    auto const node_n = static_cast<i32>(page.skyline.size());
+    for (i32 i = 0; i < node_n; ++i) {
+        auto const x = page.skyline[i].x;
+        if (x + w > LIGHTMAP_PAGE_SIZE)
+            break;
+        // The rect rests on the highest node it spans
+        auto y = 0;
+        auto remaining_w = w;
+        for (i32 j = i; remaining_w > 0; ++j) {
+            y = std::max(y, page.skyline[j].y);
+            remaining_w -= page.skyline[j].w;
+        }
+        if (y + h > LIGHTMAP_PAGE_SIZE)
+            continue;
+        if (y + h < best_top || (y + h == best_top && page.skyline[i].w < best_w)) {
+            best_i = i;
+            best_top = y + h;
+            best_w = page.skyline[i].w;
+            best_x = x;
+            best_y = y;
+        }
+    }
+    return best_i;
+}
+
+void LightmapPacker::place(Page &page, i32 node_i, i32 x, i32 y, i32 w, i32 h) {
+    auto &skyline = page.skyline;
+    skyline.insert(skyline.begin() + node_i, SkylineNode{.x = x, .y = y + h, .w = w});
+
+    // Trim the nodes now covered by the new one
+    for (auto i = static_cast<usize>(node_i) + 1; i < skyline.size();) {
+        auto const covered_end = skyline[i - 1].x + skyline[i - 1].w;
+        if (skyline[i].x >= covered_end)
+            break;
+        auto const shrink = covered_end - skyline[i].x;
+        if (skyline[i].w <= shrink) {
+            skyline.erase(skyline.begin() + static_cast<std::ptrdiff_t>(i));
+            continue;
+        }
+        skyline[i].x += shrink;
+        skyline[i].w -= shrink;
+        break;
+    }
+
+    // Merge neighbours of equal height
+    for (usize i = 0; i + 1 < skyline.size();) {
+        if (skyline[i].y == skyline[i + 1].y) {
+            skyline[i].w += skyline[i + 1].w;
+            skyline.erase(skyline.begin() + static_cast<std::ptrdiff_t>(i) + 1);
+        } else {
+            ++i;
+        }
+    }
+
+    page.used_texels += static_cast<u64>(w) * static_cast<u64>(h);
+}
+
+auto LightmapPacker::pack(std::vector<LightmapRect> &rects) -> bool {
+    // Tallest first, then widest. Ties keep face order so the result is deterministic.
+    auto order = std::vector<u32>(rects.size());
+    std::iota(order.begin(), order.end(), 0u);
+    std::stable_sort(order.begin(), order.end(), [&rects](u32 a, u32 b) {
+        if (rects[a].h != rects[b].h)
+            return rects[a].h > rects[b].h;
+        return rects[a].w > rects[b].w;
+    });
+
+    for (auto rect_i : order) {
+        auto &rect = rects[rect_i];
+        if (rect.w > LIGHTMAP_PAGE_SIZE || rect.h > LIGHTMAP_PAGE_SIZE)
+            return false;
+
+        auto placed = false;
+        for (u32 page_i = 0; !placed; ++page_i) {
+            if (page_i == pages.size())
+                add_page();
+            auto x = 0, y = 0;
+            auto const node_i = find_position(pages[page_i], rect.w, rect.h, x, y);
+            if (node_i == -1)
+                continue;
+            place(pages[page_i], node_i, x, y, rect.w, rect.h);
+            rect.x = x;
+            rect.y = y;
+            rect.page = page_i;
+            placed = true;
+        }
+    }
+    return true;
+}
+
+auto LightmapPacker::occupancy(u32 page) const -> f32 {
+    return static_cast<f32>(static_cast<f64>(pages[page].used_texels) / static_cast<f64>(LIGHTMAP_PAGE_SIZE * LIGHTMAP_PAGE_SIZE));
+}
+
+void LightmapPacker::release_page(u32 page_i) {
+    auto &page = pages[page_i];
+    if (--page.ref_count != 0)
+        return;
+    page.skyline.assign(1, SkylineNode{.x = 0, .y = 0, .w = LIGHTMAP_PAGE_SIZE});
+    page.used_texels = 0;
+}
+
+auto WorldLightmap::pack(std::vector<LightmapRect> &rects, std::vector<u32> &used_pages) -> bool {
+    auto const result = packer.pack(rects);
+    texels.resize(PAGE_BYTES * packer.pages.size());
+    used_pages.clear();
+    for (auto const &rect : rects) {
+        if (std::find(used_pages.begin(), used_pages.end(), rect.page) == used_pages.end())
+            used_pages.push_back(rect.page);
+    }
+    for (auto page : used_pages)
+        ++packer.pages[page].ref_count;
+    return result;
+}
+
+void WorldLightmap::release_pages(std::span<u32 const> used_pages) {
+    for (auto page : used_pages)
+        packer.release_page(page);
+}
+
+void WorldLightmap::upload(daxa::Device &device, u32 min_page_n) {
+    page_n = std::max(min_page_n, static_cast<u32>(packer.pages.size()));
+    texels.resize(PAGE_BYTES * page_n);
+    image_id = device.create_image({
+        .format = daxa::Format::R8G8B8A8_SRGB,
+        .size = {static_cast<u32>(LIGHTMAP_PAGE_SIZE), static_cast<u32>(LIGHTMAP_PAGE_SIZE), 1},
+        .array_layer_count = page_n,
+        .usage = daxa::ImageUsageFlagBits::SHADER_SAMPLED | daxa::ImageUsageFlagBits::TRANSFER_SRC | daxa::ImageUsageFlagBits::TRANSFER_DST,
+        .name = "world_lightmap",
+    });
+    BSP_TEXTURE lmap_tex;
+    lmap_tex.image_id = image_id;
+    lmap_tex.w = LIGHTMAP_PAGE_SIZE;
+    lmap_tex.h = LIGHTMAP_PAGE_SIZE;
+    lmap_tex.load(device, "world_lightmap", texels.data(), 3, 4, 1, page_n);
+    // Unless maps are loaded later, the GPU copy is all that is needed from here on
+    if (!keep_texels)
+        texels = {};
+}
+
+void WorldLightmap::queue_upload(LightmapRect const &rect) {
+    // Before the upload, everything is copied by it
+    if (!image_id.is_empty())
+        upload_queue.push_back(rect);
+}
+
+auto WorldLightmap::ensure_capacity(daxa::Device &device) -> bool {
+    auto const page_count = static_cast<u32>(packer.pages.size());
+    if (page_count <= page_n)
+        return false;
+    // Destroyed once the frames using it are done. Growing by half at least keeps this rare.
+    device.destroy_image(image_id);
+    upload(device, std::max(page_count, page_n + page_n / 2));
+    // Everything queued is in the new image already, except for the current style values
+    upload_queue.clear();
+    styles.queue_all();
+    return true;
+}
+
+void WorldLightmap::record_uploads(daxa::CommandList &cmd_list, daxa::BufferId staging_buffer, u8 *staging, usize staging_size) {
+    usize staging_offset = 0;
+    usize uploaded_n = 0;
+    for (; uploaded_n < upload_queue.size(); ++uploaded_n) {
+        auto const &rect = upload_queue[uploaded_n];
+        auto const rect_size = static_cast<usize>(rect.w * rect.h * 4);
+        if (staging_offset + rect_size > staging_size)
+            break;
+        for (i32 y = 0; y < rect.h; ++y) {
+            u8 const *const src = page_texels(rect.page) + static_cast<usize>(rect.x + (rect.y + y) * LIGHTMAP_PAGE_SIZE) * 3;
+            u8 *const dst = staging + staging_offset + static_cast<usize>(y * rect.w * 4);
+            for (i32 x = 0; x < rect.w; ++x) {
+                dst[x * 4 + 0] = src[x * 3 + 0];
+                dst[x * 4 + 1] = src[x * 3 + 1];
+                dst[x * 4 + 2] = src[x * 3 + 2];
+                dst[x * 4 + 3] = 255;
+            }
+        }
+        cmd_list.copy_buffer_to_image({
+            .buffer = staging_buffer,
+            .buffer_offset = staging_offset,
+            .image = image_id,
+            .image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+            .image_slice = {.base_array_layer = rect.page},
+            .image_offset = {rect.x, rect.y, 0},
+            .image_extent = {static_cast<u32>(rect.w), static_cast<u32>(rect.h), 1},
+        });
+        staging_offset += rect_size;
+    }
+    upload_queue.erase(upload_queue.begin(), upload_queue.begin() + static_cast<std::ptrdiff_t>(uploaded_n));
+    // Style composites go on top of the texels copied above, so they wait until those are all in
+    if (upload_queue.empty())
+        styles.record_uploads(cmd_list, image_id, staging_buffer, staging_offset, staging + staging_offset, staging_size - staging_offset);
+}
+
+void WorldLightmap::destroy(daxa::Device &device) {
+    if (!image_id.is_empty())
+        device.destroy_image(image_id);
+}
+
+#if BENCHMARK_LIGHTMAP_PACKING
+// Light map "rover" algorithm from Quake 2 (http://fabiensanglard.net/quake2/quake2_opengl_renderer.php)
+auto rover_pack(std::vector<LightmapRect> &rects) -> usize {
+    i32 lmapRover[LIGHTMAP_PAGE_SIZE] = {};
+    usize placed_n = 0;
+    for (auto &rect : rects) {
+        int best = LIGHTMAP_PAGE_SIZE;
+        int best2 = 0;
+
+        for (int a = 0; a < LIGHTMAP_PAGE_SIZE - rect.w; a++) {
+            best2 = 0;
+            int j = 0;
+            for (j = 0; j < rect.w; j++) {
+                if (lmapRover[a + j] >= best) {
+                    break;
+                }
+                if (lmapRover[a + j] > best2) {
+                    best2 = lmapRover[a + j];
+                }
+            }
+            if (j == rect.w) {
+                rect.x = a;
+                rect.y = best = best2;
+            }
+        }
+
+        if (best + rect.h > LIGHTMAP_PAGE_SIZE) {
+            break;
+        }
+
+        for (int a = 0; a < rect.w; a++) {
+            lmapRover[rect.x + a] = best + rect.h;
+        }
+        ++placed_n;
+    }
+    return placed_n;
+}
+#endif
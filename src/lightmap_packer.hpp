@@ -0,0 +1,91 @@
+#pragma once
+
+#include "common.hpp"
+#include "light_styles.hpp"
+
+#include <mutex>
+#include <span>
+
+static constexpr i32 LIGHTMAP_PAGE_SIZE = 1024;
+
+struct LightmapRect {
+    i32 w, h;
+    // Filled in by the packer
+    i32 x = 0, y = 0;
+    u32 page = 0;
+};
+
+// Skyline bottom-left packer. Rects are placed tallest first into as many
+// LIGHTMAP_PAGE_SIZE pages as needed, so nothing is dropped when a map overflows one page.
+struct LightmapPacker {
+    struct SkylineNode {
+        i32 x, y, w;
+    };
+    struct Page {
+        std::vector<SkylineNode> skyline;
+        u64 used_texels = 0;
+        // Maps with lightmaps on the page. It is emptied for reuse once none are left.
+        u32 ref_count = 0;
+    };
+    std::vector<Page> pages;
+
+    // Packs `rects` in place. Returns false if a rect is larger than a page.
+    auto pack(std::vector<LightmapRect> &rects) -> bool;
+    // Fraction of the page's texels covered by rects
+    auto occupancy(u32 page) const -> f32;
+    void release_page(u32 page);
+
+  private:
+    auto find_position(Page const &page, i32 w, i32 h, i32 &best_x, i32 &best_y) const -> i32;
+    void place(Page &page, i32 node_i, i32 x, i32 y, i32 w, i32 h);
+    void add_page();
+};
+
+// The lightmaps of every loaded map, packed into one layered image that all draws share.
+// Maps pack into it while loading, and the image is created and uploaded once afterwards.
+// Maps streamed in later write their texels on their loader thread, and the rects are copied
+// to the image a staging buffer at a time.
+struct WorldLightmap {
+    LightmapPacker packer;
+    // RGB texels, one LIGHTMAP_PAGE_SIZE^2 page after the other
+    std::vector<u8> texels;
+    daxa::ImageId image_id;
+    // Layers of the image, at least the number of pages
+    u32 page_n = 0;
+    // Faces lit by animated or switchable styles, updated in place after the upload
+    LightStyles styles;
+    // Rects whose texels changed since the upload
+    std::vector<LightmapRect> upload_queue;
+    // Kept for maps loaded after the upload, otherwise the texels are freed by it
+    bool keep_texels = false;
+    // Held by loader threads while they pack and write texels, and by the main thread while it reads them or the styles
+    std::mutex mutex;
+
+    static constexpr usize PAGE_BYTES = static_cast<usize>(LIGHTMAP_PAGE_SIZE) * LIGHTMAP_PAGE_SIZE * 3;
+
+    // Packs `rects` into the shared pages and takes a reference on each page they landed on, listed in `used_pages`.
+    // Returns false if a rect is larger than a page.
+    auto pack(std::vector<LightmapRect> &rects, std::vector<u32> &used_pages) -> bool;
+    void release_pages(std::span<u32 const> used_pages);
+    auto page_texels(u32 page) -> u8 * {
+        return texels.data() + PAGE_BYTES * page;
+    }
+    // Slice state after upload(), for the task image that tracks the lightmap from then on
+    auto slice() const -> daxa::ImageMipArraySlice {
+        return {.level_count = 1, .layer_count = page_n};
+    }
+    void upload(daxa::Device &device, u32 min_page_n = 1);
+    void destroy(daxa::Device &device);
+
+    void queue_upload(LightmapRect const &rect);
+    // Recreates and uploads the image with more layers once maps packed into more pages than it has.
+    // Returns true if it did, the image and slice() changed then and it is left like after upload().
+    auto ensure_capacity(daxa::Device &device) -> bool;
+    // Copies queued rects, then re-composited style lightmaps, as far as `staging_size` goes. The rest waits for the next frame.
+    void record_uploads(daxa::CommandList &cmd_list, daxa::BufferId staging_buffer, u8 *staging, usize staging_size);
+};
+
+#if BENCHMARK_LIGHTMAP_PACKING
+// The Quake 2 "rover" allocator the packer replaced, kept for comparison. Single page, returns the number of rects placed.
+auto rover_pack(std::vector<LightmapRect> &rects) -> usize;
+#endif
@@ -1,9 +1,15 @@
 #include "utils/base_app.hpp"
 
 #include "utils/player.hpp"
+#include "utils/dynamic_resolution.hpp"
+#include "utils/frustum.hpp"
 
+#include <chrono>
+#include <optional>
 #include <span>
-#include <set>
+#include <new>
+#include <utility>
+#include <cstdlib>
 #include <glm/gtc/type_ptr.hpp>
 #include <nlohmann/json.hpp>
 
@@ -11,6 +17,9 @@
 #include "wad.hpp"
 #include "bsp.hpp"
 #include "ConfigXML.hpp"
+#include "map_streamer.hpp"
+#include "map_scan.hpp"
+#include "file_prefetcher.hpp"
 
 #include <imgui_stdlib.h>
 #include <ImGuizmo.h>
@@ -19,14 +28,69 @@
 usize draw_count = 0;
 #endif
 
+#if COUNT_ALLOCATIONS
+std::atomic<u64> heap_allocation_count = 0;
+std::atomic<u64> buffer_creation_count = 0;
+
+auto operator new(usize size) -> void * {
+    heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (auto *ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc{};
+}
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+void operator delete(void *ptr, usize) noexcept {
+    std::free(ptr);
+}
+#endif
+
 #define SHOW_IMAGES_GUI 0
 
 const std::string config_name = "halflife";
+// Holds the <config>-offsets.json and <config>-layout.json files
+const std::filesystem::path data_directory = ".";
 
 struct HalfLife {
     ConfigXML *xmlconfig = new ConfigXML();
     std::vector<BSP *> maps;
     daxa::Device &device;
+    // Textures and entity data shared by the loaded maps
+    AssetRegistry assets;
+    WorldLightmap world_lightmap;
+    // Every file of the game directories, WADs and maps are read through it
+    GameFileSystem files;
+    // Reused by every WAD and map load
+    LoadScratch load_scratch;
+    // Used instead of loading every map up front when streaming is enabled in the config
+    bool streaming = false;
+    MapStreamer streamer;
+    // What happens to the triangles of each map once they are uploaded
+    CpuGeometry cpu_geometry = CpuGeometry::KEEP;
+    // Bytes of VRAM the maps may use, 0 for no limit. Above it, textures no resident map uses are evicted first,
+    // then the geometry of the maps that were out of view the longest.
+    u64 vram_budget = 0;
+    // Decodes textures that gain or lose mips and don't fit the frame's staging buffer
+    ScratchBuffer restore_rgba;
+    // Evicted textures and maps that are needed again. Queued by activate_textures() and update_residency(), and
+    // uploaded by the frame's graph ahead of its draws.
+    std::vector<TextureContent> texture_restores;
+    std::vector<BSP *> geometry_restores;
+    // Upload only the mips the camera is close enough to need. Otherwise every texture is kept at full detail.
+    bool mip_streaming = true;
+    static constexpr u32 MIP_UPLOADS_PER_FRAME = 8;
+    // The mips are planned again once the camera moved this far, or the maps or the render size changed
+    static constexpr f32 MIP_REPLAN_DISTANCE = 32.0f;
+    // Planned by update_texture_mips(), uploaded by the frame's graph
+    std::vector<TextureRegistry::MipChange> mip_changes;
+    // The finest mip of every texture drawn, kept to not allocate each plan
+    std::vector<TextureRegistry::MipChange> wanted_mips;
+    // What the last plan was made for
+    f32vec3 mip_plan_pos = {};
+    f32 mip_plan_pixel_scale = 0.0f;
+    bool mip_plan_streaming = false;
+    bool mip_plan_stale = true;
 
     daxa::SamplerId lmap_image_sampler;
     daxa::SamplerId tex_image_samplers[4];
@@ -38,14 +102,47 @@ struct HalfLife {
         auto map_config_file = config_name + ".xml";
         xmlconfig->LoadMapConfig(map_config_file.c_str());
 
-        // Texture loading
+        files.build(xmlconfig->m_szGamePaths);
+
+        // Every file loaded below, in the order it is loaded
+        streaming = xmlconfig->m_bStreaming;
+        auto load_paths = std::vector<std::string>{};
+        for (auto const &wad : xmlconfig->m_vWads)
+            load_paths.push_back(wad + ".wad");
+        for (auto const &chapter : xmlconfig->m_vChapterEntries) {
+            for (auto const &entry : chapter.m_vMapEntries) {
+                if (!streaming && chapter.m_bRender && entry.m_bRender)
+                    load_paths.push_back("maps/" + entry.m_szName + ".bsp");
+            }
+        }
+        auto const residency = page_cache_residency(files, load_paths);
+        auto const load_start = std::chrono::steady_clock::now();
+        auto prefetcher = std::optional<FilePrefetcher>{};
+        if (xmlconfig->m_bPrefetch)
+            prefetcher.emplace(files, load_paths);
+
+        // Texture loading. Only an eviction or a change of mips reads the pixels of an image again.
+        vram_budget = static_cast<u64>(xmlconfig->m_iVramBudget) << 20;
+        mip_streaming = xmlconfig->m_bMipStreaming;
+        assets.textures.keep_pixels = vram_budget != 0 || mip_streaming;
         for (size_t i = 0; i < xmlconfig->m_vWads.size(); i++) {
-            if (wad_load(device, xmlconfig->m_szGamePaths, xmlconfig->m_vWads[i] + ".wad") == -1) {
+            if (wad_load(device, files, xmlconfig->m_vWads[i] + ".wad", assets, load_scratch) == -1) {
                 return;
             }
+            if (prefetcher)
+                prefetcher->done();
         }
 
         // Map loading
+        cpu_geometry = parse_cpu_geometry(xmlconfig->m_szCpuGeometry);
+        if (streaming) {
+            streamer.cpu_geometry = cpu_geometry;
+            streamer.radius = xmlconfig->m_fStreamingRadius;
+            streamer.max_maps = std::max(1u, xmlconfig->m_iStreamingMaxMaps);
+            streamer.scan(*xmlconfig, files, assets);
+            // Maps loaded from here on write their lightmaps into the texels and queue them for upload
+            world_lightmap.keep_texels = true;
+        }
 
         int mapCount = 0;
         int mapRenderCount = 0;
@@ -56,12 +153,15 @@ struct HalfLife {
                 ChapterEntry const sChapterEntry = xmlconfig->m_vChapterEntries[i];
                 MapEntry const sMapEntry = xmlconfig->m_vChapterEntries[i].m_vMapEntries[j];
 
-                if (sChapterEntry.m_bRender && sMapEntry.m_bRender) {
-                    BSP *b = new BSP(device, xmlconfig->m_szGamePaths, "maps/" + sMapEntry.m_szName + ".bsp", sMapEntry);
+                if (!streaming && sChapterEntry.m_bRender && sMapEntry.m_bRender) {
+                    BSP *b = new BSP(device, files, "maps/" + sMapEntry.m_szName + ".bsp", sMapEntry, assets, world_lightmap, load_scratch);
                     b->SetChapterOffset(sChapterEntry.m_fOffsetX, sChapterEntry.m_fOffsetY, sChapterEntry.m_fOffsetZ);
+                    b->release_cpu_geometry(cpu_geometry);
                     totalTris += b->totalTris;
                     maps.push_back(b);
                     mapRenderCount++;
+                    if (prefetcher)
+                        prefetcher->done();
                 }
 
                 mapCount++;
@@ -69,7 +169,30 @@ struct HalfLife {
         }
 
         std::cout << mapCount << " maps found in config file." << std::endl;
+        {
+            // Run once after dropping the page cache and once again to compare cold and warm starts
+            auto const load_ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - load_start).count();
+            std::cout << "Loaded " << load_paths.size() << " files in " << load_ms << "ms";
+            if (residency && residency->bytes != 0) {
+                auto const cached = static_cast<f64>(residency->cached_bytes) / static_cast<f64>(residency->bytes);
+                std::cout << ", " << (cached < 0.5 ? "cold" : "warm") << " start (" << static_cast<int>(cached * 100.0) << "% of " << (residency->bytes >> 20) << " MiB cached)";
+            }
+            if (prefetcher)
+                std::cout << ", " << (prefetcher->bytes_read() >> 20) << " MiB prefetched";
+            else
+                std::cout << ", prefetch off";
+            std::cout << std::endl;
+        }
         std::cout << "Total triangles: " << totalTris << std::endl;
+        auto const texture_stats = assets.textures.content_stats();
+        std::cout << "Textures: " << texture_stats.image_n << " images (" << texture_stats.image_bytes / 1024 << " KiB), "
+                  << texture_stats.alias_n << " aliased by content (" << texture_stats.saved_bytes / 1024 << " KiB saved)" << std::endl;
+
+        std::cout << "Lightmap pages:";
+        for (u32 page_i = 0; page_i < world_lightmap.packer.pages.size(); page_i++)
+            std::cout << " " << static_cast<int>(world_lightmap.packer.occupancy(page_i) * 100.0f) << "%";
+        std::cout << std::endl;
+        world_lightmap.upload(device);
 
         lmap_image_sampler = device.create_sampler({
             .magnification_filter = daxa::Filter::LINEAR,
@@ -118,177 +241,525 @@ struct HalfLife {
             .name = "tex_image_samplers[3]",
         });
 
-        {
-            daxa::TaskGraph mip_task_graph = daxa::TaskGraph({
-                .device = device,
-                .name = "mip task list",
-            });
-            std::set<daxa::ImageId> image_set;
-            for (auto map : maps) {
-                for (auto [key, tex] : map->texturedTris) {
-                    image_set.emplace(tex.image_id);
-                }
-            }
-            std::vector<daxa::ImageId> images = {};
-            std::vector<daxa::ImageSliceState> latest_slice_states = {};
-            auto image_n = image_set.size();
-            images.reserve(image_n);
-            latest_slice_states.reserve(image_n);
-            for (auto image_id : image_set) {
-                if (image_id.version == 0)
-                    continue;
-                images.push_back(image_id);
-                latest_slice_states.push_back({.latest_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL});
-            }
-            image_n = images.size();
-            auto task_mip_image = daxa::TaskImage({.initial_images = {images, latest_slice_states}, .name = "task_mip_image"});
-            mip_task_graph.use_persistent_image(task_mip_image);
-            for (u32 i = 0; i < 3; ++i) {
-                auto mip_view_a = task_mip_image.view().view({.base_mip_level = i});
-                auto mip_view_b = task_mip_image.view().view({.base_mip_level = i + 1});
-                mip_task_graph.add_task({
-                    .uses = {
-                        daxa::TaskImageUse<daxa::TaskImageAccess::TRANSFER_READ>{mip_view_a},
-                        daxa::TaskImageUse<daxa::TaskImageAccess::TRANSFER_WRITE>{mip_view_b},
-                    },
-                    .task = [=, this](daxa::TaskInterface const &runtime) {
-                        auto cmd_list = runtime.get_command_list();
-                        for (size_t j = 0; j < image_n; ++j) {
-                            auto image_id = runtime.uses[mip_view_a].image(j);
-                            auto image_info = device.info_image(image_id);
-                            auto mip_size = std::array<i32, 3>{std::max<i32>(1, static_cast<i32>(image_info.size.x)), std::max<i32>(1, static_cast<i32>(image_info.size.y)), std::max<i32>(1, static_cast<i32>(image_info.size.z))};
-                            for (u32 k = 0; k < i; ++k) {
-                                mip_size = {std::max<i32>(1, mip_size[0] / 2), std::max<i32>(1, mip_size[1] / 2), std::max<i32>(1, mip_size[2] / 2)};
-                            }
-                            auto next_mip_size = std::array<i32, 3>{std::max<i32>(1, mip_size[0] / 2), std::max<i32>(1, mip_size[1] / 2), std::max<i32>(1, mip_size[2] / 2)};
-                            cmd_list.blit_image_to_image({
-                                .src_image = image_id,
-                                .src_image_layout = daxa::ImageLayout::TRANSFER_SRC_OPTIMAL, // TODO: get from TaskInterface
-                                .dst_image = image_id,
-                                .dst_image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
-                                .src_slice = {
-                                    .mip_level = i,
-                                    .base_array_layer = 0,
-                                    .layer_count = 1,
-                                },
-                                .src_offsets = {{{0, 0, 0}, {mip_size[0], mip_size[1], mip_size[2]}}},
-                                .dst_slice = {
-                                    .mip_level = i + 1,
-                                    .base_array_layer = 0,
-                                    .layer_count = 1,
-                                },
-                                .dst_offsets = {{{0, 0, 0}, {next_mip_size[0], next_mip_size[1], next_mip_size[2]}}},
-                                .filter = daxa::Filter::LINEAR,
-                            });
-                        }
-                    },
-                    .name = "mip_level_" + std::to_string(i),
-                });
-            }
-            mip_task_graph.add_task({
-                .uses = {
-                    daxa::TaskImageUse<daxa::TaskImageAccess::FRAGMENT_SHADER_SAMPLED>{task_mip_image.view().view({.base_mip_level = 0, .level_count = 4})},
-                },
-                .task = [](daxa::TaskInterface const &) {},
-                .name = "Transition",
-            });
-            mip_task_graph.submit({});
-            mip_task_graph.complete({});
-            mip_task_graph.execute({});
-            device.wait_idle();
-        }
+        for (auto *map : maps)
+            activate_textures(map);
+        if (streaming)
+            streamer.start(device, files, assets, world_lightmap);
     }
 
     ~HalfLife() {
+        streamer.stop();
+        for (auto [slot, map] : streamer.take_finished())
+            maps.push_back(map);
         for (auto &map : maps) {
 #if EXPORT_ASSETS
             map->export_mesh();
 #endif
-            device.destroy_image(map->lmap_image_id);
-            for (usize i = 0; i < map->texturedTris.size(); ++i) {
-                auto &buf = map->bufObjects[i];
+            for (auto &buf : map->bufObjects) {
                 device.destroy_buffer(buf.buffer_id);
             }
+            // Also deletes the spill file, if any
+            delete map;
         }
-        for (auto &[key, tex] : textures) {
-            if (tex.image_id.version != 0)
-                device.destroy_image(tex.image_id);
-        }
+        maps.clear();
+        for (auto image_id : assets.textures.images())
+            device.destroy_image(image_id);
+        world_lightmap.destroy(device);
         device.destroy_sampler(lmap_image_sampler);
         for (auto sampler : tex_image_samplers)
             device.destroy_sampler(sampler);
     }
 
-    void render(daxa::CommandList &cmd_list, daxa::BufferId gpu_input_buffer) {
+    // Textures only this map used are destroyed, its lightmap pages are freed for the next map to pack into.
+    // The device defers destroying anything until the frames in flight are done with it.
+    void unload_map(usize map_i) {
+        auto *const map = maps[map_i];
+        std::cout << "Unloading " << map->mapId << std::endl;
+        for (auto &streamed : streamer.maps) {
+            if (streamed.bsp != map)
+                continue;
+            streamed.user_offset = map->user_offset;
+            streamed.state = StreamedMap::State::UNLOADED;
+            streamed.bsp = nullptr;
+        }
+        std::erase(geometry_restores, map);
+        map->unload(device, world_lightmap);
+        delete map;
+        maps.erase(maps.begin() + static_cast<std::ptrdiff_t>(map_i));
+    }
+
+    // Adds the maps the streamer finished loading, then loads and unloads by distance to the camera.
+    // Returns true if the set of maps changed.
+    auto update_streaming(f32vec3 camera_pos) -> bool {
+        if (!streaming)
+            return false;
+        bool changed = false;
+        for (auto [slot, map] : streamer.take_finished()) {
+            auto &streamed = streamer.maps[slot];
+            activate_textures(map);
+            map->user_offset = streamed.user_offset;
+            map->parent_mapId = streamed.parent_mapId;
+            streamed.bsp = map;
+            streamed.state = StreamedMap::State::RESIDENT;
+            maps.push_back(map);
+            changed = true;
+        }
+        streamer.sync_offsets();
+        auto const plan = streamer.plan(camera_pos);
+        for (auto slot : plan.unload) {
+            auto const map_i = static_cast<usize>(std::find(maps.begin(), maps.end(), streamer.maps[slot].bsp) - maps.begin());
+            unload_map(map_i);
+            changed = true;
+        }
+        if (plan.load) {
+            std::cout << "Streaming in " << streamer.maps[*plan.load].entry.m_szName << std::endl;
+            streamer.request(*plan.load);
+        }
+        return changed;
+    }
+
+    // Marks the map's textures in use, and queues the ones that were evicted to be uploaded again
+    void activate_textures(BSP *map) {
+        if (map->textures_active)
+            return;
+        for (auto texture : map->texture_refs) {
+            if (assets.textures.activate(texture))
+                texture_restores.push_back(assets.textures.content(texture));
+        }
+        map->textures_active = true;
+    }
+    // Bytes of staging the queued restores need. Drops the textures a loader uploaded again in the meantime.
+    auto restore_bytes() -> usize {
+        std::sort(texture_restores.begin(), texture_restores.end());
+        texture_restores.erase(std::unique(texture_restores.begin(), texture_restores.end()), texture_restores.end());
+        std::erase_if(texture_restores, [&](TextureContent content) { return !assets.textures.is_evicted(content); });
+        usize result = 0;
+        for (auto content : texture_restores)
+            result += miptex_rgba_size(assets.textures.source(content), MIPTEX_UPLOAD_MIP);
+        for (auto *map : geometry_restores)
+            result += map->geometry_bytes();
+        return result;
+    }
+    // Records the queued restores through `staging`, which holds restore_bytes()
+    void record_restores(daxa::CommandList &cmd_list, daxa::BufferId staging_buffer, u8 *staging) {
+        usize staging_offset = 0;
+        for (auto content : texture_restores)
+            staging_offset += record_texture_restore(device, assets.textures, content, cmd_list, staging_buffer, staging, staging_offset);
+        for (auto *map : geometry_restores)
+            staging_offset += map->record_geometry_upload(cmd_list, staging_buffer, staging, staging_offset);
+        texture_restores.clear();
+        geometry_restores.clear();
+        // Restored textures come back with the coarsest mip
+        mip_plan_stale = true;
+    }
+    void deactivate_textures(BSP *map, u64 frame) {
+        if (!map->textures_active)
+            return;
+        for (auto texture : map->texture_refs)
+            assets.textures.deactivate(texture, frame);
+        map->textures_active = false;
+    }
+
+    struct VramUsage {
+        u64 geometry = 0;
+        u64 textures = 0;
+        u64 lightmap = 0;
+        u32 evicted_map_n = 0;
+        // Triangles kept in RAM, not part of the total
+        u64 cpu_geometry = 0;
+        auto total() const -> u64 {
+            return geometry + textures + lightmap;
+        }
+    };
+    auto vram_usage() -> VramUsage {
+        auto result = VramUsage{};
+        for (auto *map : maps) {
+            if (map->geometry_resident)
+                result.geometry += map->geometry_bytes();
+            else
+                ++result.evicted_map_n;
+            result.cpu_geometry += map->cpu_geometry_bytes();
+        }
+        result.textures = assets.textures.content_stats().resident_bytes;
+        result.lightmap = static_cast<u64>(world_lightmap.page_n) * LIGHTMAP_PAGE_SIZE * LIGHTMAP_PAGE_SIZE * 4;
+        return result;
+    }
+
+    // Queues the geometry of one evicted map that came into view per frame to be uploaded again, then evicts down to the budget.
+    // Maps in view are never evicted, so the budget is exceeded rather than drawing them incomplete. Neither are maps
+    // whose triangles were dropped, as nothing is left to upload them again from.
+    // Returns true if the set of vertex buffers changed.
+    auto update_residency(glm::mat4 const &view_proj, u64 frame) -> bool {
+        auto const frustum = Frustum(view_proj);
+        bool changed = false;
+        for (auto *map : maps) {
+            if (!map->should_draw)
+                continue;
+            // The shaders draw the negated position, so the bounds flip around too
+            auto const offset = map->draw_offset();
+            auto const mins = glm::vec3(map->mins.x + offset.x, map->mins.y + offset.y, map->mins.z + offset.z);
+            auto const maxs = glm::vec3(map->maxs.x + offset.x, map->maxs.y + offset.y, map->maxs.z + offset.z);
+            if (!frustum.intersects(-maxs, -mins))
+                continue;
+            map->last_visible_frame = frame;
+            if (!map->geometry_resident && !changed) {
+                activate_textures(map);
+                map->create_geometry_buffers(device);
+                geometry_restores.push_back(map);
+                changed = true;
+            }
+        }
+        if (vram_budget == 0)
+            return changed;
+
+        auto usage = vram_usage();
+        while (usage.total() > vram_budget) {
+            if (auto const image_id = assets.textures.evict_inactive()) {
+                device.destroy_image(*image_id);
+                usage.textures = assets.textures.content_stats().resident_bytes;
+                continue;
+            }
+            BSP *oldest = nullptr;
+            for (auto *map : maps) {
+                if (map->geometry_resident && map->can_evict_geometry() && map->last_visible_frame < frame &&
+                    (oldest == nullptr || map->last_visible_frame < oldest->last_visible_frame))
+                    oldest = map;
+            }
+            if (oldest == nullptr)
+                break;
+            usage.geometry -= oldest->geometry_bytes();
+            oldest->evict_geometry(device);
+            deactivate_textures(oldest, frame);
+            changed = true;
+        }
+        return changed;
+    }
+
+    // Estimates the finest mip each texture needs from the distance of the camera to the batches drawing it,
+    // and plans moving a few textures per frame towards it. `pixel_scale` is the pixels a world unit covers at a distance of 1.
+    // A texel at distance d covers about texel_size * pixel_scale / d pixels, and each mip doubles that.
+    // Only plans when something changed, `maps_changed` if maps were loaded, unloaded, evicted or brought back.
+    // Returns true while textures are not at the mips they need yet.
+    auto update_texture_mips(f32vec3 camera_pos, f32 pixel_scale, bool maps_changed) -> bool {
+        auto const moved = camera_pos - mip_plan_pos;
+        if (maps_changed || pixel_scale != mip_plan_pixel_scale || mip_streaming != mip_plan_streaming ||
+            moved.x * moved.x + moved.y * moved.y + moved.z * moved.z > MIP_REPLAN_DISTANCE * MIP_REPLAN_DISTANCE)
+            mip_plan_stale = true;
+        if (!mip_plan_stale)
+            return false;
+        mip_plan_pos = camera_pos;
+        mip_plan_pixel_scale = pixel_scale;
+        mip_plan_streaming = mip_streaming;
+
+        wanted_mips.clear();
+        for (auto *map : maps) {
+            if (!map->geometry_resident)
+                continue;
+            auto const offset = map->draw_offset();
+            for (auto const &batch : map->texturedTris) {
+                auto const content = assets.textures.content(batch.texture);
+                if (content == NO_TEXTURE_CONTENT || (assets.textures.flags(batch.texture) & TEXTURE_FLAG_TOOL) != 0)
+                    continue;
+                auto mip = 0u;
+                if (mip_streaming) {
+                    auto const distance = std::max(distance_to_bounds(camera_pos, batch.mins + offset, batch.maxs + offset), 1.0f);
+                    auto const lod = std::log2(distance / (batch.texel_size * pixel_scale));
+                    mip = static_cast<u32>(std::clamp(std::floor(lod), 0.0f, static_cast<f32>(MIPTEX_MIP_N - 1)));
+                }
+                wanted_mips.push_back({.content = content, .top_mip = mip});
+            }
+        }
+        // One entry per content, with the finest mip any of its batches needs
+        std::sort(wanted_mips.begin(), wanted_mips.end(), [](auto const &a, auto const &b) {
+            return a.content < b.content || (a.content == b.content && a.top_mip < b.top_mip);
+        });
+        auto const wanted_end = std::unique(wanted_mips.begin(), wanted_mips.end(), [](auto const &a, auto const &b) { return a.content == b.content; });
+        wanted_mips.erase(wanted_end, wanted_mips.end());
+        assets.textures.plan_mips(wanted_mips, MIP_UPLOADS_PER_FRAME, mip_changes);
+        // A full plan is only a first batch, the next frame plans again
+        mip_plan_stale = !mip_changes.empty();
+        return !mip_changes.empty();
+    }
+    // Uploads the planned mips in the frame's command list, ahead of its draws
+    void record_mip_uploads(daxa::CommandList &cmd_list, daxa::BufferId staging_buffer, u8 *staging, usize staging_size) {
+        record_mip_streaming(device, assets.textures, mip_changes, cmd_list, staging_buffer, staging, staging_size, restore_rgba);
+        mip_changes.clear();
+    }
+
+    void render(daxa::CommandList &cmd_list, DrawList &draw_list, bool masked) {
         for (auto &map : maps) {
-            map->render(device, cmd_list, gpu_input_buffer, tex_image_samplers[tex_image_sampler_i], lmap_image_sampler);
+            map->render(device, cmd_list, draw_list, world_lightmap.image_id.default_view(), tex_image_samplers[tex_image_sampler_i], lmap_image_sampler, masked);
         }
     }
 };
 
 constexpr usize VERTEX_N = 6;
 
+enum struct RenderMode : i32 {
+    TEXTURED_LIGHTMAP,
+    TEXTURE_ONLY,
+    LIGHTMAP_ONLY,
+    UV_DEBUG,
+    COUNT,
+};
+static constexpr auto RENDER_MODE_N = static_cast<usize>(RenderMode::COUNT);
+static constexpr auto render_mode_names = std::array<char const *, RENDER_MODE_N>{
+    "Textured + Lightmap",
+    "Texture Only",
+    "Lightmap Only",
+    "UV Debug",
+};
+static constexpr auto render_mode_defines = std::array<char const *, RENDER_MODE_N>{
+    "DRAW_MODE_TEXTURED_LIGHTMAP",
+    "DRAW_MODE_TEXTURE_ONLY",
+    "DRAW_MODE_LIGHTMAP_ONLY",
+    "DRAW_MODE_UV_DEBUG",
+};
+
 struct App : BaseApp<App> {
+    static constexpr auto COLOR_FORMAT = daxa::Format::R16G16B16A16_SFLOAT;
+    static constexpr auto VIS_FORMAT = daxa::Format::R32G32_UINT;
+    static constexpr auto CLEAR_COLOR = std::array<f32, 4>{51.0f / 255.0f, 102.0f / 255.0f, 250.0f / 255.0f, 1.0f};
+
+    auto create_draw_pipeline(std::string const &frag_define, std::string const &mode_define, daxa::Format color_format, std::string const &name) -> std::shared_ptr<daxa::RasterPipeline> {
+        // clang-format off
+        return pipeline_manager.add_raster_pipeline({
+            .vertex_shader_info = daxa::ShaderCompileInfo{.source = daxa::ShaderFile{"draw.glsl"}, .compile_options = {.defines = {daxa::ShaderDefine{"DRAW_VERT"}}}},
+            .fragment_shader_info = daxa::ShaderCompileInfo{.source = daxa::ShaderFile{"draw.glsl"}, .compile_options = {.defines = {daxa::ShaderDefine{frag_define}, daxa::ShaderDefine{mode_define}}}},
+            .color_attachments = {{.format = color_format}},
+            .depth_test = {
+                .depth_attachment_format = daxa::Format::D24_UNORM_S8_UINT,
+                .enable_depth_test = true,
+                .enable_depth_write = true,
+            },
+            .raster = {
+                .face_culling = daxa::FaceCullFlagBits::BACK_BIT,
+            },
+            .push_constant_size = sizeof(DrawPush),
+            .name = APPNAME_PREFIX("draw_raster_pipeline (") + name + ")",
+        }).value();
+        // clang-format on
+    }
+
+    RenderMode render_mode = RenderMode::TEXTURED_LIGHTMAP;
+    std::array<std::shared_ptr<daxa::RasterPipeline>, RENDER_MODE_N> draw_raster_pipelines = [this]() {
+        auto result = std::array<std::shared_ptr<daxa::RasterPipeline>, RENDER_MODE_N>{};
+        for (usize i = 0; i < RENDER_MODE_N; ++i)
+            result[i] = create_draw_pipeline("DRAW_FRAG", render_mode_defines[i], COLOR_FORMAT, render_mode_names[i]);
+        return result;
+    }();
+    // Used for the '{' (masked) textures, which are skipped by the other variants
+    std::shared_ptr<daxa::RasterPipeline> alpha_tested_raster_pipeline = create_draw_pipeline("DRAW_FRAG", "DRAW_MODE_ALPHA_TESTED", COLOR_FORMAT, "Alpha Tested");
+
+    // Visibility buffer path: rasterize (draw, triangle) ids, then shade every pixel once in a compute pass
+    bool use_visibility_buffer = false;
+    std::shared_ptr<daxa::RasterPipeline> vis_raster_pipeline = create_draw_pipeline("VIS_FRAG", "DRAW_MODE_TEXTURED_LIGHTMAP", VIS_FORMAT, "Visibility");
+    std::shared_ptr<daxa::RasterPipeline> vis_alpha_tested_raster_pipeline = create_draw_pipeline("VIS_FRAG", "DRAW_MODE_ALPHA_TESTED", VIS_FORMAT, "Visibility Alpha Tested");
+    std::array<std::shared_ptr<daxa::ComputePipeline>, RENDER_MODE_N> vis_resolve_compute_pipelines = [this]() {
+        auto result = std::array<std::shared_ptr<daxa::ComputePipeline>, RENDER_MODE_N>{};
+        for (usize i = 0; i < RENDER_MODE_N; ++i) {
+            // clang-format off
+            result[i] = pipeline_manager.add_compute_pipeline({
+                .shader_info = daxa::ShaderCompileInfo{.source = daxa::ShaderFile{"visbuffer.glsl"}, .compile_options = {.defines = {daxa::ShaderDefine{render_mode_defines[i]}}}},
+                .push_constant_size = sizeof(VisResolvePush),
+                .name = APPNAME_PREFIX("vis_resolve_compute_pipeline (") + std::string{render_mode_names[i]} + ")",
+            }).value();
+            // clang-format on
+        }
+        return result;
+    }();
+
     // clang-format off
-    std::shared_ptr<daxa::RasterPipeline> draw_raster_pipeline = pipeline_manager.add_raster_pipeline({
-        .vertex_shader_info = daxa::ShaderCompileInfo{.source = daxa::ShaderFile{"draw.glsl"}, .compile_options = {.defines = {daxa::ShaderDefine{"DRAW_VERT"}}}},
-        .fragment_shader_info = daxa::ShaderCompileInfo{.source = daxa::ShaderFile{"draw.glsl"}, .compile_options = {.defines = {daxa::ShaderDefine{"DRAW_FRAG"}}}},
-        .color_attachments = {{.format = swapchain.get_format()}},
-        .depth_test = {
-            .depth_attachment_format = daxa::Format::D24_UNORM_S8_UINT,
-            .enable_depth_test = true,
-            .enable_depth_write = true,
-        },
-        .raster = {
-            .face_culling = daxa::FaceCullFlagBits::BACK_BIT,
-        },
-        .push_constant_size = sizeof(DrawPush),
-        .name = APPNAME_PREFIX("draw_raster_pipeline"),
+    std::shared_ptr<daxa::ComputePipeline> easu_compute_pipeline = pipeline_manager.add_compute_pipeline({
+        .shader_info = daxa::ShaderCompileInfo{.source = daxa::ShaderFile{"upscale.glsl"}, .compile_options = {.defines = {daxa::ShaderDefine{"UPSCALE_EASU"}}}},
+        .push_constant_size = sizeof(UpscalePush),
+        .name = APPNAME_PREFIX("easu_compute_pipeline"),
+    }).value();
+    std::shared_ptr<daxa::ComputePipeline> rcas_compute_pipeline = pipeline_manager.add_compute_pipeline({
+        .shader_info = daxa::ShaderCompileInfo{.source = daxa::ShaderFile{"upscale.glsl"}, .compile_options = {.defines = {daxa::ShaderDefine{"UPSCALE_RCAS"}}}},
+        .push_constant_size = sizeof(UpscalePush),
+        .name = APPNAME_PREFIX("rcas_compute_pipeline"),
     }).value();
     // clang-format on
-    daxa::BufferId gpu_input_buffer = device.create_buffer(daxa::BufferInfo{
-        .size = sizeof(GpuInput),
-        .name = APPNAME_PREFIX("gpu_input_buffer"),
-    });
+    // Everything the CPU writes for a frame gets its own copy per frame in flight, so recording
+    // frame N + 1 never overwrites data the GPU is still reading for frame N.
+    struct FrameResources {
+        daxa::BufferId gpu_input_buffer;
+        daxa::BufferId draw_list_buffer;
+        u32 draw_capacity = 0;
+        daxa::BufferId lightmap_staging_buffer;
+        daxa::BufferId mip_staging_buffer;
+        // Evicted maps and textures coming back, grown to the largest restore of the frame
+        daxa::BufferId restore_staging_buffer;
+        usize restore_staging_capacity = 0;
+    };
+    // Lightmaps of streamed in maps and re-composited light style lightmaps uploaded per frame, the rest waits for the next frame
+    static constexpr u32 LIGHTMAP_STAGING_SIZE = 1024 * 1024;
+    // Texture mips streamed in per frame, a 512x512 texture with all its mips takes under 1.5 MiB
+    static constexpr u32 MIP_STAGING_SIZE = 8 * 1024 * 1024;
+    FrameResources *current_frame = nullptr;
+    std::vector<FrameResources> frame_resources = create_frame_resources();
+    DrawList draw_list = {};
+
+    auto create_frame_resources() -> std::vector<FrameResources> {
+        auto result = std::vector<FrameResources>(frames_in_flight);
+        for (auto &frame : result) {
+            frame.gpu_input_buffer = create_buffer(device, {
+                .size = sizeof(GpuInput),
+                .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
+                .name = APPNAME_PREFIX("gpu_input_buffer"),
+            });
+            frame.lightmap_staging_buffer = create_buffer(device, {
+                .size = LIGHTMAP_STAGING_SIZE,
+                .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
+                .name = APPNAME_PREFIX("lightmap_staging_buffer"),
+            });
+            frame.mip_staging_buffer = create_buffer(device, {
+                .size = MIP_STAGING_SIZE,
+                .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
+                .name = APPNAME_PREFIX("mip_staging_buffer"),
+            });
+        }
+        return result;
+    }
+    // Called once the GPU is done with the frame's previous use, so only that frame's list is replaced. The old buffer is
+    // destroyed once the frames using it are done. The headroom keeps maps streaming in one by one from growing it each time.
+    void ensure_draw_capacity(FrameResources &frame, u32 draw_n) {
+        if (draw_n <= frame.draw_capacity)
+            return;
+        if (!frame.draw_list_buffer.is_empty())
+            device.destroy_buffer(frame.draw_list_buffer);
+        frame.draw_capacity = std::max(draw_n + draw_n / 2, 64u);
+        frame.draw_list_buffer = create_buffer(device, {
+            .size = static_cast<u32>(sizeof(DrawData) * frame.draw_capacity),
+            .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
+            .name = APPNAME_PREFIX("draw_list_buffer"),
+        });
+    }
+    // The same for the restore staging buffer, called from the frame's graph. Its previous size usually fits a map.
+    void ensure_restore_capacity(FrameResources &frame, usize size) {
+        if (size <= frame.restore_staging_capacity)
+            return;
+        if (!frame.restore_staging_buffer.is_empty())
+            device.destroy_buffer(frame.restore_staging_buffer);
+        frame.restore_staging_capacity = size + size / 2;
+        frame.restore_staging_buffer = create_buffer(device, {
+            .size = static_cast<u32>(frame.restore_staging_capacity),
+            .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
+            .name = APPNAME_PREFIX("restore_staging_buffer"),
+        });
+    }
 
     daxa::TaskBuffer task_vertex_buffer;
+    daxa::TaskImage task_lightmap_image;
+    bool lightmap_state_tracked = false;
     std::vector<daxa::BufferId> vertex_buffers;
+    // Only rebuild the task buffer list when the set of loaded map buffers changes
+    bool vertex_buffers_dirty = true;
 
+#if COUNT_ALLOCATIONS
+    u64 frame_heap_allocations = 0;
+    u64 frame_buffer_creations = 0;
+#endif
+
+    static constexpr u32 GPU_TIMER_SLOTS = 4;
+    daxa::TimelineQueryPool gpu_timer_query_pool = device.create_timeline_query_pool({
+        .query_count = GPU_TIMER_SLOTS * 2,
+        .name = APPNAME_PREFIX("gpu_timer_query_pool"),
+    });
+    u64 frame_index = 0;
+    f32 gpu_frame_ms = 0.0f;
+
+    DynamicResolution dynamic_resolution = {};
     f32 render_scl = 1.0f;
     u32vec2 render_size = calc_render_size();
+    u32vec2 render_image_size = calc_render_image_size();
 
     auto calc_render_size() -> u32vec2 {
         return {
-            static_cast<u32>(size_x * render_scl),
-            static_cast<u32>(size_y * render_scl),
+            std::max(1u, static_cast<u32>(static_cast<f32>(size_x) * render_scl)),
+            std::max(1u, static_cast<u32>(static_cast<f32>(size_y) * render_scl)),
+        };
+    }
+    // The render images are allocated for the largest allowed scale, and
+    // each frame only renders into the top-left `render_size` sub-rect.
+    auto calc_render_image_size() -> u32vec2 {
+        return {
+            std::max(1u, static_cast<u32>(static_cast<f32>(size_x) * dynamic_resolution.max_scl)),
+            std::max(1u, static_cast<u32>(static_cast<f32>(size_y) * dynamic_resolution.max_scl)),
         };
     }
 
+    // Also written by the visibility buffer resolve, so it has to be a storage-capable format
     daxa::ImageId color_image = device.create_image({
-        .format = daxa::Format::R8G8B8A8_SRGB,
-        .size = {render_size.x, render_size.y, 1},
-        .usage = daxa::ImageUsageFlagBits::COLOR_ATTACHMENT | daxa::ImageUsageFlagBits::TRANSFER_SRC,
+        .format = COLOR_FORMAT,
+        .size = {render_image_size.x, render_image_size.y, 1},
+        .usage = daxa::ImageUsageFlagBits::COLOR_ATTACHMENT | daxa::ImageUsageFlagBits::SHADER_STORAGE | daxa::ImageUsageFlagBits::SHADER_SAMPLED | daxa::ImageUsageFlagBits::TRANSFER_SRC,
     });
     daxa::TaskImage task_color_image;
     daxa::ImageId depth_image = device.create_image({
         .format = daxa::Format::D24_UNORM_S8_UINT,
-        .size = {render_size.x, render_size.y, 1},
+        .size = {render_image_size.x, render_image_size.y, 1},
         .usage = daxa::ImageUsageFlagBits::DEPTH_STENCIL_ATTACHMENT,
     });
     daxa::TaskImage task_depth_image;
+    daxa::ImageId vis_image = device.create_image({
+        .format = VIS_FORMAT,
+        .size = {render_image_size.x, render_image_size.y, 1},
+        .usage = daxa::ImageUsageFlagBits::COLOR_ATTACHMENT | daxa::ImageUsageFlagBits::SHADER_STORAGE,
+        .name = APPNAME_PREFIX("vis_image"),
+    });
+    daxa::TaskImage task_vis_image;
+
+    // The spatial upscaler (EASU + RCAS) writes at the swapchain resolution.
+    bool use_upscaler = true;
+    f32 upscaler_sharpness_stops = 0.2f;
+    daxa::SamplerId upscale_sampler = device.create_sampler({
+        .magnification_filter = daxa::Filter::NEAREST,
+        .minification_filter = daxa::Filter::NEAREST,
+        .max_lod = 0,
+        .name = APPNAME_PREFIX("upscale_sampler"),
+    });
+    daxa::ImageId upscaled_image = device.create_image({
+        .format = daxa::Format::R16G16B16A16_SFLOAT,
+        .size = {size_x, size_y, 1},
+        .usage = daxa::ImageUsageFlagBits::SHADER_STORAGE | daxa::ImageUsageFlagBits::SHADER_SAMPLED,
+        .name = APPNAME_PREFIX("upscaled_image"),
+    });
+    daxa::TaskImage task_upscaled_image;
+    daxa::ImageId sharpened_image = device.create_image({
+        .format = daxa::Format::R16G16B16A16_SFLOAT,
+        .size = {size_x, size_y, 1},
+        .usage = daxa::ImageUsageFlagBits::SHADER_STORAGE | daxa::ImageUsageFlagBits::TRANSFER_SRC,
+        .name = APPNAME_PREFIX("sharpened_image"),
+    });
+    daxa::TaskImage task_sharpened_image;
 
-    std::filesystem::path data_directory = ".";
+    auto is_upscaling() -> bool {
+        return use_upscaler && (render_size.x < size_x || render_size.y < size_y);
+    }
 
     std::vector<nlohmann::json> saved_settings;
 
     auto get_settings_json() -> nlohmann::json {
         auto json = nlohmann::json{};
+        // Streamed maps keep their offset while they are not loaded
+        for (auto &map : halflife.streamer.maps) {
+            auto const &user_offset = map.bsp != nullptr ? map.bsp->user_offset : map.user_offset;
+            json[map.entry.m_szName] = nlohmann::json{user_offset.x, user_offset.y, user_offset.z};
+        }
         for (auto &map : halflife.maps) {
             json[map->mapId] = nlohmann::json{map->user_offset.x, map->user_offset.y, map->user_offset.z};
         }
         return json;
     }
     void set_settings_json(nlohmann::json &json) {
+        for (auto &map : halflife.streamer.maps) {
+            if (json.contains(map.entry.m_szName)) {
+                auto &v = json[map.entry.m_szName];
+                map.user_offset = {v[0], v[1], v[2]};
+            }
+        }
         for (auto &map : halflife.maps) {
             if (json.contains(map->mapId)) {
                 auto &v = json[map->mapId];
@@ -352,15 +823,249 @@ struct App : BaseApp<App> {
         player.camera.set_pos(player.pos);
         player.camera.set_rot(player.rot.x, player.rot.y);
         player.update(1.0f);
+#if BENCHMARK_UPSCALER
+        benchmark_upscaler();
+#endif
     }
     ~App() {
-        device.wait_idle();
+        {
+            auto const lock = std::lock_guard{gpu_queue_mutex};
+            device.wait_idle();
+        }
         device.collect_garbage();
-        device.destroy_buffer(gpu_input_buffer);
+        for (auto &frame : frame_resources) {
+            device.destroy_buffer(frame.gpu_input_buffer);
+            device.destroy_buffer(frame.lightmap_staging_buffer);
+            device.destroy_buffer(frame.mip_staging_buffer);
+            if (!frame.restore_staging_buffer.is_empty())
+                device.destroy_buffer(frame.restore_staging_buffer);
+            if (!frame.draw_list_buffer.is_empty())
+                device.destroy_buffer(frame.draw_list_buffer);
+        }
         device.destroy_image(depth_image);
         device.destroy_image(color_image);
+        device.destroy_image(vis_image);
+        device.destroy_image(upscaled_image);
+        device.destroy_image(sharpened_image);
+        device.destroy_sampler(upscale_sampler);
     }
 
+#if BENCHMARK_UPSCALER
+    // Times EASU and RCAS on a test image and checks what they wrote on the CPU. An EASU pixel never leaves the
+    // range of the 2x2 source texels around it, RCAS keeps colors in [0, 1] and leaves flat areas alone.
+    void benchmark_upscaler() {
+        static constexpr u32vec2 SRC_SIZE = {640, 360};
+        static constexpr u32vec2 DST_SIZE = {1280, 720};
+        static constexpr u32 DISPATCH_N = 32;
+        auto const src_n = static_cast<usize>(SRC_SIZE.x) * SRC_SIZE.y;
+        auto const dst_n = static_cast<usize>(DST_SIZE.x) * DST_SIZE.y;
+
+        // RGBA32F texels: the source, then the EASU and the RCAS output
+        auto readback_buffer = create_buffer(device, {
+            .size = static_cast<u32>((src_n + dst_n * 2) * 4 * sizeof(f32)),
+            .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
+            .name = APPNAME_PREFIX("upscaler_benchmark_buffer"),
+        });
+        auto *const src = device.get_host_address_as<f32>(readback_buffer);
+        auto const *const easu = src + src_n * 4;
+        auto const *const rcas = easu + dst_n * 4;
+        // Flat on the left half, hard edges and gradients on the right
+        for (u32 y = 0; y < SRC_SIZE.y; y++) {
+            for (u32 x = 0; x < SRC_SIZE.x; x++) {
+                auto *const texel = src + (static_cast<usize>(y) * SRC_SIZE.x + x) * 4;
+                auto const flat = x < SRC_SIZE.x / 2;
+                texel[0] = flat ? 0.25f : static_cast<f32>(((x / 7) ^ (y / 5)) & 1);
+                texel[1] = flat ? 0.5f : static_cast<f32>(x) / static_cast<f32>(SRC_SIZE.x);
+                texel[2] = flat ? 0.75f : static_cast<f32>((x * 31 + y * 17) % 64) / 63.0f;
+                texel[3] = 1.0f;
+            }
+        }
+
+        auto src_image = device.create_image({
+            .format = daxa::Format::R32G32B32A32_SFLOAT,
+            .size = {SRC_SIZE.x, SRC_SIZE.y, 1},
+            .usage = daxa::ImageUsageFlagBits::SHADER_SAMPLED | daxa::ImageUsageFlagBits::TRANSFER_DST,
+            .name = APPNAME_PREFIX("upscaler_benchmark_src_image"),
+        });
+        auto easu_image = device.create_image({
+            .format = daxa::Format::R32G32B32A32_SFLOAT,
+            .size = {DST_SIZE.x, DST_SIZE.y, 1},
+            .usage = daxa::ImageUsageFlagBits::SHADER_STORAGE | daxa::ImageUsageFlagBits::SHADER_SAMPLED | daxa::ImageUsageFlagBits::TRANSFER_SRC,
+            .name = APPNAME_PREFIX("upscaler_benchmark_easu_image"),
+        });
+        auto rcas_image = device.create_image({
+            .format = daxa::Format::R32G32B32A32_SFLOAT,
+            .size = {DST_SIZE.x, DST_SIZE.y, 1},
+            .usage = daxa::ImageUsageFlagBits::SHADER_STORAGE | daxa::ImageUsageFlagBits::TRANSFER_SRC,
+            .name = APPNAME_PREFIX("upscaler_benchmark_rcas_image"),
+        });
+
+        // Returns the time from submission until the GPU is done, in microseconds
+        auto const submit_and_wait = [this](daxa::CommandList &&cmd_list) -> f64 {
+            cmd_list.complete();
+            auto semaphore = device.create_timeline_semaphore({.initial_value = 0, .name = APPNAME_PREFIX("upscaler_benchmark_semaphore")});
+            auto const start = std::chrono::steady_clock::now();
+            {
+                auto const lock = std::lock_guard{gpu_queue_mutex};
+                device.submit_commands({
+                    .command_lists = {std::move(cmd_list)},
+                    .signal_timeline_semaphores = {{semaphore, 1}},
+                });
+            }
+            semaphore.wait_for_value(1);
+            return std::chrono::duration<f64, std::micro>(std::chrono::steady_clock::now() - start).count();
+        };
+        auto const dispatch_n_times = [](daxa::CommandList &cmd_list, daxa::ComputePipeline const &pipeline, UpscalePush const &push) {
+            cmd_list.set_pipeline(pipeline);
+            for (u32 i = 0; i < DISPATCH_N; i++) {
+                cmd_list.push_constant(push);
+                cmd_list.dispatch((DST_SIZE.x + 7) / 8, (DST_SIZE.y + 7) / 8);
+                // Serializes the dispatches, so the total is the sum of their durations
+                cmd_list.pipeline_barrier({
+                    .src_access = daxa::AccessConsts::COMPUTE_SHADER_WRITE,
+                    .dst_access = daxa::AccessConsts::COMPUTE_SHADER_WRITE,
+                });
+            }
+        };
+
+        auto cmd_list = device.create_command_list({.name = APPNAME_PREFIX("upscaler_benchmark_cmd_list")});
+        cmd_list.pipeline_barrier_image_transition({
+            .src_access = daxa::AccessConsts::HOST_WRITE,
+            .dst_access = daxa::AccessConsts::TRANSFER_WRITE,
+            .src_layout = daxa::ImageLayout::UNDEFINED,
+            .dst_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+            .image_id = src_image,
+        });
+        cmd_list.copy_buffer_to_image({
+            .buffer = readback_buffer,
+            .image = src_image,
+            .image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+            .image_extent = {SRC_SIZE.x, SRC_SIZE.y, 1},
+        });
+        cmd_list.pipeline_barrier_image_transition({
+            .src_access = daxa::AccessConsts::TRANSFER_WRITE,
+            .dst_access = daxa::AccessConsts::COMPUTE_SHADER_READ,
+            .src_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+            .dst_layout = daxa::ImageLayout::READ_ONLY_OPTIMAL,
+            .image_id = src_image,
+        });
+        for (auto image : {easu_image, rcas_image}) {
+            cmd_list.pipeline_barrier_image_transition({
+                .dst_access = daxa::AccessConsts::COMPUTE_SHADER_WRITE,
+                .src_layout = daxa::ImageLayout::UNDEFINED,
+                .dst_layout = daxa::ImageLayout::GENERAL,
+                .image_id = image,
+            });
+        }
+        submit_and_wait(std::move(cmd_list));
+
+        cmd_list = device.create_command_list({.name = APPNAME_PREFIX("upscaler_benchmark_cmd_list")});
+        dispatch_n_times(cmd_list, *easu_compute_pipeline, {
+            .src_image = src_image.default_view(),
+            .src_sampler = upscale_sampler,
+            .dst_image = easu_image.default_view(),
+            .src_size = SRC_SIZE,
+            .dst_size = DST_SIZE,
+            .sharpness = 0.0f,
+        });
+        auto const easu_us = submit_and_wait(std::move(cmd_list)) / DISPATCH_N;
+
+        cmd_list = device.create_command_list({.name = APPNAME_PREFIX("upscaler_benchmark_cmd_list")});
+        cmd_list.pipeline_barrier_image_transition({
+            .src_access = daxa::AccessConsts::COMPUTE_SHADER_WRITE,
+            .dst_access = daxa::AccessConsts::COMPUTE_SHADER_READ,
+            .src_layout = daxa::ImageLayout::GENERAL,
+            .dst_layout = daxa::ImageLayout::READ_ONLY_OPTIMAL,
+            .image_id = easu_image,
+        });
+        submit_and_wait(std::move(cmd_list));
+
+        cmd_list = device.create_command_list({.name = APPNAME_PREFIX("upscaler_benchmark_cmd_list")});
+        dispatch_n_times(cmd_list, *rcas_compute_pipeline, {
+            .src_image = easu_image.default_view(),
+            .src_sampler = upscale_sampler,
+            .dst_image = rcas_image.default_view(),
+            .src_size = DST_SIZE,
+            .dst_size = DST_SIZE,
+            .sharpness = 1.0f,
+        });
+        auto const rcas_us = submit_and_wait(std::move(cmd_list)) / DISPATCH_N;
+
+        cmd_list = device.create_command_list({.name = APPNAME_PREFIX("upscaler_benchmark_cmd_list")});
+        cmd_list.pipeline_barrier_image_transition({
+            .src_access = daxa::AccessConsts::COMPUTE_SHADER_READ,
+            .dst_access = daxa::AccessConsts::TRANSFER_READ,
+            .src_layout = daxa::ImageLayout::READ_ONLY_OPTIMAL,
+            .dst_layout = daxa::ImageLayout::TRANSFER_SRC_OPTIMAL,
+            .image_id = easu_image,
+        });
+        cmd_list.pipeline_barrier_image_transition({
+            .src_access = daxa::AccessConsts::COMPUTE_SHADER_WRITE,
+            .dst_access = daxa::AccessConsts::TRANSFER_READ,
+            .src_layout = daxa::ImageLayout::GENERAL,
+            .dst_layout = daxa::ImageLayout::TRANSFER_SRC_OPTIMAL,
+            .image_id = rcas_image,
+        });
+        for (auto [image, offset] : {std::pair{easu_image, src_n}, std::pair{rcas_image, src_n + dst_n}}) {
+            cmd_list.copy_image_to_buffer({
+                .image = image,
+                .image_layout = daxa::ImageLayout::TRANSFER_SRC_OPTIMAL,
+                .image_extent = {DST_SIZE.x, DST_SIZE.y, 1},
+                .buffer = readback_buffer,
+                .buffer_offset = offset * 4 * sizeof(f32),
+            });
+        }
+        cmd_list.pipeline_barrier({
+            .src_access = daxa::AccessConsts::TRANSFER_WRITE,
+            .dst_access = daxa::AccessConsts::HOST_READ,
+        });
+        submit_and_wait(std::move(cmd_list));
+
+        static constexpr f32 EPSILON = 1.0f / 65536.0f;
+        auto const texel = [](f32 const *image, u32vec2 size, i32 x, i32 y) {
+            x = std::clamp(x, 0, static_cast<i32>(size.x) - 1);
+            y = std::clamp(y, 0, static_cast<i32>(size.y) - 1);
+            return image + (static_cast<usize>(y) * size.x + static_cast<usize>(x)) * 4;
+        };
+        usize easu_bad_n = 0;
+        usize rcas_bad_n = 0;
+        for (i32 y = 0; y < static_cast<i32>(DST_SIZE.y); y++) {
+            for (i32 x = 0; x < static_cast<i32>(DST_SIZE.x); x++) {
+                // The same source position as the shader, the neighbourhood EASU clamps its result to
+                auto const src_x = std::floor((static_cast<f32>(x) + 0.5f) * static_cast<f32>(SRC_SIZE.x) / static_cast<f32>(DST_SIZE.x) - 0.5f);
+                auto const src_y = std::floor((static_cast<f32>(y) + 0.5f) * static_cast<f32>(SRC_SIZE.y) / static_cast<f32>(DST_SIZE.y) - 0.5f);
+                auto const ix = static_cast<i32>(src_x), iy = static_cast<i32>(src_y);
+                auto const *const e = texel(easu, DST_SIZE, x, y);
+                auto const *const r = texel(rcas, DST_SIZE, x, y);
+                auto easu_bad = false, rcas_bad = false;
+                for (u32 c = 0; c < 3; c++) {
+                    auto lo = 1.0f, hi = 0.0f;
+                    for (auto const *n : {texel(src, SRC_SIZE, ix, iy), texel(src, SRC_SIZE, ix + 1, iy), texel(src, SRC_SIZE, ix, iy + 1), texel(src, SRC_SIZE, ix + 1, iy + 1)}) {
+                        lo = std::min(lo, n[c]);
+                        hi = std::max(hi, n[c]);
+                    }
+                    easu_bad = easu_bad || e[c] < lo - EPSILON || e[c] > hi + EPSILON;
+
+                    auto flat = true;
+                    for (auto const *n : {texel(easu, DST_SIZE, x, y - 1), texel(easu, DST_SIZE, x - 1, y), texel(easu, DST_SIZE, x + 1, y), texel(easu, DST_SIZE, x, y + 1)})
+                        flat = flat && n[c] == e[c];
+                    rcas_bad = rcas_bad || r[c] < -EPSILON || r[c] > 1.0f + EPSILON || (flat && std::abs(r[c] - e[c]) > EPSILON);
+                }
+                easu_bad_n += easu_bad;
+                rcas_bad_n += rcas_bad;
+            }
+        }
+        std::cout << "Upscaler (" << SRC_SIZE.x << "x" << SRC_SIZE.y << " to " << DST_SIZE.x << "x" << DST_SIZE.y << "): EASU " << easu_us << "us, RCAS " << rcas_us
+                  << "us per dispatch, " << (easu_bad_n + rcas_bad_n == 0 ? "output within bounds" : "OUTPUT OUT OF BOUNDS") << " (" << easu_bad_n << " EASU, "
+                  << rcas_bad_n << " RCAS texels off)" << std::endl;
+
+        device.destroy_image(src_image);
+        device.destroy_image(easu_image);
+        device.destroy_image(rcas_image);
+        device.destroy_buffer(readback_buffer);
+    }
+#endif
+
     void gizmo(BSP *map) {
         auto cam_view = glm::translate(glm::rotate(glm::rotate(glm::mat4(1), -player.rot.y, {1, 0, 0}), player.rot.x, {0, 1, 0}), glm::vec3(player.pos.x, -player.pos.y, player.pos.z));
         auto cam_proj = player.camera.proj_mat;
@@ -398,19 +1103,93 @@ struct App : BaseApp<App> {
 
             ImGui::Begin("Debug");
 
-            if (ImGui::SliderFloat("Render Scale", &render_scl, 0.1f, 2.0f)) {
+            if (ImGui::SliderFloat("Max Render Scale", &dynamic_resolution.max_scl, 0.1f, 2.0f)) {
+                dynamic_resolution.min_scl = std::min(dynamic_resolution.min_scl, dynamic_resolution.max_scl);
+                render_scl = std::min(render_scl, dynamic_resolution.max_scl);
                 recreate_render_image(color_image, task_color_image);
                 recreate_render_image(depth_image, task_depth_image);
+                recreate_render_image(vis_image, task_vis_image);
+            }
+            ImGui::Checkbox("Dynamic Resolution", &dynamic_resolution.enabled);
+            if (dynamic_resolution.enabled) {
+                ImGui::SliderFloat("Target Frame Time (ms)", &dynamic_resolution.target_frame_ms, 1.0f, 50.0f);
+                ImGui::SliderFloat("Min Render Scale", &dynamic_resolution.min_scl, 0.1f, dynamic_resolution.max_scl);
+                ImGui::Text("Render Scale: %.2f", static_cast<f64>(render_scl));
+                ImGui::Text("GPU Frame Time: %.2f ms", static_cast<f64>(gpu_frame_ms));
+            } else {
+                ImGui::SliderFloat("Render Scale", &render_scl, 0.1f, dynamic_resolution.max_scl);
             }
+            ImGui::Checkbox("Upscaler (EASU + RCAS)", &use_upscaler);
+            if (use_upscaler)
+                ImGui::SliderFloat("Sharpness Reduction (stops)", &upscaler_sharpness_stops, 0.0f, 2.0f);
+
+            ImGui::Checkbox("Limit FPS", &frame_pacer.limit_fps);
+            if (frame_pacer.limit_fps)
+                ImGui::SliderFloat("Target FPS", &frame_pacer.target_fps, 10.0f, 360.0f);
+            ImGui::Checkbox("Render On Demand", &frame_pacer.on_demand);
+
+            if (ImGui::Button("Reload Shaders"))
+                pipeline_manager.reload_all();
+#if COUNT_ALLOCATIONS
+            ImGui::Text("Heap allocations per frame: %llu", static_cast<unsigned long long>(frame_heap_allocations));
+            ImGui::Text("Buffer creations per frame: %llu", static_cast<unsigned long long>(frame_buffer_creations));
+#endif
 
             ImGui::SliderInt("Sampler", &halflife.tex_image_sampler_i, 0, 3);
+            ImGui::Combo("Render Mode", reinterpret_cast<i32 *>(&render_mode), render_mode_names.data(), static_cast<i32>(RENDER_MODE_N));
+            ImGui::Checkbox("Animate Light Styles", &halflife.world_lightmap.styles.animate);
+            {
+                auto const texture_stats = halflife.assets.textures.content_stats();
+                ImGui::Text("Textures: %u images (%llu KiB), %u aliased (%llu KiB saved)", texture_stats.image_n, static_cast<unsigned long long>(texture_stats.image_bytes / 1024),
+                            texture_stats.alias_n, static_cast<unsigned long long>(texture_stats.saved_bytes / 1024));
+            }
+            {
+                auto const lock = std::lock_guard{halflife.world_lightmap.mutex};
+                ImGui::Text("Animated lightmaps: %zu (%zu queued)", halflife.world_lightmap.styles.lightmaps.size(), halflife.world_lightmap.styles.queue.size());
+            }
+            {
+                auto const usage = halflife.vram_usage();
+                ImGui::Text("VRAM: %llu MiB (geometry %llu, textures %llu, lightmap %llu), %u maps evicted", static_cast<unsigned long long>(usage.total() >> 20),
+                            static_cast<unsigned long long>(usage.geometry >> 20), static_cast<unsigned long long>(usage.textures >> 20),
+                            static_cast<unsigned long long>(usage.lightmap >> 20), usage.evicted_map_n);
+                ImGui::Text("Triangles in RAM: %llu MiB", static_cast<unsigned long long>(usage.cpu_geometry >> 20));
+                auto budget_mib = static_cast<i32>(halflife.vram_budget >> 20);
+                if (ImGui::SliderInt("VRAM Budget (MiB, 0 = none)", &budget_mib, 0, 8192))
+                    halflife.vram_budget = static_cast<u64>(budget_mib) << 20;
+                auto const top_mip_n = halflife.assets.textures.content_stats().top_mip_n;
+                ImGui::Text("Texture mips resident from: 0 x%u, 1 x%u, 2 x%u, 3 x%u", top_mip_n[0], top_mip_n[1], top_mip_n[2], top_mip_n[3]);
+                // Without the pixels, textures stay at the mips they were uploaded with
+                if (halflife.assets.textures.keep_pixels)
+                    ImGui::Checkbox("Mip Streaming", &halflife.mip_streaming);
+            }
+            if (halflife.streaming) {
+                ImGui::Text("Streaming: %u/%zu maps resident (max %u)%s", halflife.streamer.resident_count(), halflife.streamer.maps.size(), halflife.streamer.max_maps,
+                            halflife.streamer.loading() ? ", loading" : "");
+                ImGui::SliderFloat("Streaming Radius", &halflife.streamer.radius, 256.0f, 32768.0f);
+            }
+            if (ImGui::Checkbox("Visibility Buffer", &use_visibility_buffer)) {
+                // The two paths use different passes, so the task graph is recorded again
+                {
+                    auto const lock = std::lock_guard{gpu_queue_mutex};
+                    device.wait_idle();
+                }
+                loop_task_graph = record_loop_task_graph();
+                vertex_buffers_dirty = true;
+            }
 
             ImGui::SliderFloat("Move Speed", &player.speed, 50.0f, 400.0f);
             ImGui::SliderFloat("Sprint Multiplier", &player.sprint_speed, 1.0f, 50.0f);
 
-            for (auto map : halflife.maps) {
+            auto unload_i = halflife.maps.size();
+            for (usize map_i = 0; map_i < halflife.maps.size(); map_i++) {
+                auto *const map = halflife.maps[map_i];
                 ImGui::PushID(static_cast<int>(reinterpret_cast<usize>(map)));
                 ImGui::Checkbox(map->mapId.c_str(), &map->should_draw);
+                ImGui::SameLine();
+                if (ImGui::SmallButton("Unload"))
+                    unload_i = map_i;
+                if (halflife.streaming && ImGui::IsItemHovered())
+                    ImGui::SetTooltip("Not streamed in again until restarted");
                 ImGui::PopID();
 
                 auto parent_iter = std::find_if(halflife.maps.begin(), halflife.maps.end(), [map](auto const &m) { return map->parent_mapId == m->mapId; });
@@ -428,15 +1207,21 @@ struct App : BaseApp<App> {
                 ImGui::PopID();
 
                 if (map->should_draw) {
-                    auto offset_str = map->mapId + " offset";
-                    auto parent_str = map->mapId + " parent";
+                    ImGui::PushID(static_cast<int>(reinterpret_cast<usize>(map)) + 2);
                     ImGui::SameLine();
-                    if (ImGui::InputFloat3(offset_str.c_str(), &map->user_offset.x))
+                    if (ImGui::InputFloat3("offset", &map->user_offset.x))
                         save_settings();
                     ImGui::SameLine();
-                    ImGui::InputText(parent_str.c_str(), &map->parent_mapId);
+                    ImGui::InputText("parent", &map->parent_mapId);
+                    ImGui::PopID();
                 }
             }
+            if (unload_i < halflife.maps.size()) {
+                if (auto const slot = halflife.streamer.find(halflife.maps[unload_i]->mapId))
+                    halflife.streamer.maps[*slot].enabled = false;
+                halflife.unload_map(unload_i);
+                vertex_buffers_dirty = true;
+            }
 
 #if COUNT_DRAWS
             ImGui::Text("Draw Count: %llu", draw_count);
@@ -455,21 +1240,94 @@ struct App : BaseApp<App> {
             //     ImGui::Image(*reinterpret_cast<ImTextureID const *>(&tex.image_id), ImVec2(static_cast<f32>(tex.w), static_cast<f32>(tex.h)));
             // }
             // for (auto &map : halflife.maps) {
-            //     ImGui::Image(*reinterpret_cast<ImTextureID const *>(&map->lmap_image_id), {1024, 1024});
             // }
+            // ImGui::Image(*reinterpret_cast<ImTextureID const *>(&halflife.world_lightmap.image_id), {1024, 1024});
             // ImGui::End();
 #endif
         }
         ImGui::Render();
     }
+    void read_gpu_frame_time() {
+        // Reading back the queries allocates, so only do it when something consumes the result
+        if (!dynamic_resolution.enabled || frame_index < GPU_TIMER_SLOTS)
+            return;
+        auto const timer_slot = static_cast<u32>(frame_index % GPU_TIMER_SLOTS);
+        auto results = gpu_timer_query_pool.get_query_results(timer_slot * 2, 2);
+        // Each query yields a (timestamp, availability) pair
+        if (results[1] == 0 || results[3] == 0)
+            return;
+        auto const elapsed_ns = static_cast<f64>(results[2] - results[0]) * static_cast<f64>(device.properties().limits.timestamp_period);
+        gpu_frame_ms = static_cast<f32>(elapsed_ns / 1'000'000.0);
+        render_scl = dynamic_resolution.update(gpu_frame_ms, render_scl);
+    }
+
     void on_update() {
-        pipeline_manager.reload_all();
+#if COUNT_ALLOCATIONS
+        auto const heap_allocations_before = heap_allocation_count.load(std::memory_order_relaxed);
+        auto const buffer_creations_before = buffer_creation_count.load(std::memory_order_relaxed);
+#endif
+        render_frame();
+#if COUNT_ALLOCATIONS
+        frame_heap_allocations = heap_allocation_count.load(std::memory_order_relaxed) - heap_allocations_before;
+        frame_buffer_creations = buffer_creation_count.load(std::memory_order_relaxed) - buffer_creations_before;
+#endif
+    }
+
+    void render_frame() {
+        read_gpu_frame_time();
         ui_update();
+        render_size = calc_render_size();
+
+        if (halflife.update_streaming(player.pos))
+            vertex_buffers_dirty = true;
+        // Keeps polling while a map loads, even when rendering on demand
+        if (halflife.streaming && halflife.streamer.loading())
+            frame_pacer.mark_dirty();
+        // Light styles only advance and lightmaps only upload in rendered frames
+        {
+            auto const lock = std::lock_guard{halflife.world_lightmap.mutex};
+            auto const &world_lightmap = halflife.world_lightmap;
+            if (world_lightmap.styles.animating() || !world_lightmap.styles.queue.empty() || !world_lightmap.upload_queue.empty())
+                frame_pacer.mark_dirty();
+        }
+        {
+            auto const lock = std::lock_guard{halflife.world_lightmap.mutex};
+            if (halflife.world_lightmap.ensure_capacity(device)) {
+                // The new image is tracked from its upload, and the graph is recorded again for its layer count.
+                // Frames in flight keep using the old image and graph, the device destroys them once those are done.
+                lightmap_state_tracked = false;
+                loop_task_graph = record_loop_task_graph();
+            }
+        }
 
         player.camera.resize(static_cast<i32>(size_x), static_cast<i32>(size_y));
         player.camera.set_pos(player.pos);
         player.camera.set_rot(player.rot.x, player.rot.y);
         player.update(delta_time);
+        // Held movement keys produce no events, keep rendering while the camera moves
+        if (player.is_moving())
+            frame_pacer.mark_dirty();
+        if (halflife.update_residency(player.camera.get_vp(), frame_index))
+            vertex_buffers_dirty = true;
+        // Mips are sampled at the resolution rendered to, not the window's. Upgrades go on over the next frames.
+        // Maps dragged with the gizmo move relative to the camera like loaded or evicted ones change what is drawn.
+        auto const maps_changed = vertex_buffers_dirty || is_using_gizmo;
+        if (halflife.update_texture_mips(player.pos, static_cast<f32>(render_size.y) / (2.0f * std::tan(glm::radians(player.camera.fov) * 0.5f)), maps_changed))
+            frame_pacer.mark_dirty();
+
+        if (vertex_buffers_dirty) {
+            vertex_buffers.clear();
+            for (auto &map : halflife.maps) {
+                for (auto &buf : map->bufObjects) {
+                    vertex_buffers.push_back(buf.buffer_id);
+                }
+            }
+            task_vertex_buffer.set_buffers({.buffers = vertex_buffers});
+            vertex_buffers_dirty = false;
+        }
+        // Checked before acquiring, every acquired image has to be presented
+        if (vertex_buffers.empty())
+            return;
 
         swapchain_image = swapchain.acquire_next_image();
         task_swapchain_image.set_images({.images = {&swapchain_image, 1}});
@@ -479,26 +1337,33 @@ struct App : BaseApp<App> {
         auto mat = player.camera.get_vp();
         gpu_input.mvp_mat = daxa::math_operators::mat_from_span<f32, 4, 4>(std::span<f32, 4 * 4>{glm::value_ptr(mat), 4 * 4});
 
-        auto buffer_n = size_t{};
-        for (auto &map : halflife.maps) {
-            buffer_n += map->bufObjects.size();
+        // Frame N signals N on the swapchain's GPU timeline semaphore when it completes. Wait for
+        // the frame that last used this frame's resources before writing into them.
+        auto const cpu_frame = swapchain.get_cpu_timeline_value();
+        if (cpu_frame > frames_in_flight)
+            swapchain.get_gpu_timeline_semaphore().wait_for_value(cpu_frame - frames_in_flight);
+        auto &frame = frame_resources[cpu_frame % frames_in_flight];
+        current_frame = &frame;
+        // At most one draw per vertex buffer
+        ensure_draw_capacity(frame, static_cast<u32>(vertex_buffers.size()));
+        {
+            auto const lock = std::lock_guard{halflife.world_lightmap.mutex};
+            halflife.world_lightmap.styles.update(std::chrono::duration<f64>(Clock::now() - start).count());
         }
-        if (buffer_n == 0)
-            return;
+        *device.get_host_address_as<GpuInput>(frame.gpu_input_buffer) = gpu_input;
+        draw_list = DrawList{
+            .draws = device.get_host_address_as<DrawData>(frame.draw_list_buffer),
+            .draws_address = device.get_device_address(frame.draw_list_buffer),
+            .gpu_input_address = device.get_device_address(frame.gpu_input_buffer),
+            .capacity = frame.draw_capacity,
+            .count = 0,
+        };
 
-        vertex_buffers.resize(buffer_n);
-        auto buffer_i = size_t{};
-        for (auto &map : halflife.maps) {
-            for (auto &buf : map->bufObjects) {
-                vertex_buffers[buffer_i] = buf.buffer_id;
-                ++buffer_i;
-            }
+        {
+            auto const lock = std::lock_guard{gpu_queue_mutex};
+            loop_task_graph.execute({});
         }
-        task_vertex_buffer.set_buffers({.buffers = vertex_buffers});
-
-        loop_task_graph.execute({});
-
-        std::cout << std::flush;
+        ++frame_index;
     }
     void on_mouse_move(f32 x, f32 y) {
         if (!paused) {
@@ -531,6 +1396,9 @@ struct App : BaseApp<App> {
             size_y = swapchain.get_surface_extent().y;
             recreate_render_image(color_image, task_color_image);
             recreate_render_image(depth_image, task_depth_image);
+            recreate_render_image(vis_image, task_vis_image);
+            recreate_output_image(upscaled_image, task_upscaled_image);
+            recreate_output_image(sharpened_image, task_sharpened_image);
             on_update();
         }
     }
@@ -538,7 +1406,15 @@ struct App : BaseApp<App> {
         auto image_info = device.info_image(image_id);
         device.destroy_image(image_id);
         render_size = calc_render_size();
-        image_info.size = {render_size.x, render_size.y, 1},
+        render_image_size = calc_render_image_size();
+        image_info.size = {render_image_size.x, render_image_size.y, 1},
+        image_id = device.create_image(image_info);
+        task_image_id.set_images({.images = {&image_id, 1}});
+    }
+    void recreate_output_image(daxa::ImageId &image_id, daxa::TaskImage &task_image_id) {
+        auto image_info = device.info_image(image_id);
+        device.destroy_image(image_id);
+        image_info.size = {size_x, size_y, 1},
         image_id = device.create_image(image_info);
         task_image_id.set_images({.images = {&image_id, 1}});
     }
@@ -552,35 +1428,195 @@ struct App : BaseApp<App> {
         new_task_graph.use_persistent_image(task_color_image);
         task_depth_image = daxa::TaskImage({.initial_images = {.images = {&depth_image, 1}}, .name = APPNAME_PREFIX("task_depth_image")});
         new_task_graph.use_persistent_image(task_depth_image);
+        task_vis_image = daxa::TaskImage({.initial_images = {.images = {&vis_image, 1}}, .name = APPNAME_PREFIX("task_vis_image")});
+        new_task_graph.use_persistent_image(task_vis_image);
+        task_upscaled_image = daxa::TaskImage({.initial_images = {.images = {&upscaled_image, 1}}, .name = APPNAME_PREFIX("task_upscaled_image")});
+        new_task_graph.use_persistent_image(task_upscaled_image);
+        task_sharpened_image = daxa::TaskImage({.initial_images = {.images = {&sharpened_image, 1}}, .name = APPNAME_PREFIX("task_sharpened_image")});
+        new_task_graph.use_persistent_image(task_sharpened_image);
 
         task_vertex_buffer = daxa::TaskBuffer({.name = APPNAME_PREFIX("task_vertex_buffer")});
         new_task_graph.use_persistent_buffer(task_vertex_buffer);
 
+        // Left in TRANSFER_DST by the initial upload. Re-recording the graph picks up the state from the previous one.
+        if (!lightmap_state_tracked) {
+            auto const lightmap_state = daxa::ImageSliceState{
+                .latest_access = daxa::AccessConsts::TRANSFER_WRITE,
+                .latest_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+                .slice = halflife.world_lightmap.slice(),
+            };
+            task_lightmap_image = daxa::TaskImage({
+                .initial_images = {.images = {&halflife.world_lightmap.image_id, 1}, .latest_slice_states = {&lightmap_state, 1}},
+                .name = APPNAME_PREFIX("task_lightmap_image"),
+            });
+            lightmap_state_tracked = true;
+        }
+        new_task_graph.use_persistent_image(task_lightmap_image);
+
         new_task_graph.add_task({
             .uses = {
-                daxa::TaskBufferUse<daxa::TaskBufferAccess::TRANSFER_WRITE>{task_vertex_buffer},
+                daxa::TaskImageUse<daxa::TaskImageAccess::TRANSFER_WRITE>{task_lightmap_image.view().view(halflife.world_lightmap.slice())},
+            },
+            .task = [this](daxa::TaskInterface runtime) {
+                auto &world_lightmap = halflife.world_lightmap;
+                auto const lock = std::lock_guard{world_lightmap.mutex};
+                if (world_lightmap.upload_queue.empty() && world_lightmap.styles.queue.empty())
+                    return;
+                auto cmd_list = runtime.get_command_list();
+                world_lightmap.record_uploads(
+                    cmd_list,
+                    current_frame->lightmap_staging_buffer,
+                    device.get_host_address_as<u8>(current_frame->lightmap_staging_buffer),
+                    LIGHTMAP_STAGING_SIZE);
             },
+            .name = APPNAME_PREFIX("Upload lightmaps"),
+        });
+
+        // Sampled textures are not tracked by the graph, the uploads make them ready to sample themselves
+        new_task_graph.add_task({
+            .uses = {},
             .task = [this](daxa::TaskInterface runtime) {
+                if (halflife.mip_changes.empty())
+                    return;
                 auto cmd_list = runtime.get_command_list();
-                auto gpu_input_staging_buffer = device.create_buffer({
-                    .size = sizeof(GpuInput),
-                    .allocate_info = daxa::MemoryFlagBits::HOST_ACCESS_RANDOM,
-                    .name = APPNAME_PREFIX("gpu_input_staging_buffer"),
+                halflife.record_mip_uploads(
+                    cmd_list,
+                    current_frame->mip_staging_buffer,
+                    device.get_host_address_as<u8>(current_frame->mip_staging_buffer),
+                    MIP_STAGING_SIZE);
+            },
+            .name = APPNAME_PREFIX("Upload texture mips"),
+        });
+        // Also untracked: restored vertex buffers are made readable by the copies themselves
+        new_task_graph.add_task({
+            .uses = {},
+            .task = [this](daxa::TaskInterface runtime) {
+                auto const size = halflife.restore_bytes();
+                if (size == 0)
+                    return;
+                ensure_restore_capacity(*current_frame, size);
+                auto cmd_list = runtime.get_command_list();
+                halflife.record_restores(
+                    cmd_list,
+                    current_frame->restore_staging_buffer,
+                    device.get_host_address_as<u8>(current_frame->restore_staging_buffer));
+            },
+            .name = APPNAME_PREFIX("Restore evicted maps"),
+        });
+
+        new_task_graph.add_task({
+            .uses = {
+                daxa::TaskBufferUse<daxa::TaskBufferAccess::VERTEX_SHADER_READ>{task_vertex_buffer},
+            },
+            .task = [this](daxa::TaskInterface runtime) {
+                auto cmd_list = runtime.get_command_list();
+                auto const timer_slot = static_cast<u32>(frame_index % GPU_TIMER_SLOTS);
+                cmd_list.reset_timestamps({
+                    .query_pool = gpu_timer_query_pool,
+                    .start_index = timer_slot * 2,
+                    .count = 2,
+                });
+                cmd_list.write_timestamp({
+                    .query_pool = gpu_timer_query_pool,
+                    .pipeline_stage = daxa::PipelineStageFlagBits::TOP_OF_PIPE,
+                    .query_index = timer_slot * 2,
+                });
+            },
+            .name = APPNAME_PREFIX("Begin GPU timer"),
+        });
+        if (use_visibility_buffer) {
+            record_visibility_tasks(new_task_graph);
+        } else {
+            record_forward_tasks(new_task_graph);
+        }
+        new_task_graph.add_task({
+            .uses = {
+                daxa::TaskImageUse<daxa::TaskImageAccess::COMPUTE_SHADER_SAMPLED>{task_color_image},
+                daxa::TaskImageUse<daxa::TaskImageAccess::COMPUTE_SHADER_WRITE_ONLY>{task_upscaled_image},
+            },
+            .task = [this](daxa::TaskInterface runtime) {
+                if (!is_upscaling())
+                    return;
+                auto cmd_list = runtime.get_command_list();
+                cmd_list.set_pipeline(*easu_compute_pipeline);
+                cmd_list.push_constant(UpscalePush{
+                    .src_image = color_image.default_view(),
+                    .src_sampler = upscale_sampler,
+                    .dst_image = upscaled_image.default_view(),
+                    .src_size = render_size,
+                    .dst_size = {size_x, size_y},
+                    .sharpness = 0.0f,
+                });
+                cmd_list.dispatch((size_x + 7) / 8, (size_y + 7) / 8);
+            },
+            .name = APPNAME_PREFIX("Upscale (EASU)"),
+        });
+        new_task_graph.add_task({
+            .uses = {
+                daxa::TaskImageUse<daxa::TaskImageAccess::COMPUTE_SHADER_SAMPLED>{task_upscaled_image},
+                daxa::TaskImageUse<daxa::TaskImageAccess::COMPUTE_SHADER_WRITE_ONLY>{task_sharpened_image},
+            },
+            .task = [this](daxa::TaskInterface runtime) {
+                if (!is_upscaling())
+                    return;
+                auto cmd_list = runtime.get_command_list();
+                cmd_list.set_pipeline(*rcas_compute_pipeline);
+                cmd_list.push_constant(UpscalePush{
+                    .src_image = upscaled_image.default_view(),
+                    .src_sampler = upscale_sampler,
+                    .dst_image = sharpened_image.default_view(),
+                    .src_size = {size_x, size_y},
+                    .dst_size = {size_x, size_y},
+                    .sharpness = std::exp2(-upscaler_sharpness_stops),
                 });
-                cmd_list.destroy_buffer_deferred(gpu_input_staging_buffer);
-                auto gpu_input_buffer_ptr = device.get_host_address_as<GpuInput>(gpu_input_staging_buffer);
-                *gpu_input_buffer_ptr = gpu_input;
-                cmd_list.copy_buffer_to_buffer({
-                    .src_buffer = gpu_input_staging_buffer,
-                    .dst_buffer = gpu_input_buffer,
-                    .size = sizeof(GpuInput),
+                cmd_list.dispatch((size_x + 7) / 8, (size_y + 7) / 8);
+            },
+            .name = APPNAME_PREFIX("Sharpen (RCAS)"),
+        });
+        new_task_graph.add_task({
+            .uses = {
+                daxa::TaskImageUse<daxa::TaskImageAccess::TRANSFER_READ>{task_color_image},
+                daxa::TaskImageUse<daxa::TaskImageAccess::TRANSFER_READ>{task_sharpened_image},
+                daxa::TaskImageUse<daxa::TaskImageAccess::TRANSFER_WRITE>{task_swapchain_image},
+            },
+            .task = [this](daxa::TaskInterface task_runtime) {
+                auto cmd_list = task_runtime.get_command_list();
+                if (is_upscaling()) {
+                    // The upscaled image already matches the swapchain, the blit only converts the format.
+                    cmd_list.blit_image_to_image({
+                        .src_image = sharpened_image,
+                        .src_image_layout = daxa::ImageLayout::TRANSFER_SRC_OPTIMAL,
+                        .dst_image = swapchain_image,
+                        .dst_image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+                        .src_offsets = {{{0, 0, 0}, {static_cast<i32>(size_x), static_cast<i32>(size_y), 1}}},
+                        .dst_offsets = {{{0, 0, 0}, {static_cast<i32>(size_x), static_cast<i32>(size_y), 1}}},
+                        .filter = daxa::Filter::NEAREST,
+                    });
+                } else {
+                    cmd_list.blit_image_to_image({
+                        .src_image = color_image,
+                        .src_image_layout = daxa::ImageLayout::TRANSFER_SRC_OPTIMAL,
+                        .dst_image = swapchain_image,
+                        .dst_image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
+                        .src_offsets = {{{0, 0, 0}, {static_cast<i32>(render_size.x), static_cast<i32>(render_size.y), 1}}},
+                        .dst_offsets = {{{0, 0, 0}, {static_cast<i32>(size_x), static_cast<i32>(size_y), 1}}},
+                        .filter = daxa::Filter::LINEAR,
+                    });
+                }
+                cmd_list.write_timestamp({
+                    .query_pool = gpu_timer_query_pool,
+                    .pipeline_stage = daxa::PipelineStageFlagBits::BOTTOM_OF_PIPE,
+                    .query_index = static_cast<u32>(frame_index % GPU_TIMER_SLOTS) * 2 + 1,
                 });
             },
-            .name = APPNAME_PREFIX("Upload input"),
+            .name = APPNAME_PREFIX("Blit (render to swapchain)"),
         });
+    }
+    void record_forward_tasks(daxa::TaskGraph &new_task_graph) {
         new_task_graph.add_task({
             .uses = {
                 daxa::TaskBufferUse<daxa::TaskBufferAccess::VERTEX_SHADER_READ>{task_vertex_buffer},
+                daxa::TaskImageUse<daxa::TaskImageAccess::FRAGMENT_SHADER_SAMPLED>{task_lightmap_image.view().view(halflife.world_lightmap.slice())},
                 daxa::TaskImageUse<daxa::TaskImageAccess::COLOR_ATTACHMENT>{task_color_image},
                 daxa::TaskImageUse<daxa::TaskImageAccess::DEPTH_ATTACHMENT>{task_depth_image},
             },
@@ -590,7 +1626,7 @@ struct App : BaseApp<App> {
                     .color_attachments = {{
                         .image_view = color_image.default_view(),
                         .load_op = daxa::AttachmentLoadOp::CLEAR,
-                        .clear_value = std::array<f32, 4>{51.0f / 255.0f, 102.0f / 255.0f, 250.0f / 255.0f, 1.0f},
+                        .clear_value = CLEAR_COLOR,
                     }},
                     .depth_attachment = {{
                         .image_view = depth_image.default_view(),
@@ -599,35 +1635,110 @@ struct App : BaseApp<App> {
                     }},
                     .render_area = {.x = 0, .y = 0, .width = render_size.x, .height = render_size.y},
                 });
-                cmd_list.set_pipeline(*draw_raster_pipeline);
-                halflife.render(cmd_list, gpu_input_buffer);
+                cmd_list.set_pipeline(*draw_raster_pipelines[static_cast<usize>(render_mode)]);
+                halflife.render(cmd_list, draw_list, false);
+                if (render_mode == RenderMode::TEXTURED_LIGHTMAP) {
+                    cmd_list.set_pipeline(*alpha_tested_raster_pipeline);
+                    halflife.render(cmd_list, draw_list, true);
+                }
                 cmd_list.end_renderpass();
             },
             .name = APPNAME_PREFIX("Draw to render images"),
         });
+    }
+    void record_visibility_tasks(daxa::TaskGraph &new_task_graph) {
         new_task_graph.add_task({
             .uses = {
-                daxa::TaskImageUse<daxa::TaskImageAccess::TRANSFER_READ>{task_color_image},
-                daxa::TaskImageUse<daxa::TaskImageAccess::TRANSFER_WRITE>{task_swapchain_image},
+                daxa::TaskBufferUse<daxa::TaskBufferAccess::VERTEX_SHADER_READ>{task_vertex_buffer},
+                daxa::TaskImageUse<daxa::TaskImageAccess::FRAGMENT_SHADER_SAMPLED>{task_lightmap_image.view().view(halflife.world_lightmap.slice())},
+                daxa::TaskImageUse<daxa::TaskImageAccess::COLOR_ATTACHMENT>{task_vis_image},
+                daxa::TaskImageUse<daxa::TaskImageAccess::DEPTH_ATTACHMENT>{task_depth_image},
             },
-            .task = [this](daxa::TaskInterface task_runtime) {
-                auto cmd_list = task_runtime.get_command_list();
-                cmd_list.blit_image_to_image({
-                    .src_image = color_image,
-                    .src_image_layout = daxa::ImageLayout::TRANSFER_SRC_OPTIMAL,
-                    .dst_image = swapchain_image,
-                    .dst_image_layout = daxa::ImageLayout::TRANSFER_DST_OPTIMAL,
-                    .src_offsets = {{{0, 0, 0}, {static_cast<i32>(render_size.x), static_cast<i32>(render_size.y), 1}}},
-                    .dst_offsets = {{{0, 0, 0}, {static_cast<i32>(size_x), static_cast<i32>(size_y), 1}}},
-                    .filter = daxa::Filter::LINEAR,
+            .task = [this](daxa::TaskInterface runtime) {
+                auto cmd_list = runtime.get_command_list();
+                cmd_list.begin_renderpass({
+                    .color_attachments = {{
+                        .image_view = vis_image.default_view(),
+                        .load_op = daxa::AttachmentLoadOp::CLEAR,
+                        .clear_value = std::array<u32, 4>{0, 0, 0, 0},
+                    }},
+                    .depth_attachment = {{
+                        .image_view = depth_image.default_view(),
+                        .load_op = daxa::AttachmentLoadOp::CLEAR,
+                        .clear_value = daxa::DepthValue{1.0f, 0},
+                    }},
+                    .render_area = {.x = 0, .y = 0, .width = render_size.x, .height = render_size.y},
                 });
+                cmd_list.set_pipeline(*vis_raster_pipeline);
+                halflife.render(cmd_list, draw_list, false);
+                if (render_mode == RenderMode::TEXTURED_LIGHTMAP) {
+                    cmd_list.set_pipeline(*vis_alpha_tested_raster_pipeline);
+                    halflife.render(cmd_list, draw_list, true);
+                }
+                cmd_list.end_renderpass();
             },
-            .name = APPNAME_PREFIX("Blit (render to swapchain)"),
+            .name = APPNAME_PREFIX("Draw visibility buffer"),
+        });
+        new_task_graph.add_task({
+            .uses = {
+                daxa::TaskBufferUse<daxa::TaskBufferAccess::COMPUTE_SHADER_READ_ONLY>{task_vertex_buffer},
+                daxa::TaskImageUse<daxa::TaskImageAccess::COMPUTE_SHADER_READ_ONLY>{task_vis_image},
+                daxa::TaskImageUse<daxa::TaskImageAccess::COMPUTE_SHADER_SAMPLED>{task_lightmap_image.view().view(halflife.world_lightmap.slice())},
+                daxa::TaskImageUse<daxa::TaskImageAccess::COMPUTE_SHADER_WRITE_ONLY>{task_color_image},
+            },
+            .task = [this](daxa::TaskInterface runtime) {
+                auto cmd_list = runtime.get_command_list();
+                cmd_list.set_pipeline(*vis_resolve_compute_pipelines[static_cast<usize>(render_mode)]);
+                cmd_list.push_constant(VisResolvePush{
+                    .gpu_input = draw_list.gpu_input_address,
+                    .draws = draw_list.draws_address,
+                    .vis_image = vis_image.default_view(),
+                    .dst_image = color_image.default_view(),
+                    .render_size = render_size,
+                    .clear_color = {CLEAR_COLOR[0], CLEAR_COLOR[1], CLEAR_COLOR[2], CLEAR_COLOR[3]},
+                });
+                cmd_list.dispatch((render_size.x + 7) / 8, (render_size.y + 7) / 8);
+            },
+            .name = APPNAME_PREFIX("Resolve visibility buffer"),
         });
     }
 };
 
-int main() {
+// Places the maps of a config from their entities alone, without a device or any geometry, and writes where each
+// one lands (landmark and chapter offset) to <config>-layout.json, in the schema of the offsets file
+void write_layout(std::string const &name) {
+    auto const start = std::chrono::steady_clock::now();
+    auto config = ConfigXML{};
+    config.LoadProgramConfig();
+    auto map_config_file = name + ".xml";
+    config.LoadMapConfig(map_config_file.c_str());
+    auto files = GameFileSystem{};
+    files.build(config.m_szGamePaths);
+    auto assets = AssetRegistry{};
+    auto const maps = scan_maps(config, files, assets);
+
+    auto json = nlohmann::json{};
+    for (auto const &map : maps) {
+        auto const &o = map.offset;
+        auto const &c = map.chapter_offset;
+        json[map.entry.m_szName] = nlohmann::json{o.x + c.x, o.y + c.y, o.z + c.z};
+    }
+    auto const layout_file = data_directory / (name + "-layout.json");
+    auto f = std::ofstream(layout_file);
+    f << std::setw(4) << json;
+    auto const ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Placed " << maps.size() << " maps of " << name << " in " << ms << "ms, written to " << layout_file.string() << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    // --layout [config...] only solves the landmarks, of the default config if none is given
+    if (argc > 1 && std::string_view(argv[1]) == "--layout") {
+        if (argc == 2)
+            write_layout(config_name);
+        for (int i = 2; i < argc; i++)
+            write_layout(argv[i]);
+        return 0;
+    }
     App app = {};
 #if EXPORT_ASSETS
     app.update();
@@ -0,0 +1,56 @@
+#include "map_scan.hpp"
+#include "entities.hpp"
+
+#include "utils/parallel_chunks.hpp"
+
+auto scan_maps(ConfigXML const &config, GameFileSystem const &files, AssetRegistry &assets) -> std::vector<ScannedMap> {
+    auto maps = std::vector<ScannedMap>{};
+    for (auto const &chapter : config.m_vChapterEntries) {
+        if (!chapter.m_bRender)
+            continue;
+        for (auto const &entry : chapter.m_vMapEntries) {
+            if (!entry.m_bRender)
+                continue;
+            auto &map = maps.emplace_back();
+            map.entry = entry;
+            map.filename = "maps/" + entry.m_szName + ".bsp";
+            map.chapter_offset = VERTEX(chapter.m_fOffsetX, chapter.m_fOffsetY, chapter.m_fOffsetZ);
+        }
+    }
+
+    // Several maps per thread, one entity lump alone is too little work for a thread of its own
+    auto entities = std::vector<MapEntities>(maps.size());
+    parallel_chunks(maps.size(), parallel_chunk_count(maps.size(), 4), [&](usize, usize begin, usize end) {
+        for (auto i = begin; i < end; i++) {
+            auto &map = maps[i];
+            auto const file = files.read(map.filename);
+            if (!file) {
+                std::cerr << "Can't open BSP " << map.filename << "." << std::endl;
+                continue;
+            }
+            auto const header = file->read<BSPHEADER>(0);
+            if (header.nVersion != 30) {
+                std::cerr << "BSP version is not 30 (" << map.filename << ")." << std::endl;
+                continue;
+            }
+
+            entities[i] = parse_entities(entity_lump(*file, header), map.entry);
+
+            // Model 0 is the world, its bounds hold every other model
+            BSPMODEL world{};
+            if (static_cast<usize>(header.lump[LUMP_MODELS].nLength) >= sizeof(world))
+                world = file->read<BSPMODEL>(static_cast<usize>(std::max(header.lump[LUMP_MODELS].nOffset, 0)));
+            model_bounds(world, map.mins, map.maxs);
+            map.found = true;
+        }
+    });
+
+    for (usize i = 0; i < maps.size(); i++) {
+        if (maps[i].found)
+            register_entities(std::move(entities[i]), maps[i].entry.m_szName, assets);
+    }
+    // In config order, like the maps that are all loaded up front are placed
+    for (auto &map : maps)
+        map.offset = place_map(assets, map.entry.m_szName, map.parent_mapId);
+    return maps;
+}
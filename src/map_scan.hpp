@@ -0,0 +1,21 @@
+#pragma once
+
+#include "bsp.hpp"
+#include "ConfigXML.hpp"
+
+// A map of the config as seen by its header, entities and world model, without loading its geometry
+struct ScannedMap {
+    MapEntry entry;
+    std::string filename;
+    VERTEX chapter_offset;
+    // Landmark placement, and the world model bounds in the renderer's handedness
+    VERTEX offset;
+    std::string parent_mapId;
+    f32vec3 mins = {}, maxs = {};
+    bool found = false;
+};
+
+// Reads the maps of the config with `render="1"`, registers their entities and places them.
+// - Only the header, entity lump and world model of each map are read, the maps in parallel.
+// - Entities are registered and maps placed in config order, so the placement is the same as loading every map.
+auto scan_maps(ConfigXML const &config, GameFileSystem const &files, AssetRegistry &assets) -> std::vector<ScannedMap>;
@@ -0,0 +1,178 @@
+#include "map_streamer.hpp"
+#include "map_scan.hpp"
+
+#include <limits>
+#include <utility>
+
+MapStreamer::~MapStreamer() {
+    stop();
+}
+
+void MapStreamer::scan(ConfigXML const &config, GameFileSystem const &files, AssetRegistry &assets) {
+    for (auto &scanned : scan_maps(config, files, assets)) {
+        auto &map = maps.emplace_back();
+        map.entry = std::move(scanned.entry);
+        map.filename = std::move(scanned.filename);
+        map.chapter_offset = scanned.chapter_offset;
+        map.offset = scanned.offset;
+        map.parent_mapId = std::move(scanned.parent_mapId);
+        map.mins = scanned.mins;
+        map.maxs = scanned.maxs;
+        map.found = scanned.found;
+        slot_of[map.entry.m_szName] = static_cast<u32>(maps.size() - 1);
+    }
+
+    {
+        auto const lock = std::lock_guard{assets.entity_mutex};
+        for (auto const &[name, positions] : assets.landmarks) {
+            for (auto const &a : positions) {
+                for (auto const &b : positions) {
+                    if (a.second == b.second || !slot_of.contains(a.second) || !slot_of.contains(b.second))
+                        continue;
+                    auto &neighbours = maps[slot_of[a.second]].neighbours;
+                    auto const b_slot = slot_of[b.second];
+                    if (std::find(neighbours.begin(), neighbours.end(), b_slot) == neighbours.end())
+                        neighbours.push_back(b_slot);
+                }
+            }
+        }
+    }
+    std::cout << maps.size() << " maps scanned for streaming." << std::endl;
+}
+
+void MapStreamer::start(daxa::Device &device, GameFileSystem const &files, AssetRegistry &assets, WorldLightmap &world_lightmap) {
+    worker = std::thread([this, &device, &files, &assets, &world_lightmap]() {
+        // Reused from one map to the next, like the loads at startup
+        auto scratch = LoadScratch{};
+        while (true) {
+            u32 slot = 0;
+            {
+                auto lock = std::unique_lock{mutex};
+                cv.wait(lock, [this]() { return stopping || !requests.empty(); });
+                if (stopping)
+                    return;
+                slot = requests.front();
+                requests.erase(requests.begin());
+            }
+            // Only the main thread writes the slot, and not these parts of it after the scan
+            auto const &map = maps[slot];
+            auto *const bsp = new BSP(device, files, map.filename, map.entry, assets, world_lightmap, scratch);
+            bsp->SetChapterOffset(map.chapter_offset.x, map.chapter_offset.y, map.chapter_offset.z);
+            bsp->release_cpu_geometry(cpu_geometry);
+            auto const lock = std::lock_guard{mutex};
+            finished.emplace_back(slot, bsp);
+        }
+    });
+}
+
+void MapStreamer::stop() {
+    if (!worker.joinable())
+        return;
+    {
+        auto const lock = std::lock_guard{mutex};
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+void MapStreamer::sync_offsets() {
+    for (auto &map : maps) {
+        if (map.bsp == nullptr)
+            continue;
+        map.user_offset = map.bsp->user_offset;
+        map.parent_mapId = map.bsp->parent_mapId;
+    }
+    // From the parents' values of the previous frame, a chain of n maps settles in n frames
+    auto propagated = std::vector<f32vec3>(maps.size());
+    for (usize i = 0; i < maps.size(); i++) {
+        auto const parent = find(maps[i].parent_mapId);
+        propagated[i] = maps[i].user_offset;
+        if (parent && *parent != i)
+            propagated[i] = propagated[i] + maps[*parent].propagated_user_offset;
+    }
+    for (usize i = 0; i < maps.size(); i++) {
+        maps[i].propagated_user_offset = propagated[i];
+        if (maps[i].bsp != nullptr)
+            maps[i].bsp->propagated_user_offset = propagated[i];
+    }
+}
+
+auto MapStreamer::plan(f32vec3 camera_pos) -> Plan {
+    auto const unreachable = std::numeric_limits<f32>::infinity();
+    auto wanted = std::vector<u32>{};
+    for (u32 i = 0; i < maps.size(); i++) {
+        auto &map = maps[i];
+        map.distance = unreachable;
+        if (!map.found || !map.enabled)
+            continue;
+        // Vertices are drawn at their position plus the offset, which is where the camera position is too
+        auto const offset = f32vec3{map.offset.x + map.chapter_offset.x, map.offset.y + map.chapter_offset.y, map.offset.z + map.chapter_offset.z} + map.propagated_user_offset;
+        map.distance = distance_to_bounds(camera_pos, map.mins + offset, map.maxs + offset);
+        auto const keep_radius = map.state == StreamedMap::State::UNLOADED ? radius : radius * 1.25f;
+        if (map.distance <= keep_radius)
+            wanted.push_back(i);
+    }
+    auto const by_distance = [this](u32 a, u32 b) { return maps[a].distance < maps[b].distance; };
+    std::sort(wanted.begin(), wanted.end(), by_distance);
+
+    auto prefetch = std::vector<u32>{};
+    for (auto i : wanted) {
+        for (auto neighbour : maps[i].neighbours) {
+            if (maps[neighbour].distance <= radius * 2.0f && std::find(wanted.begin(), wanted.end(), neighbour) == wanted.end() &&
+                std::find(prefetch.begin(), prefetch.end(), neighbour) == prefetch.end())
+                prefetch.push_back(neighbour);
+        }
+    }
+    std::sort(prefetch.begin(), prefetch.end(), by_distance);
+    wanted.insert(wanted.end(), prefetch.begin(), prefetch.end());
+    if (wanted.size() > max_maps)
+        wanted.resize(max_maps);
+
+    auto result = Plan{};
+    bool in_flight = false;
+    for (u32 i = 0; i < maps.size(); i++) {
+        in_flight |= maps[i].state == StreamedMap::State::LOADING;
+        if (maps[i].state == StreamedMap::State::RESIDENT && std::find(wanted.begin(), wanted.end(), i) == wanted.end())
+            result.unload.push_back(i);
+    }
+    // One at a time, so that the next one is picked from where the camera is by then
+    if (!in_flight) {
+        for (auto i : wanted) {
+            if (maps[i].state == StreamedMap::State::UNLOADED) {
+                result.load = i;
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+void MapStreamer::request(u32 slot) {
+    maps[slot].state = StreamedMap::State::LOADING;
+    {
+        auto const lock = std::lock_guard{mutex};
+        requests.push_back(slot);
+    }
+    cv.notify_one();
+}
+
+auto MapStreamer::take_finished() -> std::vector<std::pair<u32, BSP *>> {
+    auto const lock = std::lock_guard{mutex};
+    return std::exchange(finished, {});
+}
+
+auto MapStreamer::find(std::string const &mapId) const -> std::optional<u32> {
+    auto const it = slot_of.find(mapId);
+    if (it == slot_of.end())
+        return std::nullopt;
+    return it->second;
+}
+
+auto MapStreamer::resident_count() const -> u32 {
+    return static_cast<u32>(std::count_if(maps.begin(), maps.end(), [](auto const &map) { return map.state == StreamedMap::State::RESIDENT; }));
+}
+
+auto MapStreamer::loading() const -> bool {
+    return std::any_of(maps.begin(), maps.end(), [](auto const &map) { return map.state == StreamedMap::State::LOADING; });
+}
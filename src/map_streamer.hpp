@@ -0,0 +1,87 @@
+#pragma once
+
+#include "bsp.hpp"
+#include "ConfigXML.hpp"
+
+#include <condition_variable>
+#include <optional>
+#include <thread>
+
+// A map of the config that may be streamed in. Its placement and bounds come from a scan of the
+// header, entities and world model at startup, so it can be placed without loading its geometry.
+struct StreamedMap {
+    MapEntry entry;
+    std::string filename;
+    VERTEX chapter_offset;
+    // Landmark placement, and the world model bounds in the renderer's handedness
+    VERTEX offset;
+    std::string parent_mapId;
+    f32vec3 mins = {}, maxs = {};
+    bool found = false;
+    // Maps it shares a changelevel landmark with, prefetched before the camera gets to them
+    std::vector<u32> neighbours;
+
+    enum struct State : u8 {
+        UNLOADED,
+        LOADING,
+        RESIDENT,
+    };
+    State state = State::UNLOADED;
+    BSP *bsp = nullptr;
+    // Kept while the map is not loaded, so that it comes back where it was moved to
+    f32vec3 user_offset = {};
+    f32vec3 propagated_user_offset = {};
+    // From the camera to the bounds, as of the last plan()
+    f32 distance = 0;
+    // Cleared when the map is unloaded by hand, it is not streamed in again then
+    bool enabled = true;
+};
+
+// Loads the maps near the camera on a background thread and unloads the ones it moved away from.
+// - Maps within `radius` of the camera are loaded, nearest first. Resident maps stay until the camera is
+//   a quarter further away, so that walking along a border does not load and unload the same map.
+// - Changelevel neighbours of those within twice the radius are prefetched after them.
+// - At most `max_maps` are resident at once, the farthest ones give way.
+// Placing a map needs the landmarks of the maps before it, so every map's entities are scanned up front.
+struct MapStreamer {
+    std::vector<StreamedMap> maps;
+    f32 radius = 4096.0f;
+    u32 max_maps = 16;
+    // Applied on the loader thread, so that spilling does not stall the frame
+    CpuGeometry cpu_geometry = CpuGeometry::KEEP;
+
+    MapStreamer() = default;
+    MapStreamer(MapStreamer const &) = delete;
+    auto operator=(MapStreamer const &) -> MapStreamer & = delete;
+    ~MapStreamer();
+
+    // Reads the maps of the config with `render="1"` and places them
+    void scan(ConfigXML const &config, GameFileSystem const &files, AssetRegistry &assets);
+    void start(daxa::Device &device, GameFileSystem const &files, AssetRegistry &assets, WorldLightmap &world_lightmap);
+    // Waits for the map being loaded, if any. Maps loaded but not taken are left for take_finished().
+    void stop();
+
+    // Pulls user offsets and parents from the resident maps, and propagates offsets down the parent chain by one level
+    void sync_offsets();
+    struct Plan {
+        std::vector<u32> unload;
+        std::optional<u32> load;
+    };
+    auto plan(f32vec3 camera_pos) -> Plan;
+    // The slot is LOADING until take_finished() returns it
+    void request(u32 slot);
+    auto take_finished() -> std::vector<std::pair<u32, BSP *>>;
+    auto find(std::string const &mapId) const -> std::optional<u32>;
+
+    auto resident_count() const -> u32;
+    auto loading() const -> bool;
+
+  private:
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<u32> requests;
+    std::vector<std::pair<u32, BSP *>> finished;
+    bool stopping = false;
+    std::map<std::string, u32> slot_of;
+};
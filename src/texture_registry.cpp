@@ -0,0 +1,497 @@
+#include "texture_registry.hpp"
+
+// For XXH3_state_t, so that the hash state can live on the stack
+#define XXH_STATIC_LINKING_ONLY
+#include <xxhash.h>
+
+#include <utility>
+
+auto make_texture_name(std::string_view name) -> TextureName {
+    auto result = TextureName{};
+    auto const n = std::min(name.size(), TEXTURE_NAME_SIZE);
+    for (usize i = 0; i < n && name[i] != '\0'; i++)
+        result[i] = name[i];
+    return result;
+}
+
+static auto hash_texture_name(TextureName const &name) -> u64 {
+    u64 lo = 0, hi = 0;
+    std::memcpy(&lo, name.data(), 8);
+    std::memcpy(&hi, name.data() + 8, 8);
+    auto h = lo * 0x9E3779B97F4A7C15ull ^ hi;
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ull;
+    h ^= h >> 32;
+    return h;
+}
+
+auto hash_miptex(MiptexPixels const &pixels) -> TextureContent {
+    XXH3_state_t state;
+    XXH3_64bits_reset(&state);
+    u32 const size[2] = {pixels.w, pixels.h};
+    XXH3_64bits_update(&state, size, sizeof(size));
+    XXH3_64bits_update(&state, pixels.indices[0], static_cast<usize>(pixels.w) * pixels.h);
+    XXH3_64bits_update(&state, pixels.palette, 256 * 3);
+    auto const result = XXH3_64bits_digest(&state);
+    return result != NO_TEXTURE_CONTENT ? result : 1;
+}
+
+// Size of the uploaded image with mips [top_mip, MIPTEX_MIP_N)
+static auto texture_bytes(BSP_TEXTURE const &texture, u32 top_mip = 0) -> u64 {
+    u64 result = 0;
+    for (u32 mip = top_mip; mip < MIPTEX_MIP_N; mip++)
+        result += static_cast<u64>(miptex_mip_size(static_cast<u32>(texture.w), mip)) * miptex_mip_size(static_cast<u32>(texture.h), mip) * 4;
+    return result;
+}
+
+static auto texture_flags(std::string_view name) -> u8 {
+    u8 result = 0;
+    if (name == "aaatrigger" || name == "origin" || name == "clip" || name == "sky")
+        result |= TEXTURE_FLAG_TOOL;
+    if (!name.empty() && name[0] == '{')
+        result |= TEXTURE_FLAG_MASKED;
+    return result;
+}
+
+auto TextureRegistry::shard_of(TextureName const &key) const -> u32 {
+    // The top bits pick the shard, the bottom ones the slot within it
+    return static_cast<u32>(hash_texture_name(key) >> 60) % SHARD_N;
+}
+
+auto TextureRegistry::find_slot(Shard const &shard, TextureName const &key) const -> usize {
+    auto const mask = shard.slots.size() - 1;
+    for (auto slot = static_cast<usize>(hash_texture_name(key)) & mask;; slot = (slot + 1) & mask) {
+        auto const handle = shard.slots[slot];
+        if (handle == INVALID_TEXTURE_HANDLE || entry(handle).name == key)
+            return slot;
+    }
+}
+
+void TextureRegistry::grow(Shard &shard) {
+    auto const old_slots = std::move(shard.slots);
+    shard.slots.assign(std::max<usize>(16, old_slots.size() * 2), INVALID_TEXTURE_HANDLE);
+    for (auto handle : old_slots) {
+        if (handle != INVALID_TEXTURE_HANDLE)
+            shard.slots[find_slot(shard, entry(handle).name)] = handle;
+    }
+}
+
+auto TextureRegistry::new_entry(TextureName const &key) -> TextureHandle {
+    auto const lock = std::lock_guard{segment_mutex};
+    auto const handle = entry_n.load(std::memory_order_relaxed);
+    auto const segment_i = handle / SEGMENT_SIZE;
+    if (segment_i >= MAX_SEGMENT_N) {
+        std::cerr << "Too many textures." << std::endl;
+        std::abort();
+    }
+    if (!segment_storage[segment_i]) {
+        segment_storage[segment_i] = std::make_unique<Entry[]>(SEGMENT_SIZE);
+        segments[segment_i].store(segment_storage[segment_i].get(), std::memory_order_release);
+    }
+    auto &e = segment_storage[segment_i][handle % SEGMENT_SIZE];
+    e.name = key;
+    e.flags = texture_flags({key.data(), static_cast<usize>(std::find(key.begin(), key.end(), '\0') - key.begin())});
+    e.texture = {};
+    e.content = NO_TEXTURE_CONTENT;
+    e.state.store(State::EMPTY, std::memory_order_relaxed);
+    e.ref_count = 0;
+    entry_n.store(handle + 1, std::memory_order_release);
+    return handle;
+}
+
+auto TextureRegistry::acquire(std::string_view name) -> std::pair<TextureHandle, bool> {
+    auto const key = make_texture_name(name);
+    auto &shard = shards[shard_of(key)];
+    auto const lock = std::lock_guard{shard.mutex};
+    // At most half full, so probes stay short
+    if ((shard.count + 1) * 2 > shard.slots.size())
+        grow(shard);
+    auto const slot = find_slot(shard, key);
+    if (shard.slots[slot] == INVALID_TEXTURE_HANDLE) {
+        shard.slots[slot] = new_entry(key);
+        ++shard.count;
+    }
+    auto const handle = shard.slots[slot];
+    auto &e = entry(handle);
+    ++e.ref_count;
+    if (e.state.load(std::memory_order_relaxed) == State::EMPTY) {
+        e.state.store(State::LOADING, std::memory_order_relaxed);
+        return {handle, true};
+    }
+    return {handle, false};
+}
+
+auto TextureRegistry::acquire_variant(std::string_view name) -> TextureHandle {
+    auto const key = make_texture_name(name);
+    auto const lock = std::lock_guard{shards[shard_of(key)].mutex};
+    auto const handle = new_entry(key);
+    auto &e = entry(handle);
+    e.ref_count = 1;
+    e.state.store(State::LOADING, std::memory_order_relaxed);
+    return handle;
+}
+
+void TextureRegistry::publish(TextureHandle handle, BSP_TEXTURE const &texture) {
+    auto &e = entry(handle);
+    e.texture = texture;
+    e.state.store(State::READY, std::memory_order_release);
+    e.state.notify_all();
+}
+
+void TextureRegistry::publish_locked(Entry &e, BSP_TEXTURE const &texture, TextureContent content) {
+    e.texture = texture;
+    e.content = content;
+    e.state.store(State::READY, std::memory_order_release);
+    e.state.notify_all();
+}
+
+auto TextureRegistry::wait_ready(TextureHandle handle) const -> BSP_TEXTURE const & {
+    auto &e = entry(handle);
+    for (auto state = e.state.load(std::memory_order_acquire); state != State::READY; state = e.state.load(std::memory_order_acquire))
+        e.state.wait(state, std::memory_order_acquire);
+    return e.texture;
+}
+
+auto TextureRegistry::release(TextureHandle handle) -> std::optional<BSP_TEXTURE> {
+    auto &e = entry(handle);
+    auto &shard = shards[shard_of(e.name)];
+    auto const lock = std::lock_guard{shard.mutex};
+    if (--e.ref_count != 0)
+        return std::nullopt;
+    auto const result = e.texture;
+    auto const content = e.content;
+    if (content == NO_TEXTURE_CONTENT) {
+        e.texture = {};
+        e.state.store(State::EMPTY, std::memory_order_release);
+        return result;
+    }
+
+    auto const content_lock = std::lock_guard{content_mutex};
+    e.texture = {};
+    e.content = NO_TEXTURE_CONTENT;
+    e.state.store(State::EMPTY, std::memory_order_release);
+    auto const it = contents.find(content);
+    if (--it->second.ref_count != 0) {
+        // Every reference but the last is an alias
+        --stats.alias_n;
+        stats.saved_bytes -= texture_bytes(it->second.texture);
+        return std::nullopt;
+    }
+    auto const &c = it->second;
+    --stats.image_n;
+    stats.image_bytes -= texture_bytes(c.texture);
+    if (c.texture.image_id.is_empty())
+        --stats.evicted_n;
+    else
+        stats.resident_bytes -= texture_bytes(c.texture, c.top_mip);
+    auto const image = c.texture;
+    contents.erase(it);
+    return image;
+}
+
+auto TextureRegistry::publish_content(TextureHandle handle, TextureContent content) -> bool {
+    auto const lock = std::lock_guard{content_mutex};
+    auto const it = contents.find(content);
+    if (it == contents.end())
+        return false;
+    ++it->second.ref_count;
+    ++stats.alias_n;
+    stats.saved_bytes += texture_bytes(it->second.texture);
+    publish_locked(entry(handle), it->second.texture, content);
+    return true;
+}
+
+auto TextureRegistry::add_content(TextureHandle handle, TextureContent content, BSP_TEXTURE const &texture, MiptexPixels const &pixels) -> BSP_TEXTURE {
+    auto const lock = std::lock_guard{content_mutex};
+    auto const [it, inserted] = contents.try_emplace(content, Content{.texture = texture, .ref_count = 0, .active_n = 0, .inactive_since = 0, .top_mip = upload_mip(), .pixels = {}});
+    auto &c = it->second;
+    ++c.ref_count;
+    if (inserted) {
+        ++stats.image_n;
+        stats.image_bytes += texture_bytes(texture);
+        stats.resident_bytes += texture_bytes(texture, c.top_mip);
+        publish_locked(entry(handle), c.texture, content);
+        if (!keep_pixels)
+            return c.texture;
+        c.pixels.resize(miptex_index_n(pixels.w, pixels.h) + 256 * 3);
+        auto *dst = c.pixels.data();
+        for (u32 mip = 0; mip < MIPTEX_MIP_N; mip++)
+            dst = std::copy_n(pixels.indices[mip], static_cast<usize>(miptex_mip_size(pixels.w, mip)) * miptex_mip_size(pixels.h, mip), dst);
+        std::copy_n(pixels.palette, 256 * 3, dst);
+        return c.texture;
+    }
+    ++stats.alias_n;
+    stats.saved_bytes += texture_bytes(texture);
+    // An evicted image is replaced by the one just uploaded instead
+    if (c.texture.image_id.is_empty()) {
+        c.texture.image_id = texture.image_id;
+        --stats.evicted_n;
+        stats.resident_bytes += texture_bytes(c.texture, c.top_mip);
+        set_content_image(content, texture.image_id);
+    }
+    publish_locked(entry(handle), c.texture, content);
+    return c.texture;
+}
+
+auto TextureRegistry::images() const -> std::vector<daxa::ImageId> {
+    auto const lock = std::lock_guard{content_mutex};
+    auto result = std::vector<daxa::ImageId>{};
+    result.reserve(contents.size());
+    for (auto const &[content, c] : contents) {
+        if (!c.texture.image_id.is_empty())
+            result.push_back(c.texture.image_id);
+    }
+    return result;
+}
+
+auto TextureRegistry::activate(TextureHandle handle) -> bool {
+    auto const content = entry(handle).content;
+    if (content == NO_TEXTURE_CONTENT)
+        return false;
+    auto const lock = std::lock_guard{content_mutex};
+    auto &c = contents.at(content);
+    ++c.active_n;
+    return c.texture.image_id.is_empty();
+}
+
+void TextureRegistry::deactivate(TextureHandle handle, u64 frame) {
+    auto const content = entry(handle).content;
+    if (content == NO_TEXTURE_CONTENT)
+        return;
+    auto const lock = std::lock_guard{content_mutex};
+    auto &c = contents.at(content);
+    if (--c.active_n == 0)
+        c.inactive_since = frame;
+}
+
+auto TextureRegistry::evict_inactive() -> std::optional<daxa::ImageId> {
+    auto const lock = std::lock_guard{content_mutex};
+    auto oldest = contents.end();
+    for (auto it = contents.begin(); it != contents.end(); ++it) {
+        auto const &c = it->second;
+        if (c.active_n == 0 && !c.texture.image_id.is_empty() && !c.pixels.empty() && (oldest == contents.end() || c.inactive_since < oldest->second.inactive_since))
+            oldest = it;
+    }
+    if (oldest == contents.end())
+        return std::nullopt;
+    auto &c = oldest->second;
+    auto const image_id = c.texture.image_id;
+    c.texture.image_id = {};
+    ++stats.evicted_n;
+    stats.resident_bytes -= texture_bytes(c.texture, c.top_mip);
+    // It comes back like a fresh upload
+    c.top_mip = MIPTEX_UPLOAD_MIP;
+    set_content_image(oldest->first, {});
+    return image_id;
+}
+
+auto TextureRegistry::source(TextureContent content) const -> MiptexPixels {
+    auto const lock = std::lock_guard{content_mutex};
+    auto const &c = contents.at(content);
+    auto const w = static_cast<u32>(c.texture.w), h = static_cast<u32>(c.texture.h);
+    auto result = MiptexPixels{.indices = {}, .palette = c.pixels.data() + miptex_index_n(w, h), .w = w, .h = h};
+    auto const *indices = c.pixels.data();
+    for (u32 mip = 0; mip < MIPTEX_MIP_N; mip++) {
+        result.indices[mip] = indices;
+        indices += static_cast<usize>(miptex_mip_size(w, mip)) * miptex_mip_size(h, mip);
+    }
+    return result;
+}
+
+auto TextureRegistry::restore(TextureContent content, daxa::ImageId image_id) -> bool {
+    auto const lock = std::lock_guard{content_mutex};
+    auto &c = contents.at(content);
+    // A loader may have uploaded the same pixels in the meantime
+    if (!c.texture.image_id.is_empty())
+        return false;
+    c.texture.image_id = image_id;
+    --stats.evicted_n;
+    stats.resident_bytes += texture_bytes(c.texture, c.top_mip);
+    set_content_image(content, image_id);
+    return true;
+}
+
+auto TextureRegistry::is_evicted(TextureContent content) const -> bool {
+    auto const lock = std::lock_guard{content_mutex};
+    auto const it = contents.find(content);
+    return it != contents.end() && it->second.texture.image_id.is_empty();
+}
+
+void TextureRegistry::plan_mips(std::span<MipChange const> wanted, u32 max_n, std::vector<MipChange> &changes) const {
+    auto const lock = std::lock_guard{content_mutex};
+    changes.clear();
+    for (auto const &want : wanted) {
+        auto const it = contents.find(want.content);
+        if (it == contents.end() || it->second.texture.image_id.is_empty() || it->second.pixels.empty())
+            continue;
+        // Dropping a single mip saves little, and would go back and forth at the distance it switches at
+        if (want.top_mip < it->second.top_mip || want.top_mip >= it->second.top_mip + 2)
+            changes.push_back(want);
+    }
+    auto const resident_mip = [&](MipChange const &change) {
+        return contents.at(change.content).top_mip;
+    };
+    auto const raise_end = std::partition(changes.begin(), changes.end(), [&](MipChange const &change) {
+        return change.top_mip < resident_mip(change);
+    });
+    // The blurriest first
+    std::sort(changes.begin(), raise_end, [&](MipChange const &a, MipChange const &b) {
+        return resident_mip(a) - a.top_mip > resident_mip(b) - b.top_mip;
+    });
+    if (changes.size() > max_n)
+        changes.resize(max_n);
+}
+
+auto TextureRegistry::replace_mips(TextureContent content, u32 top_mip, daxa::ImageId image_id) -> daxa::ImageId {
+    auto const lock = std::lock_guard{content_mutex};
+    auto &c = contents.at(content);
+    if (c.texture.image_id.is_empty())
+        return image_id;
+    stats.resident_bytes -= texture_bytes(c.texture, c.top_mip);
+    c.top_mip = top_mip;
+    stats.resident_bytes += texture_bytes(c.texture, c.top_mip);
+    auto const replaced = std::exchange(c.texture.image_id, image_id);
+    set_content_image(content, image_id);
+    return replaced;
+}
+
+void TextureRegistry::set_content_image(TextureContent content, daxa::ImageId image_id) {
+    // Names of evicted images are only drawn by maps that are not resident, so nobody reads these meanwhile
+    auto const n = entry_n.load(std::memory_order_acquire);
+    for (TextureHandle handle = 0; handle < n; handle++) {
+        auto &e = entry(handle);
+        if (e.content == content)
+            e.texture.image_id = image_id;
+    }
+}
+
+auto TextureRegistry::content_stats() const -> ContentStats {
+    auto const lock = std::lock_guard{content_mutex};
+    auto result = stats;
+    result.top_mip_n = {};
+    for (auto const &[content, c] : contents) {
+        if (!c.texture.image_id.is_empty())
+            ++result.top_mip_n[c.top_mip];
+    }
+    return result;
+}
+
+auto TextureRegistry::find(std::string_view name) const -> TextureHandle {
+    auto const key = make_texture_name(name);
+    auto &shard = shards[shard_of(key)];
+    auto const lock = std::lock_guard{shard.mutex};
+    if (shard.slots.empty())
+        return INVALID_TEXTURE_HANDLE;
+    return shard.slots[find_slot(shard, key)];
+}
+
+auto TextureRegistry::name(TextureHandle handle) const -> std::string_view {
+    auto const &n = entry(handle).name;
+    return {n.data(), static_cast<usize>(std::find(n.begin(), n.end(), '\0') - n.begin())};
+}
+
+auto miptex_rgba_size(MiptexPixels const &pixels, u32 top_mip) -> usize {
+    usize pixel_n = 0;
+    for (u32 mip = top_mip; mip < MIPTEX_MIP_N; mip++)
+        pixel_n += static_cast<usize>(miptex_mip_size(pixels.w, mip)) * miptex_mip_size(pixels.h, mip);
+    return pixel_n * 4;
+}
+
+// Decodes mips [top_mip, MIPTEX_MIP_N) to RGBA, packed one after the other
+static void decode_miptex(MiptexPixels const &pixels, u32 top_mip, u8 *dst) {
+    for (u32 mip = top_mip; mip < MIPTEX_MIP_N; mip++) {
+        auto const mip_pixel_n = static_cast<usize>(miptex_mip_size(pixels.w, mip)) * miptex_mip_size(pixels.h, mip);
+        for (usize p = 0; p < mip_pixel_n; p++, dst += 4) {
+            auto const *const color = pixels.palette + pixels.indices[mip][p] * 3;
+            // Blue is the cutout color of '{' textures, it becomes fully transparent black
+            if (color[0] == 0 && color[1] == 0 && color[2] == 255) {
+                dst[0] = dst[1] = dst[2] = dst[3] = 0;
+            } else {
+                dst[0] = color[0];
+                dst[1] = color[1];
+                dst[2] = color[2];
+                dst[3] = 255;
+            }
+        }
+    }
+}
+
+// An image for mips [top_mip, MIPTEX_MIP_N), of the size of `top_mip`. Its contents are undefined.
+static auto create_miptex_image(daxa::Device &device, MiptexPixels const &pixels, u32 top_mip) -> BSP_TEXTURE {
+    // The size stays that of mip 0, which the texture coordinates are computed from
+    BSP_TEXTURE n{};
+    n.w = static_cast<int>(pixels.w);
+    n.h = static_cast<int>(pixels.h);
+    n.image_id = device.create_image({
+        .format = daxa::Format::R8G8B8A8_SRGB,
+        .size = {miptex_mip_size(pixels.w, top_mip), miptex_mip_size(pixels.h, top_mip), 1},
+        .mip_level_count = MIPTEX_MIP_N - top_mip,
+        .usage = daxa::ImageUsageFlagBits::SHADER_SAMPLED | daxa::ImageUsageFlagBits::TRANSFER_DST,
+        .name = "image",
+    });
+    return n;
+}
+
+// Decodes mips [top_mip, MIPTEX_MIP_N) to RGBA and uploads them into a new image of the size of `top_mip`
+static auto upload_miptex(daxa::Device &device, std::string const &name, MiptexPixels const &pixels, u32 top_mip, ScratchBuffer &rgba) -> BSP_TEXTURE {
+    u8 *const dst = rgba.get(miptex_rgba_size(pixels, top_mip));
+    decode_miptex(pixels, top_mip, dst);
+    auto n = create_miptex_image(device, pixels, top_mip);
+    if (pixels.w > 0 && pixels.h > 0)
+        n.load_levels(device, name, dst, top_mip);
+    return n;
+}
+
+void load_miptex(daxa::Device &device, TextureRegistry &textures, TextureHandle handle, MiptexPixels const &pixels, ScratchBuffer &rgba) {
+    auto const content = hash_miptex(pixels);
+    if (textures.publish_content(handle, content))
+        return;
+
+    auto const n = upload_miptex(device, std::string(textures.name(handle)), pixels, textures.upload_mip(), rgba);
+    auto const result = textures.add_content(handle, content, n, pixels);
+    if (result.image_id != n.image_id)
+        device.destroy_image(n.image_id);
+}
+
+auto record_texture_restore(daxa::Device &device, TextureRegistry &textures, TextureContent content, daxa::CommandList &cmd_list, daxa::BufferId staging_buffer,
+                            u8 *staging, usize staging_offset) -> usize {
+    auto const pixels = textures.source(content);
+    auto const size = miptex_rgba_size(pixels, MIPTEX_UPLOAD_MIP);
+    auto const texture = create_miptex_image(device, pixels, MIPTEX_UPLOAD_MIP);
+    // A loader may have uploaded the same pixels in the meantime. Nothing used the new image yet, so it goes right away.
+    // Otherwise its names draw it from this frame on, after the copies recorded here.
+    if (!textures.restore(content, texture.image_id)) {
+        device.destroy_image(texture.image_id);
+        return size;
+    }
+    decode_miptex(pixels, MIPTEX_UPLOAD_MIP, staging + staging_offset);
+    if (pixels.w > 0 && pixels.h > 0)
+        texture.record_levels(cmd_list, staging_buffer, staging_offset, MIPTEX_UPLOAD_MIP);
+    return size;
+}
+
+auto record_mip_streaming(daxa::Device &device, TextureRegistry &textures, std::span<TextureRegistry::MipChange const> changes, daxa::CommandList &cmd_list,
+                          daxa::BufferId staging_buffer, u8 *staging, usize staging_size, ScratchBuffer &rgba) -> usize {
+    usize staging_offset = 0;
+    usize change_n = 0;
+    for (; change_n < changes.size(); ++change_n) {
+        auto const &change = changes[change_n];
+        auto const pixels = textures.source(change.content);
+        auto const size = miptex_rgba_size(pixels, change.top_mip);
+        auto texture = BSP_TEXTURE{};
+        if (size > staging_size) {
+            // Never fits, it is uploaded on its own
+            texture = upload_miptex(device, "", pixels, change.top_mip, rgba);
+        } else {
+            if (staging_offset + size > staging_size)
+                break;
+            decode_miptex(pixels, change.top_mip, staging + staging_offset);
+            texture = create_miptex_image(device, pixels, change.top_mip);
+            texture.record_levels(cmd_list, staging_buffer, staging_offset, change.top_mip);
+            staging_offset += size;
+        }
+        // Frames in flight may still sample the image replaced, the device defers destroying it
+        device.destroy_image(textures.replace_mips(change.content, change.top_mip, texture.image_id));
+    }
+    return change_n;
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "common.hpp"
+#include "utils/load_arena.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+
+struct BSP_TEXTURE {
+    daxa::ImageId image_id;
+    int w, h;
+
+    void load(daxa::Device &device, std::string const &tex_name, uint8_t *data, u32 src_channel_n = 4, u32 dst_channel_n = 4, u32 mip_level_count = 4, u32 layer_count = 1);
+    // Copies RGBA mips [top_mip, MIPTEX_MIP_N) of the texture, packed one after the other, into levels [0, MIPTEX_MIP_N - top_mip)
+    // of its image, and leaves them ready to sample
+    void load_levels(daxa::Device &device, std::string const &tex_name, u8 const *data, u32 top_mip);
+    // The same from mips already in `staging_buffer` at `staging_offset`, recorded into a command list of the caller's
+    void record_levels(daxa::CommandList &cmd_list, daxa::BufferId staging_buffer, usize staging_offset, u32 top_mip) const;
+};
+
+// Dense index of an interned texture name
+using TextureHandle = u32;
+static constexpr TextureHandle INVALID_TEXTURE_HANDLE = ~0u;
+
+// Texture names are at most 16 bytes in BSPs and WADs, and are stored zero padded to that
+static constexpr usize TEXTURE_NAME_SIZE = 16;
+using TextureName = std::array<char, TEXTURE_NAME_SIZE>;
+
+enum TextureFlagBits : u8 {
+    // Tool textures (triggers, clips, origin brushes and sky) are never drawn or exported
+    TEXTURE_FLAG_TOOL = 1 << 0,
+    // '{' textures use the blue palette entry as a cutout and are drawn in the masked pass
+    TEXTURE_FLAG_MASKED = 1 << 1,
+};
+
+// Miptexes carry 4 authored mips, each half the size of the one before
+static constexpr u32 MIPTEX_MIP_N = 4;
+// Fresh uploads hold the coarsest mip only, unless every texture is exported in full
+static constexpr u32 MIPTEX_UPLOAD_MIP = EXPORT_ASSETS ? 0 : MIPTEX_MIP_N - 1;
+
+// A miptex as stored in WADs and BSPs: the palette indices of each mip, and the 256 RGB palette entries they refer to
+struct MiptexPixels {
+    std::array<u8 const *, MIPTEX_MIP_N> indices;
+    u8 const *palette;
+    u32 w, h;
+};
+
+inline auto miptex_mip_size(u32 size, u32 mip) -> u32 {
+    return std::max(size >> mip, 1u);
+}
+// Palette indices of mips [0, MIPTEX_MIP_N) of a w x h miptex
+inline auto miptex_index_n(u32 w, u32 h) -> usize {
+    usize result = 0;
+    for (u32 mip = 0; mip < MIPTEX_MIP_N; mip++)
+        result += static_cast<usize>(miptex_mip_size(w, mip)) * miptex_mip_size(h, mip);
+    return result;
+}
+
+// Content hash of a miptex (xxHash over its size, mip 0 indices and palette). 0 stands for no content.
+using TextureContent = u64;
+static constexpr TextureContent NO_TEXTURE_CONTENT = 0;
+auto hash_miptex(MiptexPixels const &pixels) -> TextureContent;
+
+// Every texture name seen in a WAD or BSP, interned once into a stable handle.
+// - Names map to handles through flat open addressing tables (linear probing, power of two size), sharded by
+//   name hash with a mutex each, so concurrent loaders only contend when they hash to the same shard.
+// - Entries live in fixed size segments that never move, so a handle can be dereferenced without locking
+//   once the texture is ready.
+// - Every user holds a reference. The first acquirer of a name (or of a released one) loads it and publishes
+//   it, the others wait for that. Dropping the last reference hands the texture back to be destroyed,
+//   while the name and handle stay interned for the next load.
+// - Uploaded images are deduplicated by content: names whose pixels hash the same alias one image, which is
+//   refcounted by the names using it.
+// - Images no map with resident geometry uses may be evicted for the VRAM budget. The palette indices they were
+//   decoded from are kept, to upload them again when a map needs them.
+// - Images start out with the coarsest authored mip only. Finer mips are uploaded once the camera gets close
+//   enough to need them, and dropped again when it moves away.
+struct TextureRegistry {
+    static constexpr u32 SHARD_N = 16;
+    static constexpr u32 SEGMENT_SIZE = 1024;
+    static constexpr u32 MAX_SEGMENT_N = 256;
+
+    enum struct State : u8 {
+        EMPTY,
+        LOADING,
+        READY,
+    };
+
+    struct Entry {
+        TextureName name;
+        u8 flags;
+        BSP_TEXTURE texture;
+        // Written with content_mutex held, so that images swapped in for a content reach every name using it
+        TextureContent content;
+        std::atomic<State> state;
+        // Guarded by the mutex of the entry's shard
+        u32 ref_count;
+    };
+
+    // Whether the palette indices of each image are kept in RAM, to upload it again after an eviction or with other
+    // mips. Without them images are uploaded with every mip and stay as they are. Set before anything is loaded.
+    bool keep_pixels = true;
+
+    TextureRegistry() = default;
+    TextureRegistry(TextureRegistry const &) = delete;
+    auto operator=(TextureRegistry const &) -> TextureRegistry & = delete;
+
+    // Takes a reference on `name`. If the second value is true the caller has to load the texture and publish() it.
+    auto acquire(std::string_view name) -> std::pair<TextureHandle, bool>;
+    // A private entry for `name` that find() does not return, for an embedded texture whose pixels differ from the
+    // one already interned under that name. The caller holds its only reference and has to publish() it.
+    auto acquire_variant(std::string_view name) -> TextureHandle;
+    // For placeholders, which have no content. Uploaded images are published by publish_content() or add_content().
+    void publish(TextureHandle handle, BSP_TEXTURE const &texture);
+    // Blocks until whoever is loading the texture published it
+    auto wait_ready(TextureHandle handle) const -> BSP_TEXTURE const &;
+    // Drops a reference. Returns the texture when no name uses its image anymore, for the caller to destroy.
+    auto release(TextureHandle handle) -> std::optional<BSP_TEXTURE>;
+
+    // Publishes the already uploaded image with these pixels to `handle`, which then gains a reference. False if there
+    // is none. Its image is empty while evicted. Done under one lock, so an image swapped in meanwhile can't be missed.
+    auto publish_content(TextureHandle handle, TextureContent content) -> bool;
+    // Registers a freshly uploaded image and publishes it to `handle`, and keeps `pixels` if keep_pixels is set. If
+    // another loader registered the same content in the meantime, theirs is published and the caller has to destroy its own.
+    auto add_content(TextureHandle handle, TextureContent content, BSP_TEXTURE const &texture, MiptexPixels const &pixels) -> BSP_TEXTURE;
+    // Every resident image once, however many names alias it
+    auto images() const -> std::vector<daxa::ImageId>;
+
+    // VRAM residency, by content. An image is active while a map with resident geometry uses it. Inactive images
+    // may be evicted, and are uploaded again from their kept pixels once a map activates them.
+    // Returns true if the image is evicted and has to be brought back with record_texture_restore().
+    auto activate(TextureHandle handle) -> bool;
+    void deactivate(TextureHandle handle, u64 frame);
+    // Evicts the inactive image that was used the longest ago, of those with kept pixels, and returns it to be destroyed
+    auto evict_inactive() -> std::optional<daxa::ImageId>;
+    // The pixels an image was uploaded from. Valid while the caller holds a reference to a name using it.
+    auto source(TextureContent content) const -> MiptexPixels;
+    // The mip images are first uploaded from
+    auto upload_mip() const -> u32 {
+        return keep_pixels ? MIPTEX_UPLOAD_MIP : 0;
+    }
+    // Publishes a re-uploaded image to every name that aliases it. False if the image was uploaded again already.
+    auto restore(TextureContent content, daxa::ImageId image_id) -> bool;
+    // False once the image was uploaded again, or no name uses it anymore
+    auto is_evicted(TextureContent content) const -> bool;
+
+    // Mip residency, by content. `wanted` holds the finest mip each content needs this frame, once per content.
+    struct MipChange {
+        TextureContent content;
+        u32 top_mip;
+    };
+    // Fills `changes` with the resident contents lacking the detail they need first, then the ones holding at least
+    // two mips more than they need. At most `max_n`. Allocates nothing once `changes` has grown to fit.
+    void plan_mips(std::span<MipChange const> wanted, u32 max_n, std::vector<MipChange> &changes) const;
+    // Swaps in an image holding mips [top_mip, MIPTEX_MIP_N). Returns the image to destroy: the one replaced, or
+    // `image_id` itself if the content was evicted in the meantime.
+    auto replace_mips(TextureContent content, u32 top_mip, daxa::ImageId image_id) -> daxa::ImageId;
+    auto find(std::string_view name) const -> TextureHandle;
+
+    // Only valid for handles the caller holds a reference to
+    auto operator[](TextureHandle handle) -> BSP_TEXTURE & {
+        return entry(handle).texture;
+    }
+    auto operator[](TextureHandle handle) const -> BSP_TEXTURE const & {
+        return entry(handle).texture;
+    }
+    auto flags(TextureHandle handle) const -> u8 {
+        return entry(handle).flags;
+    }
+    auto is_ready(TextureHandle handle) const -> bool {
+        return entry(handle).state.load(std::memory_order_acquire) == State::READY;
+    }
+    // Only valid once the texture is ready
+    auto content(TextureHandle handle) const -> TextureContent {
+        return entry(handle).content;
+    }
+    auto name(TextureHandle handle) const -> std::string_view;
+    // Handles are [0, size())
+    auto size() const -> u32 {
+        return entry_n.load(std::memory_order_acquire);
+    }
+
+    // Images uploaded and their size with every mip, and what uploading every alias separately would have added on top.
+    // Evicted images count towards image_bytes but not resident_bytes, which only counts the mips resident.
+    struct ContentStats {
+        u32 image_n;
+        u32 alias_n;
+        u64 image_bytes;
+        u64 saved_bytes;
+        u32 evicted_n;
+        u64 resident_bytes;
+        // Resident images by their finest mip
+        std::array<u32, MIPTEX_MIP_N> top_mip_n;
+    };
+    auto content_stats() const -> ContentStats;
+
+  private:
+    struct Shard {
+        mutable std::mutex mutex;
+        // Handles, INVALID_TEXTURE_HANDLE for empty slots
+        std::vector<TextureHandle> slots;
+        u32 count = 0;
+    };
+    std::array<Shard, SHARD_N> shards;
+    std::array<std::atomic<Entry *>, MAX_SEGMENT_N> segments = {};
+    std::array<std::unique_ptr<Entry[]>, MAX_SEGMENT_N> segment_storage;
+    std::mutex segment_mutex;
+    std::atomic<u32> entry_n = 0;
+
+    struct Content {
+        BSP_TEXTURE texture;
+        u32 ref_count;
+        // Maps with resident geometry using it, and when the last of them stopped
+        u32 active_n = 0;
+        u64 inactive_since = 0;
+        // The finest mip the image holds
+        u32 top_mip = MIPTEX_UPLOAD_MIP;
+        // Palette indices of every mip followed by the palette
+        std::vector<u8> pixels;
+    };
+    mutable std::mutex content_mutex;
+    std::unordered_map<TextureContent, Content> contents;
+    ContentStats stats = {};
+
+    auto entry(TextureHandle handle) const -> Entry & {
+        return segments[handle / SEGMENT_SIZE].load(std::memory_order_acquire)[handle % SEGMENT_SIZE];
+    }
+    auto shard_of(TextureName const &key) const -> u32;
+    auto find_slot(Shard const &shard, TextureName const &key) const -> usize;
+    void grow(Shard &shard);
+    auto new_entry(TextureName const &key) -> TextureHandle;
+    // Points every name aliasing `content` at `image_id`. Called with content_mutex held, which keeps their content stable.
+    void set_content_image(TextureContent content, daxa::ImageId image_id);
+    // Called with content_mutex held
+    void publish_locked(Entry &e, BSP_TEXTURE const &texture, TextureContent content);
+};
+
+// Reads a name up to its terminator or 16 bytes, whichever comes first
+auto make_texture_name(std::string_view name) -> TextureName;
+
+// Publishes a miptex to `handle`. Pixels that were uploaded before under any name are aliased, otherwise
+// the mips from upload_mip() on are decoded into `rgba` and uploaded.
+void load_miptex(daxa::Device &device, TextureRegistry &textures, TextureHandle handle, MiptexPixels const &pixels, ScratchBuffer &rgba);
+// Bytes of mips [top_mip, MIPTEX_MIP_N) decoded to RGBA
+auto miptex_rgba_size(MiptexPixels const &pixels, u32 top_mip) -> usize;
+// Uploads an evicted image again from the pixels kept for it, with the mips from MIPTEX_UPLOAD_MIP on. They are decoded
+// into `staging` at `staging_offset` and their copies recorded into `cmd_list`. Returns the bytes staged.
+auto record_texture_restore(daxa::Device &device, TextureRegistry &textures, TextureContent content, daxa::CommandList &cmd_list, daxa::BufferId staging_buffer,
+                            u8 *staging, usize staging_offset) -> usize;
+// Uploads mips [top_mip, MIPTEX_MIP_N) of each change from the kept pixels, decoded straight into `staging`, and swaps
+// them in for the ones resident. The copies are recorded into `cmd_list`, which has to run before anything samples the
+// textures; the images replaced are destroyed once the frames still using them are done.
+// Returns how many changes were made, those that don't fit into the staging buffer are left for another frame.
+auto record_mip_streaming(daxa::Device &device, TextureRegistry &textures, std::span<TextureRegistry::MipChange const> changes, daxa::CommandList &cmd_list,
+                          daxa::BufferId staging_buffer, u8 *staging, usize staging_size, ScratchBuffer &rgba) -> usize;
@@ -1,11 +1,16 @@
 #pragma once
 
 #include "window.hpp"
+#include "shader_watcher.hpp"
+#include "frame_pacer.hpp"
+#include "../ConfigXML.hpp"
 
 #include <thread>
+#include <variant>
 using namespace std::chrono_literals;
 #include <filesystem>
 #include <cmath>
+#include <algorithm>
 
 #include <daxa/utils/imgui.hpp>
 #include <imgui_impl_glfw.h>
@@ -28,11 +33,27 @@ struct BaseApp : AppWindow<T> {
     daxa::Instance daxa_ctx;
     daxa::Device device;
 
+    ConfigXML program_config = load_program_config();
+    // How many frames the CPU may record ahead of the GPU, from config.xml
+    u32 frames_in_flight = std::clamp(program_config.m_iFramesInFlight, 2u, 3u);
+    FramePacer frame_pacer = FramePacer{
+        .limit_fps = program_config.m_iFpsLimit != 0,
+        .target_fps = program_config.m_iFpsLimit != 0 ? static_cast<f32>(program_config.m_iFpsLimit) : 60.0f,
+        .on_demand = program_config.m_bOnDemand,
+    };
+
+    static auto load_program_config() -> ConfigXML {
+        auto config = ConfigXML{};
+        config.LoadProgramConfig();
+        return config;
+    }
+
     daxa::Swapchain swapchain = device.create_swapchain({
         .native_window = AppWindow<T>::get_native_handle(),
         .native_window_platform = AppWindow<T>::get_native_platform(),
-        .present_mode = daxa::PresentMode::IMMEDIATE,
+        .present_mode = program_config.m_bVsync ? daxa::PresentMode::FIFO : daxa::PresentMode::IMMEDIATE,
         .image_usage = daxa::ImageUsageFlagBits::TRANSFER_DST,
+        .max_allowed_frames_in_flight = frames_in_flight,
         .name = APPNAME_PREFIX("swapchain"),
     });
 
@@ -47,6 +68,7 @@ struct BaseApp : AppWindow<T> {
         },
         .name = APPNAME_PREFIX("pipeline_manager"),
     });
+    ShaderWatcher shader_watcher = ShaderWatcher({"shaders", "shared"});
 
     ImFont *mono_font = nullptr;
     ImFont *menu_font = nullptr;
@@ -164,8 +186,18 @@ struct BaseApp : AppWindow<T> {
         ImGui_ImplGlfw_Shutdown();
     }
 
+    void on_window_event() {
+        frame_pacer.mark_dirty();
+    }
+
     auto update() -> bool {
-        glfwPollEvents();
+        if (frame_pacer.should_wait_for_events() || AppWindow<T>::minimized) {
+            glfwWaitEventsTimeout(FramePacer::IDLE_WAIT_SECONDS);
+            // Time spent idle should not show up as one huge frame delta
+            prev_time = Clock::now();
+        } else {
+            glfwPollEvents();
+        }
         if (glfwWindowShouldClose(AppWindow<T>::glfw_window_ptr)) {
             return true;
         }
@@ -174,10 +206,15 @@ struct BaseApp : AppWindow<T> {
         delta_time = std::chrono::duration<f32>(now - prev_time).count();
         prev_time = now;
 
-        if (!AppWindow<T>::minimized) {
+        if (shader_watcher.consume_reload_request()) {
+            // Polling requests come whether or not anything changed
+            if (!std::holds_alternative<daxa::NoPipelineChanged>(pipeline_manager.reload_all()))
+                frame_pacer.mark_dirty();
+        }
+
+        if (!AppWindow<T>::minimized && frame_pacer.should_render()) {
             reinterpret_cast<T *>(this)->on_update();
-        } else {
-            std::this_thread::sleep_for(1ms);
+            frame_pacer.end_frame();
         }
 
         return false;
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <daxa/daxa.hpp>
+using namespace daxa::types;
+
+#include <algorithm>
+#include <cmath>
+
+// Picks a render scale that keeps the measured GPU frame time close to a target.
+// The render targets are sized for `max_scl` once, so changing the scale only
+// shrinks the rendered sub-rect and never recreates images.
+struct DynamicResolution {
+    bool enabled = false;
+    f32 target_frame_ms = 1000.0f / 60.0f;
+    f32 min_scl = 0.5f;
+    f32 max_scl = 1.0f;
+
+    // Only react once the frame time leaves the band [target * (1 - hysteresis), target].
+    f32 hysteresis = 0.15f;
+    // Largest change in scale applied per adjustment.
+    f32 max_step = 0.05f;
+    // Frames to wait after an adjustment so the new scale shows up in the timings.
+    u32 settle_frames = 8;
+
+    f32 smoothed_frame_ms = 0.0f;
+    u32 frames_since_change = 0;
+
+    auto update(f32 gpu_frame_ms, f32 current_scl) -> f32 {
+        if (smoothed_frame_ms == 0.0f) {
+            smoothed_frame_ms = gpu_frame_ms;
+        } else {
+            smoothed_frame_ms += (gpu_frame_ms - smoothed_frame_ms) * 0.1f;
+        }
+        ++frames_since_change;
+
+        if (!enabled || frames_since_change < settle_frames)
+            return current_scl;
+
+        auto const lower_bound_ms = target_frame_ms * (1.0f - hysteresis);
+        if (smoothed_frame_ms <= target_frame_ms && smoothed_frame_ms >= lower_bound_ms)
+            return current_scl;
+
+        // GPU time scales roughly with the pixel count, so with the square of the scale.
+        auto const ideal_scl = current_scl * std::sqrt(target_frame_ms / std::max(smoothed_frame_ms, 0.01f));
+        auto const new_scl = std::clamp(std::clamp(ideal_scl, current_scl - max_step, current_scl + max_step), min_scl, max_scl);
+        if (new_scl != current_scl)
+            frames_since_change = 0;
+        return new_scl;
+    }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <daxa/daxa.hpp>
+using namespace daxa::types;
+
+#include <chrono>
+#include <thread>
+
+// Decides when the main loop renders and how long it sleeps in between.
+// - `limit_fps` caps the frame rate at `target_fps`. The wait is a coarse sleep until shortly
+//   before the deadline followed by a spin, since OS sleeps routinely overshoot by a millisecond or more.
+// - `on_demand` only renders while the frame is dirty (input, window events, settings changes)
+//   plus a few frames after, and otherwise blocks in the event loop instead of spinning.
+struct FramePacer {
+    using Clock = std::chrono::steady_clock;
+
+    // Sleeping closer to the deadline than this is left to the spin loop
+    static constexpr auto SPIN_MARGIN = std::chrono::microseconds(1500);
+    // Upper bound on an idle wait, so work signalled from other threads (e.g. shader reloads) is still picked up
+    static constexpr f64 IDLE_WAIT_SECONDS = 0.25;
+    // Frames rendered after the last dirty event, lets ImGui settle hover and animation state
+    static constexpr u32 LINGER_FRAMES = 3;
+
+    bool limit_fps = false;
+    f32 target_fps = 60.0f;
+    bool on_demand = false;
+
+    u32 dirty_frames = LINGER_FRAMES;
+    Clock::time_point next_frame_time = Clock::now();
+
+    void mark_dirty() {
+        dirty_frames = LINGER_FRAMES;
+    }
+
+    auto should_render() const -> bool {
+        return !on_demand || dirty_frames > 0;
+    }
+
+    // True when the loop has nothing to render and may block until the next event
+    auto should_wait_for_events() const -> bool {
+        return !should_render();
+    }
+
+    void end_frame() {
+        if (dirty_frames > 0)
+            --dirty_frames;
+        if (!limit_fps || target_fps <= 0.0f)
+            return;
+
+        auto const frame_period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<f64>(1.0 / static_cast<f64>(target_fps)));
+        auto now = Clock::now();
+        next_frame_time += frame_period;
+        // Missed the deadline by more than a frame (hitch, idle, or a lowered limit), start over from now
+        if (next_frame_time + frame_period < now) {
+            next_frame_time = now;
+            return;
+        }
+        if (next_frame_time - now > SPIN_MARGIN)
+            std::this_thread::sleep_until(next_frame_time - SPIN_MARGIN);
+        while (Clock::now() < next_frame_time)
+            std::this_thread::yield();
+    }
+};
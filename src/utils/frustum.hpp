@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <array>
+
+// The six planes of a view projection matrix (Gribb & Hartmann), pointing inwards.
+// The near plane is the -w <= z one, which holds for both depth conventions, so nothing in view is rejected.
+struct Frustum {
+    std::array<glm::vec4, 6> planes;
+
+    explicit Frustum(glm::mat4 const &m) {
+        auto const row = [&m](glm::length_t i) { return glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]); };
+        planes = {row(3) + row(0), row(3) - row(0), row(3) + row(1), row(3) - row(1), row(3) + row(2), row(3) - row(2)};
+    }
+
+    // False only when the box is entirely behind one of the planes
+    auto intersects(glm::vec3 const &mins, glm::vec3 const &maxs) const -> bool {
+        for (auto const &p : planes) {
+            auto const corner = glm::vec3(p.x >= 0 ? maxs.x : mins.x, p.y >= 0 ? maxs.y : mins.y, p.z >= 0 ? maxs.z : mins.z);
+            if (glm::dot(glm::vec3(p), corner) + p.w < 0)
+                return false;
+        }
+        return true;
+    }
+};
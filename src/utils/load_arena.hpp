@@ -0,0 +1,90 @@
+#pragma once
+
+#include <daxa/daxa.hpp>
+using namespace daxa::types;
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+// Monotonic allocator for the temporaries of one asset load (lumps, decode buffers, face arrays).
+// Nothing is freed individually: reset() rewinds it for the next load and keeps the blocks, so once
+// the largest map has been seen, loading allocates nothing from the heap.
+struct LoadArena {
+    static constexpr usize BLOCK_SIZE = usize{4} << 20;
+    static constexpr usize ALIGNMENT = 16;
+
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        usize size;
+    };
+    std::vector<Block> blocks;
+    usize block_i = 0;
+    usize block_used = 0;
+    // Bytes handed out since the last reset, and the most there ever were since then
+    usize used = 0;
+    usize peak = 0;
+
+    // Uninitialized storage for `n` Ts
+    template <typename T>
+    auto alloc(usize n) -> std::span<T> {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena memory is never destructed");
+        static_assert(alignof(T) <= ALIGNMENT);
+        auto const size = (n * sizeof(T) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        // Move on to the first block the allocation fits in, adding one when none is left
+        while (block_i < blocks.size() && block_used + size > blocks[block_i].size) {
+            ++block_i;
+            block_used = 0;
+        }
+        if (block_i == blocks.size()) {
+            auto const block_size = std::max(BLOCK_SIZE, size);
+            blocks.push_back({.data = std::make_unique_for_overwrite<std::byte[]>(block_size), .size = block_size});
+            block_used = 0;
+        }
+        auto *const ptr = blocks[block_i].data.get() + block_used;
+        block_used += size;
+        used += size;
+        peak = std::max(peak, used);
+        return {reinterpret_cast<T *>(ptr), n};
+    }
+
+    // Invalidates everything allocated so far
+    void reset() {
+        block_i = 0;
+        block_used = 0;
+        used = 0;
+        peak = 0;
+    }
+
+    auto capacity() const -> usize {
+        usize result = 0;
+        for (auto const &block : blocks)
+            result += block.size;
+        return result;
+    }
+};
+
+// Grow-only buffer reused across decodes, e.g. one texture's RGBA pixels at a time
+struct ScratchBuffer {
+    std::unique_ptr<u8[]> data;
+    usize size = 0;
+
+    // Previous contents are not kept when it grows
+    auto get(usize min_size) -> u8 * {
+        if (min_size > size) {
+            data = std::make_unique_for_overwrite<u8[]>(min_size);
+            size = min_size;
+        }
+        return data.get();
+    }
+};
+
+// Everything a load job reuses from one load to the next
+struct LoadScratch {
+    LoadArena arena;
+    // RGBA pixels decoded from palette indices, one texture at a time
+    ScratchBuffer texture_rgba;
+};
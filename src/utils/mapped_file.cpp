@@ -0,0 +1,71 @@
+#include "mapped_file.hpp"
+
+#include <system_error>
+
+// Kept out of the header, so that <windows.h> and its macros don't leak into everything that reads files
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+auto MappedFile::open(std::filesystem::path const &file_path, bool is_temporary) -> bool {
+    close();
+    path = file_path;
+    temporary = is_temporary;
+#if defined(_WIN32)
+    auto const file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size{};
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        auto const mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr) {
+            mapped = static_cast<u8 const *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping);
+        }
+        mapped_size = mapped != nullptr ? static_cast<usize>(file_size.QuadPart) : 0;
+    }
+    CloseHandle(file);
+#else
+    auto const fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st {};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        auto *const view = mmap(nullptr, static_cast<usize>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (view != MAP_FAILED) {
+            mapped = static_cast<u8 const *>(view);
+            mapped_size = static_cast<usize>(st.st_size);
+        }
+    }
+    ::close(fd);
+#endif
+    return mapped != nullptr;
+}
+
+void MappedFile::close() {
+    if (mapped != nullptr) {
+#if defined(_WIN32)
+        UnmapViewOfFile(mapped);
+#else
+        munmap(const_cast<u8 *>(mapped), mapped_size);
+#endif
+    }
+    mapped = nullptr;
+    mapped_size = 0;
+    if (temporary) {
+        auto ec = std::error_code{};
+        std::filesystem::remove(path, ec);
+        temporary = false;
+    }
+}
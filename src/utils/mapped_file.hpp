@@ -0,0 +1,55 @@
+#pragma once
+
+#include <daxa/daxa.hpp>
+using namespace daxa::types;
+
+#include <filesystem>
+#include <span>
+#include <utility>
+
+// A whole file mapped read-only. Pages are read in on first access, and as they are backed by the file the
+// OS may drop them again under memory pressure instead of swapping them out.
+struct MappedFile {
+    MappedFile() = default;
+    MappedFile(MappedFile const &) = delete;
+    auto operator=(MappedFile const &) -> MappedFile & = delete;
+    MappedFile(MappedFile &&other) noexcept {
+        *this = std::move(other);
+    }
+    auto operator=(MappedFile &&other) noexcept -> MappedFile & {
+        if (this != &other) {
+            close();
+            mapped = std::exchange(other.mapped, nullptr);
+            mapped_size = std::exchange(other.mapped_size, 0);
+            path = std::move(other.path);
+            temporary = std::exchange(other.temporary, false);
+        }
+        return *this;
+    }
+    ~MappedFile() {
+        close();
+    }
+
+    // A temporary file is deleted once it is closed
+    auto open(std::filesystem::path const &file_path, bool is_temporary = false) -> bool;
+    void close();
+
+    auto is_open() const -> bool {
+        return mapped != nullptr;
+    }
+    auto data() const -> u8 const * {
+        return mapped;
+    }
+    auto size() const -> usize {
+        return mapped_size;
+    }
+    auto bytes() const -> std::span<u8 const> {
+        return {mapped, mapped_size};
+    }
+
+  private:
+    u8 const *mapped = nullptr;
+    usize mapped_size = 0;
+    std::filesystem::path path;
+    bool temporary = false;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <daxa/daxa.hpp>
+using namespace daxa::types;
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Number of chunks to split `n` items into, at most one per hardware thread and none smaller than `min_chunk_size`
+inline auto parallel_chunk_count(usize n, usize min_chunk_size) -> usize {
+    auto const thread_n = std::max<usize>(1, std::thread::hardware_concurrency());
+    return std::clamp<usize>(n / std::max<usize>(1, min_chunk_size), 1, thread_n);
+}
+
+// Splits [0, n) into `chunk_n` contiguous ranges in order and calls `fn(chunk_i, begin, end)` for each,
+// the first on the calling thread and the rest on their own threads. Returns once all of them are done.
+// Chunk i always covers the same range for a given n and chunk_n, so per-chunk results can be merged in chunk order.
+template <typename F>
+void parallel_chunks(usize n, usize chunk_n, F const &fn) {
+    chunk_n = std::max<usize>(1, chunk_n);
+    auto const range = [n, chunk_n](usize chunk_i) {
+        return std::pair{n * chunk_i / chunk_n, n * (chunk_i + 1) / chunk_n};
+    };
+    auto threads = std::vector<std::thread>{};
+    threads.reserve(chunk_n - 1);
+    for (usize chunk_i = 1; chunk_i < chunk_n; chunk_i++) {
+        auto const [begin, end] = range(chunk_i);
+        threads.emplace_back([&fn, chunk_i, begin, end]() { fn(chunk_i, begin, end); });
+    }
+    auto const [begin, end] = range(0);
+    fn(usize{0}, begin, end);
+    for (auto &thread : threads)
+        thread.join();
+}
@@ -65,6 +65,10 @@ struct Player3D {
         uint8_t px : 1, py : 1, pz : 1, nx : 1, ny : 1, nz : 1, sprint : 1;
     } move{};
 
+    auto is_moving() const -> bool {
+        return move.px || move.py || move.pz || move.nx || move.ny || move.nz;
+    }
+
     void update(f32 dt) {
         auto delta_pos = speed * dt;
         if (move.sprint)
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Watches the shader source roots on a background thread (inotify on Linux) and only
+// requests a pipeline reload when a file under them actually changes. The main loop
+// applies the request at a frame boundary, so the per-frame cost does not depend on
+// how many shader files or include roots there are.
+// Where it can't watch (other platforms, or inotify unavailable), it requests a reload once per
+// POLL_INTERVAL instead, and the pipeline manager checks the file timestamps itself, like it did every frame.
+struct ShaderWatcher {
+    using Clock = std::chrono::steady_clock;
+
+    // Editors tend to save in several steps, wait for the events to settle before reloading
+    static constexpr auto SETTLE_TIME = std::chrono::milliseconds(50);
+    static constexpr auto POLL_INTERVAL = std::chrono::seconds(1);
+
+    std::atomic<bool> reload_requested = false;
+    std::atomic<Clock::rep> last_event_time = 0;
+    std::atomic<bool> should_stop = false;
+    std::thread watch_thread;
+    // Only touched by the main loop
+    Clock::time_point next_poll = {};
+
+#if defined(__linux__)
+    int inotify_fd = -1;
+    std::unordered_map<int, std::filesystem::path> watched_dirs;
+#endif
+
+    explicit ShaderWatcher(std::vector<std::filesystem::path> const &root_paths) {
+#if defined(__linux__)
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1)
+            return;
+        for (auto const &root_path : root_paths) {
+            auto ec = std::error_code{};
+            if (!std::filesystem::is_directory(root_path, ec))
+                continue;
+            add_watch(root_path);
+            for (auto const &entry : std::filesystem::recursive_directory_iterator(root_path, ec)) {
+                if (entry.is_directory())
+                    add_watch(entry.path());
+            }
+        }
+        watch_thread = std::thread([this]() { watch_loop(); });
+#else
+        (void)root_paths;
+#endif
+    }
+    ShaderWatcher(ShaderWatcher const &) = delete;
+    ShaderWatcher &operator=(ShaderWatcher const &) = delete;
+
+    ~ShaderWatcher() {
+        should_stop = true;
+        if (watch_thread.joinable())
+            watch_thread.join();
+#if defined(__linux__)
+        if (inotify_fd != -1)
+            close(inotify_fd);
+#endif
+    }
+
+    auto consume_reload_request() -> bool {
+        if (!watch_thread.joinable()) {
+            auto const now = Clock::now();
+            if (now < next_poll)
+                return false;
+            next_poll = now + POLL_INTERVAL;
+            return true;
+        }
+        if (!reload_requested.load(std::memory_order_acquire))
+            return false;
+        auto const since_last_event = Clock::now().time_since_epoch().count() - last_event_time.load(std::memory_order_relaxed);
+        if (since_last_event < std::chrono::duration_cast<Clock::duration>(SETTLE_TIME).count())
+            return false;
+        return reload_requested.exchange(false, std::memory_order_acq_rel);
+    }
+
+  private:
+#if defined(__linux__)
+    void add_watch(std::filesystem::path const &dir) {
+        auto const wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+        if (wd != -1)
+            watched_dirs[wd] = dir;
+    }
+
+    void watch_loop() {
+        alignas(inotify_event) char buffer[4096];
+        auto pfd = pollfd{.fd = inotify_fd, .events = POLLIN, .revents = 0};
+        while (!should_stop) {
+            if (poll(&pfd, 1, 100) <= 0)
+                continue;
+            while (true) {
+                auto const read_n = read(inotify_fd, buffer, sizeof(buffer));
+                if (read_n <= 0)
+                    break;
+                for (auto offset = ssize_t{0}; offset < read_n;) {
+                    auto const *event = reinterpret_cast<inotify_event const *>(buffer + offset);
+                    offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+                    if ((event->mask & IN_ISDIR) != 0) {
+                        // New include directories get watched too
+                        if ((event->mask & IN_CREATE) != 0 && event->len > 0 && watched_dirs.contains(event->wd))
+                            add_watch(watched_dirs[event->wd] / event->name);
+                        continue;
+                    }
+                    // Files are picked up once they are fully written
+                    if ((event->mask & IN_CREATE) != 0)
+                        continue;
+                    last_event_time.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+                    reload_requested.store(true, std::memory_order_release);
+                }
+            }
+        }
+    }
+#endif
+};
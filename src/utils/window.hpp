@@ -65,26 +65,51 @@ struct AppWindow {
             glfw_window_ptr,
             [](GLFWwindow *window_ptr, f64 x, f64 y) {
                 auto &app = *reinterpret_cast<App *>(glfwGetWindowUserPointer(window_ptr));
+                app.on_window_event();
                 app.on_mouse_move(static_cast<f32>(x), static_cast<f32>(y));
             });
         glfwSetMouseButtonCallback(
             glfw_window_ptr,
             [](GLFWwindow *window_ptr, i32 key, i32 action, i32) {
                 auto &app = *reinterpret_cast<App *>(glfwGetWindowUserPointer(window_ptr));
+                app.on_window_event();
                 app.on_mouse_button(key, action);
             });
         glfwSetKeyCallback(
             glfw_window_ptr,
             [](GLFWwindow *window_ptr, i32 key, i32, i32 action, i32) {
                 auto &app = *reinterpret_cast<App *>(glfwGetWindowUserPointer(window_ptr));
+                app.on_window_event();
                 app.on_key(key, action);
             });
         glfwSetWindowSizeCallback(
             glfw_window_ptr,
             [](GLFWwindow *window_ptr, i32 sx, i32 sy) {
                 auto &app = *reinterpret_cast<App *>(glfwGetWindowUserPointer(window_ptr));
+                app.on_window_event();
                 app.on_resize(static_cast<u32>(sx), static_cast<u32>(sy));
             });
+        // Events the app itself does not handle (ImGui chains its own callbacks onto these)
+        glfwSetScrollCallback(
+            glfw_window_ptr,
+            [](GLFWwindow *window_ptr, f64, f64) {
+                reinterpret_cast<App *>(glfwGetWindowUserPointer(window_ptr))->on_window_event();
+            });
+        glfwSetCharCallback(
+            glfw_window_ptr,
+            [](GLFWwindow *window_ptr, u32) {
+                reinterpret_cast<App *>(glfwGetWindowUserPointer(window_ptr))->on_window_event();
+            });
+        glfwSetWindowFocusCallback(
+            glfw_window_ptr,
+            [](GLFWwindow *window_ptr, i32) {
+                reinterpret_cast<App *>(glfwGetWindowUserPointer(window_ptr))->on_window_event();
+            });
+        glfwSetWindowRefreshCallback(
+            glfw_window_ptr,
+            [](GLFWwindow *window_ptr) {
+                reinterpret_cast<App *>(glfwGetWindowUserPointer(window_ptr))->on_window_event();
+            });
 
 #if defined(_WIN32)
         {
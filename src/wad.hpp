@@ -2,6 +2,8 @@
 
 #include <vector>
 
+#include "utils/load_arena.hpp"
+
 // Extracted from http://hlbsp.sourceforge.net/index.php?content=waddef
 
 struct WADHEADER {
@@ -20,4 +22,8 @@ struct WADDIRENTRY {
     char szName[16];   // must be null terminated
 };
 
-int wad_load(daxa::Device &device, const std::vector<std::string> &szGamePaths, const std::string &filename);
+struct AssetRegistry;
+struct GameFileSystem;
+
+// The WAD's textures stay referenced, and so loaded, for as long as the registry lives
+int wad_load(daxa::Device &device, GameFileSystem const &files, const std::string &filename, AssetRegistry &assets, LoadScratch &scratch);